@@ -0,0 +1,48 @@
+# Headless benchmark of the tree generator.  Only needs glm, not Qt or OpenGL:
+#   qmake benchmark.pro && make && ./benchmark --json > results.json
+
+TARGET = benchmark
+TEMPLATE = app
+CONFIG += console
+CONFIG -= qt app_bundle
+
+INCLUDEPATH += .. ../glm
+DEPENDPATH += .. ../glm
+
+SOURCES += main.cpp \
+    ../treemaker.cpp \
+    ../lsystem.cpp \
+    ../parametriclsystem.cpp \
+    ../instancestore.cpp \
+    ../templatelibrary.cpp \
+    ../species.cpp \
+    ../forest.cpp \
+    ../forestworker.cpp \
+    ../forestcache.cpp \
+    ../placement.cpp \
+    ../frustum.cpp \
+    ../treemesh.cpp \
+    ../parallel.cpp \
+    recursiveturtle.cpp
+
+HEADERS += ../treemaker.h \
+    ../lsystem.h \
+    ../parametriclsystem.h \
+    ../instancestore.h \
+    ../templatelibrary.h \
+    ../species.h \
+    ../staticlsystem.h \
+    ../random.h \
+    ../forest.h \
+    ../forestworker.h \
+    ../forestcache.h \
+    ../placement.h \
+    ../frustum.h \
+    ../treemesh.h \
+    ../parallel.h \
+    recursiveturtle.h
+
+QMAKE_CXXFLAGS += -std=c++11
+unix:!macx {
+    LIBS += -pthread # std::thread for the parallel L-system derivation and culling
+}
@@ -0,0 +1,997 @@
+/**
+ * Headless benchmark of the tree generator.
+ *
+ * Builds forests with TreeMaker alone, the way Forest does on one thread, for every
+ * combination of iteration count, derivation thread count, tree count and seed, and prints
+ * one row per forest:
+ *
+ *   iterations, threads, trees, seed, derive_ms, interpret_ms, branches, leaves,
+ *   peak_symbols, peak_stream_depth, peak_rss_kb, output_hash
+ *
+ * derive_ms is the time spent in reset and interpret_ms the time spent in makeTree, summed
+ * over the trees.  When streaming the derivation happens inside makeTree, so derive_ms is
+ * next to nothing.  peak_symbols is the longest string any tree's derivation produced, and
+ * is 0 when streaming, since no string is.  peak_stream_depth is then the most frames any
+ * tree's expansion held at once, which is what a streamed tree's memory goes with.
+ * With --repeats the fastest run of each forest is reported.
+ *
+ * Every thread count that is a power of two up to --threads is run.  output_hash is a hash
+ * of every byte of the forest's instances, and a forest whose hash differs from the one
+ * thread build of it is reported on stderr and fails the run.  When more than one count is
+ * run, every one derives through LSystem's tables, so the one thread row times the same
+ * code rather than StaticLSystem, and the iterations go up to MAX_SPECIES_ITERATIONS unless
+ * given, so the longest strings are split between the threads.
+ *
+ * With --per-iteration each forest instead prints one row per iteration of derivation,
+ * from TreeMaker::derivationStats summed over its trees:
+ *
+ *   iterations, threads, trees, seed, iteration, symbols_in, symbols_out, seconds, symbols_per_sec
+ *
+ * symbols_per_sec is of the symbols written, which is what the rewriting costs.
+ *
+ * With --cull it measures frustum culling instead.  Each forest is a box per tree, at
+ * Poisson-disk sites, with a few clusters stacked inside it, culled by ForestBuffers::cull
+ * from a camera standing in the middle and turning on the spot:
+ *
+ *   trees, threads, seed, simd, cull_ms, trees_per_ms, visible_trees, visible_clusters
+ *
+ * cull_ms is the mean time of one cull, and the visible counts are of the last one.  Every
+ * thread count that is a power of two up to --threads is run, each on a WorkerPool that
+ * is started before the culls are timed, as View keeps one.
+ *
+ * With --growth each tree is instead grown one iteration at a time by TreeMaker::grow, and
+ * made again at once by makeTree to check against:
+ *
+ *   iterations, trees, seed, grow_ms, max_step_ms, make_ms, branches, leaves
+ *
+ * grow_ms is the time spent in beginGrowth and grow, summed over the trees, and max_step_ms
+ * the longest single call to grow.  A grown tree must hold the same instances as the made
+ * one, in any order; one that doesn't is reported on stderr and fails the run.
+ *
+ * With --interpret each tree's derived string is read by makeTree's turtle and again by
+ * RecursiveTurtle, the recursive one it replaced:
+ *
+ *   iterations, trees, seed, branches, recursive_ms, iterative_ms,
+ *   recursive_branches_per_sec, iterative_branches_per_sec
+ *
+ * Both times leave the derivation out.  The recursive turtle builds every matrix as it goes,
+ * and the iterative one leaves that to InstanceStore::buildMatrices, which isn't timed.
+ *
+ * With --matrices the branches of each forest are put in one store, as ForestBuffers does,
+ * and their model matrices built three ways:
+ *
+ *   iterations, trees, seed, simd, branches, chain_ms, model_ms, build_ms, speedup
+ *
+ * chain_ms is the scalar glm chain the turtle used to run per branch, translate * rotate *
+ * scale, model_ms InstanceStore::modelMatrix per branch, and build_ms buildMatrices.  Each
+ * is the mean of MATRIX_PASSES passes, and speedup is chain_ms over build_ms.  A build that
+ * differs from modelMatrix in any bit, or a chain that differs by more than rounding, is
+ * reported on stderr and fails the run.
+ */
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "treemaker.h"
+#include "forestworker.h"
+#include "placement.h"
+#include "recursiveturtle.h"
+#include <glm/gtc/matrix_transform.hpp>
+
+// The camera of a culling run turns all the way round over this many culls
+#define CULL_PASSES 64
+// Trees of a culling run are this wide and tall, and split into this many clusters
+#define CULL_TREE_WIDTH 6.0f
+#define CULL_TREE_HEIGHT 12.0f
+#define CULL_CLUSTERS 4
+
+// Times each way of building matrices is run for
+#define MATRIX_PASSES 16
+
+struct Options
+{
+    int minIterations;
+    int maxIterations;
+    std::vector<int> treeCounts;
+    int numSeeds;
+    int repeats;
+    int threads;
+    bool streaming;
+    bool json;
+    bool cull;
+    bool perIteration;
+    bool growth;
+    bool interpret;
+    bool matrices;
+    std::string grammarFile;
+};
+
+struct Result
+{
+    int iterations;
+    int trees;
+    uint64_t seed;
+    double deriveSeconds;
+    double interpretSeconds;
+    size_t branches;
+    size_t leaves;
+    size_t peakSymbols;
+    size_t peakStreamDepth;
+    long peakRSS;
+    int threads;
+    uint64_t hash;
+    // Each iteration's derivation stats, summed over the trees
+    std::vector<LSystem::DeriveStats> iterationStats;
+};
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: benchmark [options]\n"
+            "  --iterations MIN[-MAX]  iteration counts to sweep (default 4-7, or 4-12\n"
+            "                          with --threads)\n"
+            "  --trees N[,N...]        forest sizes to sweep (default 1,10,50)\n"
+            "  --seeds N               seeds 1..N for every forest (default 3)\n"
+            "  --repeats N             runs per forest, the fastest is kept (default 1)\n"
+            "  --threads N             derivation threads per tree; every power of two\n"
+            "                          up to N is run (default 1)\n"
+            "  --streaming             derive on demand while interpreting\n"
+            "  --per-iteration         print symbols/sec for each iteration of derivation\n"
+            "  --grammar FILE          use a parametric grammar; it sets its own iterations\n"
+            "  --json                  print JSON instead of CSV\n"
+            "  --cull                  measure frustum culling; --trees then defaults to\n"
+            "                          10000,100000,1000000\n"
+            "  --growth                grow trees an iteration at a time and check them\n"
+            "                          against makeTree\n"
+            "  --interpret             time the turtle alone, against the recursive one\n"
+            "                          it replaced, in branches/sec\n"
+            "  --matrices              time InstanceStore::buildMatrices against the\n"
+            "                          scalar glm chain\n");
+}
+
+static bool parseOptions(int argc, char *argv[], Options *options)
+{
+    options->minIterations = 0;
+    options->maxIterations = 0;
+    options->treeCounts.clear();
+    options->numSeeds = 3;
+    options->repeats = 1;
+    options->threads = 1;
+    options->streaming = false;
+    options->json = false;
+    options->cull = false;
+    options->perIteration = false;
+    options->growth = false;
+    options->interpret = false;
+    options->matrices = false;
+
+    for(int i = 1; i < argc; i++){
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : 0;
+        bool takesValue = true;
+
+        if(!strcmp(arg, "--streaming")){
+            options->streaming = true;
+            takesValue = false;
+        } else if(!strcmp(arg, "--json")){
+            options->json = true;
+            takesValue = false;
+        } else if(!strcmp(arg, "--cull")){
+            options->cull = true;
+            takesValue = false;
+        } else if(!strcmp(arg, "--per-iteration")){
+            options->perIteration = true;
+            takesValue = false;
+        } else if(!strcmp(arg, "--growth")){
+            options->growth = true;
+            takesValue = false;
+        } else if(!strcmp(arg, "--interpret")){
+            options->interpret = true;
+            takesValue = false;
+        } else if(!strcmp(arg, "--matrices")){
+            options->matrices = true;
+            takesValue = false;
+        } else if(!value){
+            usage();
+            return false;
+        } else if(!strcmp(arg, "--iterations")){
+            int lo, hi;
+            int n = sscanf(value, "%d-%d", &lo, &hi);
+            if(n < 1){
+                usage();
+                return false;
+            }
+            options->minIterations = lo;
+            options->maxIterations = (n == 2) ? hi : lo;
+        } else if(!strcmp(arg, "--trees")){
+            std::stringstream list(value);
+            std::string count;
+            while(std::getline(list, count, ',')){
+                options->treeCounts.push_back(atoi(count.c_str()));
+            }
+        } else if(!strcmp(arg, "--seeds")){
+            options->numSeeds = atoi(value);
+        } else if(!strcmp(arg, "--repeats")){
+            options->repeats = std::max(1, atoi(value));
+        } else if(!strcmp(arg, "--threads")){
+            options->threads = std::max(1, atoi(value));
+        } else if(!strcmp(arg, "--grammar")){
+            options->grammarFile = value;
+        } else {
+            usage();
+            return false;
+        }
+        if(takesValue){
+            i++;
+        }
+    }
+
+    if(options->perIteration && options->streaming){
+        // A streamed tree is never derived as a whole string, so there is nothing to time
+        fprintf(stderr, "--per-iteration can't be used with --streaming\n");
+        return false;
+    }
+    if((options->growth || options->interpret || options->matrices) && !options->grammarFile.empty()){
+        // Growth only knows the built in grammar's '!', and the recursive turtle only its strings
+        fprintf(stderr, "--growth, --interpret and --matrices can't be used with --grammar\n");
+        return false;
+    }
+
+    if(options->treeCounts.empty() && options->cull){
+        options->treeCounts.push_back(10000);
+        options->treeCounts.push_back(100000);
+        options->treeCounts.push_back(1000000);
+    } else if(options->treeCounts.empty()){
+        options->treeCounts.push_back(1);
+        options->treeCounts.push_back(10);
+        options->treeCounts.push_back(50);
+    }
+    // Only the last few iterations have strings long enough to be derived in parallel
+    if(options->maxIterations == 0){
+        options->minIterations = 4;
+        options->maxIterations = (options->threads > 1) ? MAX_SPECIES_ITERATIONS : 7;
+    }
+    return true;
+}
+
+// Forgets the peak resident set size so far, where the OS allows it.  Otherwise the peak
+// only ever grows, and a row's value may come from an earlier, bigger forest.
+static void resetPeakRSS()
+{
+#ifdef __linux__
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if(f){
+        fputs("5", f);
+        fclose(f);
+    }
+#endif
+}
+
+// Peak resident set size in kilobytes
+static long peakRSS()
+{
+#ifdef __linux__
+    // VmHWM is what clear_refs resets, while ru_maxrss never goes down.
+    FILE *f = fopen("/proc/self/status", "r");
+    if(f){
+        char line[256];
+        long kb = -1;
+        while(fgets(line, sizeof(line), f)){
+            if(sscanf(line, "VmHWM: %ld", &kb) == 1){
+                break;
+            }
+        }
+        fclose(f);
+        if(kb >= 0){
+            return kb;
+        }
+    }
+#endif
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+// Mixes every byte of a store's instances into h
+static uint64_t hashStore(uint64_t h, const InstanceStore &store)
+{
+    const float *arrays[] = {(const float *)store.positions(), (const float *)store.orientations(),
+                             store.radii(), store.lengths()};
+    const size_t widths[] = {3, 4, 1, 1};
+    for(int a = 0; a < 4; a++){
+        for(size_t i = 0; i < store.size() * widths[a]; i++){
+            uint32_t bits;
+            memcpy(&bits, arrays[a] + i, sizeof(bits));
+            h = Random::mix(h, bits);
+        }
+    }
+    return Random::mix(h, store.size());
+}
+
+// Every power of two below maxThreads, then maxThreads
+static std::vector<int> threadSweep(int maxThreads)
+{
+    std::vector<int> threadCounts;
+    for(int threads = 1; threads < maxThreads; threads *= 2){
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(maxThreads);
+    return threadCounts;
+}
+
+/**
+ * @brief runForest builds one forest and measures it
+ * The stores of every tree are kept until the forest is done, as Forest keeps them.
+ */
+static Result runForest(TreeMaker &maker, int numTrees, uint64_t seed)
+{
+    Result result = {maker.iterations(), numTrees, seed, 0.0, 0.0, 0, 0, 0, 0, 0, 1, 0,
+                     std::vector<LSystem::DeriveStats>()};
+    std::vector<InstanceStore> branches(numTrees);
+    std::vector<InstanceStore> leaves(numTrees);
+
+    resetPeakRSS();
+    for(int tree = 0; tree < numTrees; tree++){
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        maker.reset(1.0f, &branches[tree], &leaves[tree], Random::mix(seed, tree));
+        std::chrono::steady_clock::time_point derived = std::chrono::steady_clock::now();
+        maker.makeTree();
+        std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now();
+
+        result.deriveSeconds += std::chrono::duration<double>(derived - start).count();
+        result.interpretSeconds += std::chrono::duration<double>(done - derived).count();
+        result.branches += branches[tree].size();
+        result.leaves += leaves[tree].size();
+        result.hash = hashStore(hashStore(result.hash, branches[tree]), leaves[tree]);
+        result.peakStreamDepth = std::max(result.peakStreamDepth, maker.peakStreamDepth());
+
+        const std::vector<LSystem::DeriveStats> &stats = maker.derivationStats();
+        if(result.iterationStats.size() < stats.size()){
+            LSystem::DeriveStats zero = {0, 0, 0.0};
+            result.iterationStats.resize(stats.size(), zero);
+        }
+        for(size_t i = 0; i < stats.size(); i++){
+            result.peakSymbols = std::max(result.peakSymbols, stats[i].symbolsOut);
+            result.iterationStats[i].symbolsIn += stats[i].symbolsIn;
+            result.iterationStats[i].symbolsOut += stats[i].symbolsOut;
+            result.iterationStats[i].seconds += stats[i].seconds;
+        }
+    }
+    result.peakRSS = peakRSS();
+    return result;
+}
+
+// One row per iteration of r's derivation
+static void printIterations(const Result &r, bool json, bool first)
+{
+    for(size_t i = 0; i < r.iterationStats.size(); i++){
+        const LSystem::DeriveStats &s = r.iterationStats[i];
+        double rate = s.seconds > 0.0 ? s.symbolsOut / s.seconds : 0.0;
+        if(json){
+            printf("%s\n  {\"iterations\": %d, \"threads\": %d, \"trees\": %d, \"seed\": %llu, "
+                   "\"iteration\": %zu, \"symbols_in\": %zu, \"symbols_out\": %zu, "
+                   "\"seconds\": %.6f, \"symbols_per_sec\": %.0f}",
+                   (first && i == 0) ? "" : ",", r.iterations, r.threads, r.trees,
+                   (unsigned long long)r.seed, i + 1, s.symbolsIn, s.symbolsOut, s.seconds, rate);
+        } else {
+            printf("%d,%d,%d,%llu,%zu,%zu,%zu,%.6f,%.0f\n",
+                   r.iterations, r.threads, r.trees, (unsigned long long)r.seed,
+                   i + 1, s.symbolsIn, s.symbolsOut, s.seconds, rate);
+        }
+    }
+}
+
+static void printResult(const Result &r, bool json, bool first)
+{
+    if(json){
+        printf("%s\n  {\"iterations\": %d, \"threads\": %d, \"trees\": %d, \"seed\": %llu, "
+               "\"derive_ms\": %.3f, \"interpret_ms\": %.3f, \"branches\": %zu, \"leaves\": %zu, "
+               "\"peak_symbols\": %zu, \"peak_stream_depth\": %zu, \"peak_rss_kb\": %ld, "
+               "\"output_hash\": \"%016llx\"}",
+               first ? "" : ",", r.iterations, r.threads, r.trees, (unsigned long long)r.seed,
+               r.deriveSeconds * 1000.0, r.interpretSeconds * 1000.0,
+               r.branches, r.leaves, r.peakSymbols, r.peakStreamDepth, r.peakRSS, (unsigned long long)r.hash);
+    } else {
+        printf("%d,%d,%d,%llu,%.3f,%.3f,%zu,%zu,%zu,%zu,%ld,%016llx\n",
+               r.iterations, r.threads, r.trees, (unsigned long long)r.seed,
+               r.deriveSeconds * 1000.0, r.interpretSeconds * 1000.0,
+               r.branches, r.leaves, r.peakSymbols, r.peakStreamDepth, r.peakRSS, (unsigned long long)r.hash);
+    }
+}
+
+struct CullResult
+{
+    int trees;
+    int threads;
+    uint64_t seed;
+    double seconds;
+    size_t visibleTrees;
+    size_t visibleClusters;
+};
+
+// The widest SIMD path Frustum::cull was built with
+static const char *simdName()
+{
+#if defined(__AVX__)
+    return "avx";
+#elif defined(__SSE__)
+    return "sse";
+#else
+    return "none";
+#endif
+}
+
+/**
+ * @brief buildCullForest fills forest with just what culling reads
+ * Every tree is a box standing on its site, its clusters being slabs of it one above the
+ * other, each covering as many branches as ForestBuffers gives a cluster.
+ */
+static void buildCullForest(int numTrees, uint64_t seed, ForestBuffers *forest)
+{
+    // Room for rather more trees than asked, so the sites stop at numTrees rather than
+    // at the edge
+    float side = CULL_TREE_WIDTH * 1.5f * sqrtf((float)numTrees);
+    std::vector<float> spacings(1, CULL_TREE_WIDTH);
+    Placement placement;
+    placement.scatter(side, side, spacings, seed, numTrees);
+    const std::vector<glm::vec2> &sites = placement.sites();
+
+    forest->clear();
+    for(size_t t = 0; t < sites.size(); t++){
+        TreeParts parts = {(uint32_t)forest->clusters.size(), CULL_CLUSTERS, 0, 0, 64 * CULL_CLUSTERS, 0, 0, 0, 0, 0};
+        forest->trees.push_back(parts);
+
+        glm::vec3 lo(sites[t].x - CULL_TREE_WIDTH / 2, 0.0f, sites[t].y - CULL_TREE_WIDTH / 2);
+        glm::vec3 hi(sites[t].x + CULL_TREE_WIDTH / 2, CULL_TREE_HEIGHT, sites[t].y + CULL_TREE_WIDTH / 2);
+        forest->treeBounds.append(lo, hi);
+
+        for(int c = 0; c < CULL_CLUSTERS; c++){
+            BranchCluster cluster = {(uint32_t)(forest->clusters.size() * 64), 64};
+            forest->clusters.push_back(cluster);
+            glm::vec3 slabLo(lo.x, CULL_TREE_HEIGHT * c / CULL_CLUSTERS, lo.z);
+            glm::vec3 slabHi(hi.x, CULL_TREE_HEIGHT * (c + 1) / CULL_CLUSTERS, hi.z);
+            forest->clusterBounds.append(slabLo, slabHi);
+        }
+    }
+}
+
+/**
+ * @brief runCull culls the forest CULL_PASSES times, from the middle of it
+ * The camera is set up like View's, eye high, turning a little between culls.
+ */
+static CullResult runCull(const ForestBuffers &forest, WorkerPool *pool, uint64_t seed)
+{
+    CullResult result = {(int)forest.trees.size(), pool->numThreads(), seed, 0.0, 0, 0};
+    glm::mat4x4 projection = glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, 1.0f, 150.0f);
+    VisibleSet visible;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(int pass = 0; pass < CULL_PASSES; pass++){
+        float angle = 2.0f * glm::pi<float>() * pass / CULL_PASSES;
+        glm::vec3 eye(0.0f, 2.0f, 0.0f);
+        glm::vec3 look(cosf(angle), -0.05f, sinf(angle));
+        glm::mat4x4 view = glm::lookAt(eye, eye + look, glm::vec3(0.0f, 1.0f, 0.0f));
+        forest.cull(Frustum(projection * view), &visible, pool);
+    }
+    std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now();
+
+    result.seconds = std::chrono::duration<double>(done - start).count() / CULL_PASSES;
+    result.visibleTrees = visible.numTrees;
+    result.visibleClusters = visible.numClusters;
+    return result;
+}
+
+static void printCullResult(const CullResult &r, bool json, bool first)
+{
+    double ms = r.seconds * 1000.0;
+    if(json){
+        printf("%s\n  {\"trees\": %d, \"threads\": %d, \"seed\": %llu, \"simd\": \"%s\", "
+               "\"cull_ms\": %.4f, \"trees_per_ms\": %.0f, \"visible_trees\": %zu, "
+               "\"visible_clusters\": %zu}",
+               first ? "" : ",", r.trees, r.threads, (unsigned long long)r.seed, simdName(),
+               ms, r.trees / ms, r.visibleTrees, r.visibleClusters);
+    } else {
+        printf("%d,%d,%llu,%s,%.4f,%.0f,%zu,%zu\n",
+               r.trees, r.threads, (unsigned long long)r.seed, simdName(),
+               ms, r.trees / ms, r.visibleTrees, r.visibleClusters);
+    }
+}
+
+// The culling benchmark, in place of the generator's
+static int benchmarkCulling(const Options &options)
+{
+    if(options.json){
+        printf("[");
+    } else {
+        printf("trees,threads,seed,simd,cull_ms,trees_per_ms,visible_trees,visible_clusters\n");
+    }
+
+    std::vector<int> threadCounts = threadSweep(options.threads);
+
+    bool first = true;
+    ForestBuffers forest;
+    for(size_t t = 0; t < options.treeCounts.size(); t++){
+        for(int seed = 1; seed <= options.numSeeds; seed++){
+            buildCullForest(options.treeCounts[t], seed, &forest);
+            for(size_t c = 0; c < threadCounts.size(); c++){
+                WorkerPool pool(threadCounts[c]);
+                CullResult best = runCull(forest, &pool, seed);
+                for(int r = 1; r < options.repeats; r++){
+                    CullResult run = runCull(forest, &pool, seed);
+                    if(run.seconds < best.seconds){
+                        best = run;
+                    }
+                }
+                printCullResult(best, options.json, first);
+                first = false;
+                fflush(stdout);
+            }
+        }
+    }
+
+    if(options.json){
+        printf("\n]\n");
+    }
+    return 0;
+}
+
+// Every bit of one instance
+typedef std::array<uint32_t, 9> InstanceBits;
+
+// The instances of a store in a fixed order, whatever order they were stored in
+static std::vector<InstanceBits> sortedInstances(const InstanceStore &store)
+{
+    std::vector<InstanceBits> instances(store.size());
+    for(size_t i = 0; i < store.size(); i++){
+        memcpy(&instances[i][0], &store.positions()[i], 3 * sizeof(float));
+        memcpy(&instances[i][3], &store.orientations()[i], 4 * sizeof(float));
+        memcpy(&instances[i][7], &store.radii()[i], sizeof(float));
+        memcpy(&instances[i][8], &store.lengths()[i], sizeof(float));
+    }
+    std::sort(instances.begin(), instances.end());
+    return instances;
+}
+
+struct GrowthResult
+{
+    int iterations;
+    int trees;
+    uint64_t seed;
+    double growSeconds;
+    double maxStepSeconds;
+    double makeSeconds;
+    size_t branches;
+    size_t leaves;
+    // Set when every grown tree matched the made one
+    bool same;
+};
+
+/**
+ * @brief runGrowth grows a forest with beginGrowth and grow, and makes it again with makeTree
+ */
+static GrowthResult runGrowth(TreeMaker &maker, int numTrees, uint64_t seed)
+{
+    GrowthResult result = {maker.iterations(), numTrees, seed, 0.0, 0.0, 0.0, 0, 0, true};
+    InstanceStore grownBranches, grownLeaves, madeBranches, madeLeaves;
+
+    for(int tree = 0; tree < numTrees; tree++){
+        uint64_t treeSeed = Random::mix(seed, tree);
+        grownBranches.clear();
+        grownLeaves.clear();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        maker.beginGrowth(1.0f, &grownBranches, &grownLeaves, treeSeed);
+        for(int i = 1; i <= result.iterations; i++){
+            std::chrono::steady_clock::time_point stepStart = std::chrono::steady_clock::now();
+            maker.grow(i == result.iterations);
+            double step = std::chrono::duration<double>(std::chrono::steady_clock::now() - stepStart).count();
+            result.maxStepSeconds = std::max(result.maxStepSeconds, step);
+        }
+        std::chrono::steady_clock::time_point grown = std::chrono::steady_clock::now();
+
+        madeBranches.clear();
+        madeLeaves.clear();
+        maker.reset(1.0f, &madeBranches, &madeLeaves, treeSeed);
+        maker.makeTree();
+        std::chrono::steady_clock::time_point made = std::chrono::steady_clock::now();
+
+        result.growSeconds += std::chrono::duration<double>(grown - start).count();
+        result.makeSeconds += std::chrono::duration<double>(made - grown).count();
+        result.branches += grownBranches.size();
+        result.leaves += grownLeaves.size();
+        if(sortedInstances(grownBranches) != sortedInstances(madeBranches) ||
+           sortedInstances(grownLeaves) != sortedInstances(madeLeaves)){
+            fprintf(stderr, "%d iterations, seed %llu, tree %d: grown tree differs from makeTree's\n",
+                    result.iterations, (unsigned long long)seed, tree);
+            result.same = false;
+        }
+    }
+    return result;
+}
+
+static void printGrowthResult(const GrowthResult &r, bool json, bool first)
+{
+    if(json){
+        printf("%s\n  {\"iterations\": %d, \"trees\": %d, \"seed\": %llu, \"grow_ms\": %.3f, "
+               "\"max_step_ms\": %.3f, \"make_ms\": %.3f, \"branches\": %zu, \"leaves\": %zu}",
+               first ? "" : ",", r.iterations, r.trees, (unsigned long long)r.seed,
+               r.growSeconds * 1000.0, r.maxStepSeconds * 1000.0, r.makeSeconds * 1000.0,
+               r.branches, r.leaves);
+    } else {
+        printf("%d,%d,%llu,%.3f,%.3f,%.3f,%zu,%zu\n",
+               r.iterations, r.trees, (unsigned long long)r.seed,
+               r.growSeconds * 1000.0, r.maxStepSeconds * 1000.0, r.makeSeconds * 1000.0,
+               r.branches, r.leaves);
+    }
+}
+
+// The growth benchmark, in place of the generator's
+static int benchmarkGrowth(const Options &options)
+{
+    if(options.json){
+        printf("[");
+    } else {
+        printf("iterations,trees,seed,grow_ms,max_step_ms,make_ms,branches,leaves\n");
+    }
+
+    TreeMaker maker;
+    maker.setDerivationThreads(options.threads);
+    bool first = true;
+    bool same = true;
+    for(int iterations = options.minIterations; iterations <= options.maxIterations; iterations++){
+        maker.setIterations(iterations);
+        for(size_t t = 0; t < options.treeCounts.size(); t++){
+            for(int seed = 1; seed <= options.numSeeds; seed++){
+                GrowthResult best = runGrowth(maker, options.treeCounts[t], seed);
+                for(int r = 1; r < options.repeats; r++){
+                    GrowthResult run = runGrowth(maker, options.treeCounts[t], seed);
+                    if(run.growSeconds < best.growSeconds){
+                        best = run;
+                    }
+                }
+                printGrowthResult(best, options.json, first);
+                first = false;
+                same = same && best.same;
+                fflush(stdout);
+            }
+        }
+    }
+
+    if(options.json){
+        printf("\n]\n");
+    }
+    return same ? 0 : 1;
+}
+
+struct InterpretResult
+{
+    int iterations;
+    int trees;
+    uint64_t seed;
+    size_t branches;
+    double recursiveSeconds;
+    double iterativeSeconds;
+};
+
+/**
+ * @brief runInterpret times both turtles on every tree of a forest
+ * The stores are kept until the forest is done, as runForest keeps them, so both turtles
+ * pay for growing theirs.
+ */
+static InterpretResult runInterpret(TreeMaker &maker, int numTrees, uint64_t seed)
+{
+    InterpretResult result = {maker.iterations(), numTrees, seed, 0, 0.0, 0.0};
+    std::vector<InstanceStore> branches(numTrees);
+    std::vector<InstanceStore> leaves(numTrees);
+    std::vector<std::deque<glm::mat4x4> > branchMatrices(numTrees);
+    std::vector<std::deque<glm::mat4x4> > leafMatrices(numTrees);
+    RecursiveTurtle recursive;
+
+    for(int tree = 0; tree < numTrees; tree++){
+        uint64_t treeSeed = Random::mix(seed, tree);
+        maker.reset(1.0f, &branches[tree], &leaves[tree], treeSeed);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        maker.makeTree();
+        std::chrono::steady_clock::time_point iterated = std::chrono::steady_clock::now();
+        recursive.makeTree(maker.derivedString(), &branchMatrices[tree], &leafMatrices[tree], (unsigned)treeSeed);
+        std::chrono::steady_clock::time_point recursed = std::chrono::steady_clock::now();
+
+        result.iterativeSeconds += std::chrono::duration<double>(iterated - start).count();
+        result.recursiveSeconds += std::chrono::duration<double>(recursed - iterated).count();
+        result.branches += branches[tree].size();
+    }
+    return result;
+}
+
+static void printInterpretResult(const InterpretResult &r, bool json, bool first)
+{
+    if(json){
+        printf("%s\n  {\"iterations\": %d, \"trees\": %d, \"seed\": %llu, \"branches\": %zu, "
+               "\"recursive_ms\": %.3f, \"iterative_ms\": %.3f, \"recursive_branches_per_sec\": %.0f, "
+               "\"iterative_branches_per_sec\": %.0f}",
+               first ? "" : ",", r.iterations, r.trees, (unsigned long long)r.seed, r.branches,
+               r.recursiveSeconds * 1000.0, r.iterativeSeconds * 1000.0,
+               r.branches / r.recursiveSeconds, r.branches / r.iterativeSeconds);
+    } else {
+        printf("%d,%d,%llu,%zu,%.3f,%.3f,%.0f,%.0f\n",
+               r.iterations, r.trees, (unsigned long long)r.seed, r.branches,
+               r.recursiveSeconds * 1000.0, r.iterativeSeconds * 1000.0,
+               r.branches / r.recursiveSeconds, r.branches / r.iterativeSeconds);
+    }
+}
+
+// The turtle benchmark, in place of the generator's
+static int benchmarkInterpret(const Options &options)
+{
+    if(options.json){
+        printf("[");
+    } else {
+        printf("iterations,trees,seed,branches,recursive_ms,iterative_ms,"
+               "recursive_branches_per_sec,iterative_branches_per_sec\n");
+    }
+
+    TreeMaker maker;
+    bool first = true;
+    for(int iterations = options.minIterations; iterations <= options.maxIterations; iterations++){
+        maker.setIterations(iterations);
+        for(size_t t = 0; t < options.treeCounts.size(); t++){
+            for(int seed = 1; seed <= options.numSeeds; seed++){
+                InterpretResult best = runInterpret(maker, options.treeCounts[t], seed);
+                for(int r = 1; r < options.repeats; r++){
+                    InterpretResult run = runInterpret(maker, options.treeCounts[t], seed);
+                    best.recursiveSeconds = std::min(best.recursiveSeconds, run.recursiveSeconds);
+                    best.iterativeSeconds = std::min(best.iterativeSeconds, run.iterativeSeconds);
+                }
+                printInterpretResult(best, options.json, first);
+                first = false;
+                fflush(stdout);
+            }
+        }
+    }
+
+    if(options.json){
+        printf("\n]\n");
+    }
+    return 0;
+}
+
+struct MatrixResult
+{
+    int iterations;
+    int trees;
+    uint64_t seed;
+    size_t branches;
+    double chainSeconds;
+    double modelSeconds;
+    double buildSeconds;
+    // Set when buildMatrices matched modelMatrix bit for bit, and the chain matched it but
+    // for rounding
+    bool same;
+};
+
+// The scalar chain the turtle used to build a branch's matrix with
+static glm::mat4x4 chainMatrix(const InstanceStore &store, size_t i)
+{
+    float radius = store.radii()[i];
+    return glm::translate(glm::mat4x4(1.0f), store.positions()[i])
+            * glm::mat4_cast(store.orientations()[i])
+            * glm::scale(glm::mat4x4(1.0f), glm::vec3(radius, radius, store.lengths()[i]));
+}
+
+/**
+ * @brief runMatrices builds the matrices of a forest's branches every way, MATRIX_PASSES times each
+ */
+static MatrixResult runMatrices(const InstanceStore &branches, int iterations, int numTrees, uint64_t seed)
+{
+    MatrixResult result = {iterations, numTrees, seed, branches.size(), 0.0, 0.0, 0.0, true};
+    size_t n = branches.size();
+    std::vector<glm::mat4x4> chain(n), model(n), built(n);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(int pass = 0; pass < MATRIX_PASSES; pass++){
+        for(size_t i = 0; i < n; i++){
+            chain[i] = chainMatrix(branches, i);
+        }
+    }
+    std::chrono::steady_clock::time_point chained = std::chrono::steady_clock::now();
+    for(int pass = 0; pass < MATRIX_PASSES; pass++){
+        for(size_t i = 0; i < n; i++){
+            model[i] = branches.modelMatrix(i);
+        }
+    }
+    std::chrono::steady_clock::time_point modeled = std::chrono::steady_clock::now();
+    for(int pass = 0; pass < MATRIX_PASSES; pass++){
+        branches.buildMatrices(built.data());
+    }
+    std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now();
+
+    result.chainSeconds = std::chrono::duration<double>(chained - start).count() / MATRIX_PASSES;
+    result.modelSeconds = std::chrono::duration<double>(modeled - chained).count() / MATRIX_PASSES;
+    result.buildSeconds = std::chrono::duration<double>(done - modeled).count() / MATRIX_PASSES;
+    result.same = (n == 0 || memcmp(model.data(), built.data(), n * sizeof(glm::mat4x4)) == 0);
+    for(size_t i = 0; i < n; i++){
+        for(int col = 0; col < 4; col++){
+            glm::vec4 error = glm::abs(chain[i][col] - model[i][col]);
+            glm::vec4 bound = 1e-5f * (glm::abs(model[i][col]) + 1.0f);
+            result.same = result.same && glm::all(glm::lessThanEqual(error, bound));
+        }
+    }
+    return result;
+}
+
+static void printMatrixResult(const MatrixResult &r, bool json, bool first)
+{
+    if(json){
+        printf("%s\n  {\"iterations\": %d, \"trees\": %d, \"seed\": %llu, \"simd\": \"%s\", "
+               "\"branches\": %zu, \"chain_ms\": %.4f, \"model_ms\": %.4f, \"build_ms\": %.4f, "
+               "\"speedup\": %.2f}",
+               first ? "" : ",", r.iterations, r.trees, (unsigned long long)r.seed, simdName(),
+               r.branches, r.chainSeconds * 1000.0, r.modelSeconds * 1000.0, r.buildSeconds * 1000.0,
+               r.chainSeconds / r.buildSeconds);
+    } else {
+        printf("%d,%d,%llu,%s,%zu,%.4f,%.4f,%.4f,%.2f\n",
+               r.iterations, r.trees, (unsigned long long)r.seed, simdName(),
+               r.branches, r.chainSeconds * 1000.0, r.modelSeconds * 1000.0, r.buildSeconds * 1000.0,
+               r.chainSeconds / r.buildSeconds);
+    }
+}
+
+// The matrix building benchmark, in place of the generator's
+static int benchmarkMatrices(const Options &options)
+{
+    if(options.json){
+        printf("[");
+    } else {
+        printf("iterations,trees,seed,simd,branches,chain_ms,model_ms,build_ms,speedup\n");
+    }
+
+    TreeMaker maker;
+    bool first = true;
+    bool same = true;
+    InstanceStore branches, treeBranches, treeLeaves;
+    for(int iterations = options.minIterations; iterations <= options.maxIterations; iterations++){
+        maker.setIterations(iterations);
+        for(size_t t = 0; t < options.treeCounts.size(); t++){
+            for(int seed = 1; seed <= options.numSeeds; seed++){
+                branches.clear();
+                for(int tree = 0; tree < options.treeCounts[t]; tree++){
+                    treeBranches.clear();
+                    treeLeaves.clear();
+                    maker.reset(1.0f, &treeBranches, &treeLeaves, Random::mix(seed, tree));
+                    maker.makeTree();
+                    branches.append(treeBranches);
+                }
+
+                MatrixResult best = runMatrices(branches, iterations, options.treeCounts[t], seed);
+                for(int r = 1; r < options.repeats; r++){
+                    MatrixResult run = runMatrices(branches, iterations, options.treeCounts[t], seed);
+                    best.chainSeconds = std::min(best.chainSeconds, run.chainSeconds);
+                    best.modelSeconds = std::min(best.modelSeconds, run.modelSeconds);
+                    best.buildSeconds = std::min(best.buildSeconds, run.buildSeconds);
+                }
+                if(!best.same){
+                    fprintf(stderr, "%d iterations, %d trees, seed %d: the matrices differ from modelMatrix\n",
+                            iterations, options.treeCounts[t], seed);
+                    same = false;
+                }
+                printMatrixResult(best, options.json, first);
+                first = false;
+                fflush(stdout);
+            }
+        }
+    }
+
+    if(options.json){
+        printf("\n]\n");
+    }
+    return same ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    if(!parseOptions(argc, argv, &options)){
+        return 1;
+    }
+
+    if(options.cull){
+        return benchmarkCulling(options);
+    }
+    if(options.growth){
+        return benchmarkGrowth(options);
+    }
+    if(options.interpret){
+        return benchmarkInterpret(options);
+    }
+    if(options.matrices){
+        return benchmarkMatrices(options);
+    }
+
+    TreeMaker maker;
+    maker.setStreaming(options.streaming);
+
+    if(!options.grammarFile.empty()){
+        std::ifstream file(options.grammarFile.c_str());
+        if(!file){
+            fprintf(stderr, "can't open %s\n", options.grammarFile.c_str());
+            return 1;
+        }
+        std::stringstream source;
+        source << file.rdbuf();
+        std::string error;
+        if(!maker.setGrammar(source.str(), &error)){
+            fprintf(stderr, "%s: %s\n", options.grammarFile.c_str(), error.c_str());
+            return 1;
+        }
+        // The grammar decides how deep it goes, so there is nothing to sweep.
+        options.maxIterations = options.minIterations;
+    }
+
+    if(options.json){
+        printf("[");
+    } else if(options.perIteration){
+        printf("iterations,threads,trees,seed,iteration,symbols_in,symbols_out,seconds,symbols_per_sec\n");
+    } else {
+        printf("iterations,threads,trees,seed,derive_ms,interpret_ms,branches,leaves,"
+               "peak_symbols,peak_stream_depth,peak_rss_kb,output_hash\n");
+    }
+
+    std::vector<int> threadCounts = threadSweep(options.threads);
+    maker.setCompiledRules(threadCounts.size() == 1);
+    bool first = true;
+    bool identical = true;
+    for(int iterations = options.minIterations; iterations <= options.maxIterations; iterations++){
+        maker.setIterations(iterations);
+        for(size_t t = 0; t < options.treeCounts.size(); t++){
+            for(int seed = 1; seed <= options.numSeeds; seed++){
+                uint64_t serialHash = 0;
+                for(size_t c = 0; c < threadCounts.size(); c++){
+                    maker.setDerivationThreads(threadCounts[c]);
+                    Result best = runForest(maker, options.treeCounts[t], seed);
+                    for(int r = 1; r < options.repeats; r++){
+                        Result run = runForest(maker, options.treeCounts[t], seed);
+                        if(run.deriveSeconds + run.interpretSeconds < best.deriveSeconds + best.interpretSeconds){
+                            best = run;
+                        }
+                    }
+                    best.threads = threadCounts[c];
+                    // A grammar's trees report its own iteration count.
+                    if(!options.grammarFile.empty()){
+                        best.iterations = (int)maker.derivationStats().size();
+                    }
+                    if(options.perIteration){
+                        printIterations(best, options.json, first);
+                        first = first && best.iterationStats.empty();
+                    } else {
+                        printResult(best, options.json, first);
+                        first = false;
+                    }
+                    fflush(stdout);
+
+                    // More threads must only make it faster, never different
+                    if(c == 0){
+                        serialHash = best.hash;
+                    } else if(best.hash != serialHash){
+                        fprintf(stderr, "%d iterations, %d trees, seed %d: %d threads differ from 1\n",
+                                best.iterations, best.trees, seed, best.threads);
+                        identical = false;
+                    }
+                }
+            }
+        }
+    }
+
+    if(options.json){
+        printf("\n]\n");
+    }
+    return identical ? 0 : 1;
+}
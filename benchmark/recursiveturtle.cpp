@@ -0,0 +1,124 @@
+#include "recursiveturtle.h"
+#include <math.h>
+#include <stdlib.h>
+#include <glm/gtc/matrix_transform.hpp>
+
+#define DEG_TO_RAD (M_PI / 180)
+
+// Generates a random float between 0.0 and 1.0.
+static float randomFloat(){
+    return static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
+}
+
+void RecursiveTurtle::makeTree(const std::string &symbols, std::deque<glm::mat4x4> *shapeTransformations,
+                               std::deque<glm::mat4x4> *leafTransformations, unsigned seed)
+{
+    m_shapeTransformations = shapeTransformations;
+    m_leafTransformations = leafTransformations;
+    L_string = symbols.c_str();
+    L_index = 0;
+    current_branch_radius = 1.0f;
+    phi_rotations.clear();
+    theta_rotations.clear();
+    branch_size_ratios.clear();
+
+    srand(seed);
+    phi_rotations.push_front(0.0);
+    theta_rotations.push_front(0.0);
+    branch_size_ratios.push_front(1.0);
+    m_x = randomFloat() * 30.0 - 15.0;
+    m_y = randomFloat() * 30.0 - 15.0;
+    handleBranch(glm::mat4x4(1.0));
+}
+
+void RecursiveTurtle::handleBranch(glm::mat4x4 current_total_transformation){
+    while(L_string[L_index] != '\0'){
+
+        if(L_string[L_index] == '['){
+
+            float phi = phi_rotations.front();
+            phi_rotations.pop_front();
+            float theta = theta_rotations.front();
+            theta_rotations.pop_front();
+
+            float branch_size_ratio = branch_size_ratios.front();
+            branch_size_ratios.pop_front();
+            current_branch_radius *= branch_size_ratio;
+
+            // The randomly generated length of this branch will be between 5 and 15 times the diameter.
+            float length = (randomFloat() * 10.0 + 5.0) * current_branch_radius;
+
+            glm::mat4x4 coord_translation = glm::translate(glm::mat4x4(1.0), glm::vec3(0.0f, 0.0f, length));
+            glm::mat4x4 cyl_translation = glm::translate(glm::mat4x4(1.0), glm::vec3(0.0, 0.0, length / 2));
+            glm::mat4x4 rotation = glm::rotate(glm::mat4x4(1.0), phi, glm::vec3(sin(theta), cos(theta), 0.0));
+            glm::mat4x4 scale = glm::scale(glm::mat4x4(1.0), glm::vec3(current_branch_radius, current_branch_radius, length));
+
+            glm::mat4x4 branch_trans = current_total_transformation * rotation * cyl_translation;
+            glm::mat4x4 coord_trans = current_total_transformation * rotation * coord_translation;
+
+            m_shapeTransformations->push_front(glm::translate(glm::mat4x4(1.0), glm::vec3(m_x, -5, m_y))
+                        * glm::rotate(glm::mat4x4(1.0), (float)(-90.0 * DEG_TO_RAD), glm::vec3(1,0,0)) * branch_trans * scale);
+
+            L_index++;
+            handleBranch(coord_trans);
+
+            current_branch_radius /= branch_size_ratio;
+
+        } else if(L_string[L_index] == 'a'){
+            float phi = randomFloat() * 60 * DEG_TO_RAD;
+            float theta = randomFloat() * 360 * DEG_TO_RAD;
+
+            phi_rotations.push_front(phi);
+            theta_rotations.push_front(theta);
+            branch_size_ratios.push_front(.75);
+        } else if(L_string[L_index] == 'b'){
+            float theta1 = randomFloat() * 360 * DEG_TO_RAD;
+            float theta2 = theta1 + (180 * DEG_TO_RAD);
+
+            float ratio1 = randomFloat() * .6 + .3;
+            float ratio2 = 1.2 - ratio1;
+
+            float phi1 = (1.0 - ratio1) * 45 * DEG_TO_RAD;
+            float phi2 = (1.0 - ratio2) * 45 * DEG_TO_RAD;
+
+            phi_rotations.push_front(phi1);
+            phi_rotations.push_front(phi2);
+            theta_rotations.push_front(theta1);
+            theta_rotations.push_front(theta2);
+            branch_size_ratios.push_front(ratio1);
+            branch_size_ratios.push_front(ratio2);
+        } else if(L_string[L_index] == 'c'){
+            float theta1 = randomFloat() * 360 * DEG_TO_RAD;
+            float theta2 = theta1 + (randomFloat() * 125 + 35) * DEG_TO_RAD;
+            float theta3 = theta2 + (randomFloat() * 125 + 35) * DEG_TO_RAD;
+
+            float phi1 = (randomFloat() * 55 + 25) * DEG_TO_RAD;
+            float phi2 = (randomFloat() * 55 + 25) * DEG_TO_RAD;
+            float phi3 = (randomFloat() * 55 + 25) * DEG_TO_RAD;
+
+            float ratio1 = randomFloat() * .45 + .25;
+            float ratio2 = randomFloat() * .45 + .25;
+            float ratio3 = randomFloat() * .45 + .25;
+
+            phi_rotations.push_front(phi1);
+            phi_rotations.push_front(phi2);
+            phi_rotations.push_front(phi3);
+            theta_rotations.push_front(theta1);
+            theta_rotations.push_front(theta2);
+            theta_rotations.push_front(theta3);
+            branch_size_ratios.push_front(ratio1);
+            branch_size_ratios.push_front(ratio2);
+            branch_size_ratios.push_front(ratio3);
+        } else if(L_string[L_index] == 'x'){
+            float phi = randomFloat() * 30 * DEG_TO_RAD;
+            float theta = randomFloat() * 360 * DEG_TO_RAD;
+
+            glm::mat4x4 rotation = glm::rotate(glm::mat4x4(1.0), phi, glm::vec3(sin(theta), cos(theta), 0.0));
+            m_leafTransformations->push_front(rotation * current_total_transformation);
+        } else if(L_string[L_index] == ']'){
+            return;
+        }
+
+        L_index++;
+    }
+}
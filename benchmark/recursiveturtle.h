@@ -0,0 +1,43 @@
+#ifndef RECURSIVETURTLE_H
+#define RECURSIVETURTLE_H
+
+#include <deque>
+#include <string>
+#include "instancestore.h"
+
+/**
+ * The turtle TreeMaker had before it was made iterative, kept as a baseline for the
+ * benchmark's --interpret mode.
+ *
+ * It recurses once per '[', passing the frame as a mat4 by value, keeps the parameters of
+ * coming branches in three deques used as stacks, builds every branch's matrix on the spot
+ * and draws from rand().  Its trees are of the same size as TreeMaker's for the same string
+ * but not of the same shape.
+ */
+class RecursiveTurtle
+{
+public:
+    // Interprets symbols, appending a matrix per branch and per leaf
+    void makeTree(const std::string &symbols, std::deque<glm::mat4x4> *shapeTransformations,
+                  std::deque<glm::mat4x4> *leafTransformations, unsigned seed);
+
+private:
+    void handleBranch(glm::mat4x4 current_total_transformation);
+
+    std::deque<glm::mat4x4> *m_shapeTransformations;
+    std::deque<glm::mat4x4> *m_leafTransformations;
+
+    const char *L_string;
+    size_t L_index;
+
+    float m_x, m_y;
+
+    // Only ever use push/pop_front on these, turns them into a stack.
+    std::deque<float> phi_rotations;
+    std::deque<float> theta_rotations;
+    std::deque<float> branch_size_ratios;
+
+    float current_branch_radius;
+};
+
+#endif // RECURSIVETURTLE_H
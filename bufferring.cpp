@@ -0,0 +1,117 @@
+#include "bufferring.h"
+#include <algorithm>
+
+// How long each wait on a fence may block before it is tried again, in nanoseconds
+#define FENCE_TIMEOUT 1000000
+
+BufferRing::BufferRing(GLenum target, size_t regionSize)
+{
+    m_target = target;
+    m_buffer = 0;
+    m_regionSize = 0;
+    m_persistent = false;
+    m_mapping = 0;
+    m_region = BUFFER_RING_REGIONS - 1;
+    for(int i = 0; i < BUFFER_RING_REGIONS; i++){
+        m_fences[i] = 0;
+    }
+
+    allocate(regionSize);
+}
+
+BufferRing::~BufferRing()
+{
+    release();
+}
+
+/**
+ * @brief BufferRing::allocate makes a new buffer with room for every region
+ * Any old buffer must have been released first.
+ */
+void BufferRing::allocate(size_t regionSize)
+{
+    // Whole blocks of 256 bytes, which keeps every region aligned for any use of the buffer
+    m_regionSize = std::max((regionSize + 255) & ~(size_t)255, (size_t)256);
+    m_persistent = GLEW_ARB_buffer_storage;
+
+    glGenBuffers(1, &m_buffer);
+    glBindBuffer(m_target, m_buffer);
+    size_t size = m_regionSize * BUFFER_RING_REGIONS;
+    if(m_persistent){
+        // Coherent, so writes are seen by the GPU without flushing
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(m_target, size, 0, flags);
+        m_mapping = (char *)glMapBufferRange(m_target, 0, size, flags);
+    } else {
+        glBufferData(m_target, size, 0, GL_STREAM_DRAW);
+    }
+    glBindBuffer(m_target, 0);
+}
+
+void BufferRing::release()
+{
+    for(int i = 0; i < BUFFER_RING_REGIONS; i++){
+        wait(i);
+    }
+    if(m_mapping){
+        glBindBuffer(m_target, m_buffer);
+        glUnmapBuffer(m_target);
+        glBindBuffer(m_target, 0);
+        m_mapping = 0;
+    }
+    glDeleteBuffers(1, &m_buffer);
+    m_buffer = 0;
+}
+
+// Blocks until the GPU is done with the reads fenced in region.
+void BufferRing::wait(int region)
+{
+    GLsync fence = m_fences[region];
+    if(!fence){
+        return;
+    }
+    // The first wait flushes, so that the fence is sure to be reached.
+    GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+    GLenum result;
+    do {
+        result = glClientWaitSync(fence, flags, FENCE_TIMEOUT);
+        flags = 0;
+    } while(result == GL_TIMEOUT_EXPIRED);
+    glDeleteSync(fence);
+    m_fences[region] = 0;
+}
+
+void *BufferRing::map(size_t size)
+{
+    if(size > m_regionSize){
+        // Half again as big as asked, so slow growth doesn't reallocate every frame
+        release();
+        allocate(size + size / 2);
+    }
+
+    m_region = (m_region + 1) % BUFFER_RING_REGIONS;
+    wait(m_region);
+
+    size_t offset = m_region * m_regionSize;
+    if(m_persistent){
+        return m_mapping + offset;
+    }
+    glBindBuffer(m_target, m_buffer);
+    return glMapBufferRange(m_target, offset, m_regionSize,
+                            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+}
+
+size_t BufferRing::unmap()
+{
+    if(!m_persistent){
+        glUnmapBuffer(m_target);
+        glBindBuffer(m_target, 0);
+    }
+    return m_region * m_regionSize;
+}
+
+void BufferRing::fence()
+{
+    // A region is only written again after wait, so it never has two fences.
+    m_fences[m_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
@@ -0,0 +1,63 @@
+#ifndef BUFFERRING_H
+#define BUFFERRING_H
+
+#include "Common.h"
+
+// How many regions a ring rotates through: one being written, and up to two more frames
+// the GPU may still be reading.
+#define BUFFER_RING_REGIONS 3
+
+/**
+ * A GL buffer for data that is written anew every frame, split into regions that are
+ * written in turn.
+ *
+ * Writing a region only waits on the fence of the frame that last read it, three frames
+ * back, which has almost always passed.  Re-uploading one buffer with glBufferData would
+ * instead wait on the frame before, or have the driver copy the data.
+ *
+ * With GL_ARB_buffer_storage the whole buffer is mapped once, persistently and coherently,
+ * and map only has to wait and return a pointer.  Without it each region is mapped with
+ * glMapBufferRange, unsynchronized since the fences already keep the GPU off it.
+ *
+ * A frame goes map, write, unmap, then draw from buffer() at the offset unmap returned,
+ * then fence.
+ */
+class BufferRing
+{
+public:
+    BufferRing(GLenum target, size_t regionSize);
+    ~BufferRing();
+
+    // Waits for the next region to be free, and returns where to write size bytes.  The
+    // regions are made bigger first if they are too small.
+    void *map(size_t size);
+
+    // Done writing.  Returns the byte offset in buffer() where the data starts.
+    size_t unmap();
+
+    // Marks the end of the draws that read the region last unmapped.
+    void fence();
+
+    GLuint buffer() const { return m_buffer; }
+    size_t regionSize() const { return m_regionSize; }
+    bool persistent() const { return m_persistent; }
+
+private:
+    void allocate(size_t regionSize);
+    void release();
+    void wait(int region);
+
+    GLenum m_target;
+    GLuint m_buffer;
+    size_t m_regionSize;
+    bool m_persistent;
+    // The whole buffer, when it is mapped persistently
+    char *m_mapping;
+
+    // The region being written, or last written
+    int m_region;
+    // Set once the GPU has been given reads of a region, until they are known to be done
+    GLsync m_fences[BUFFER_RING_REGIONS];
+};
+
+#endif // BUFFERRING_H
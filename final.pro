@@ -20,6 +20,19 @@ SOURCES += main.cpp \
     glhlib_2_1_win/source/TCylinder2.cpp \
     glhlib_2_1_win/source/3DGraphicsLibrarySmall.cpp \
     treemaker.cpp \
+    lsystem.cpp \
+    parametriclsystem.cpp \
+    instancestore.cpp \
+    forest.cpp \
+    forestworker.cpp \
+    forestcache.cpp \
+    placement.cpp \
+    bufferring.cpp \
+    frustum.cpp \
+    parallel.cpp \
+    templatelibrary.cpp \
+    species.cpp \
+    treemesh.cpp \
     skybox.cpp
 
 HEADERS += mainwindow.h \
@@ -180,6 +193,21 @@ HEADERS += mainwindow.h \
     glhlib_2_1_win/source/glhlib.h \
     glhlib_2_1_win/source/3DGraphicsLibrarySmall.h \
     treemaker.h \
+    lsystem.h \
+    parametriclsystem.h \
+    instancestore.h \
+    random.h \
+    forest.h \
+    forestworker.h \
+    forestcache.h \
+    placement.h \
+    bufferring.h \
+    frustum.h \
+    parallel.h \
+    templatelibrary.h \
+    species.h \
+    staticlsystem.h \
+    treemesh.h \
     skybox.h
 
 FORMS += mainwindow.ui
@@ -188,6 +216,7 @@ FORMS += mainwindow.ui
 # If on linux
 unix:!macx {
     QMAKE_CXXFLAGS += -std=c++11 # Why does this break glm on mac?
+    LIBS += -pthread # std::thread for the parallel L-system derivation
 }
 # For local development
 #QMAKE_CXXFLAGS += -stdlib=libc++ # Use Clang's c++11 library # Or don't, thanks Apple
@@ -204,7 +233,10 @@ DEPENDPATH+=/usr/local/Cellar/glew/1.11.0/include
 
 OTHER_FILES += \
     shaders/shader.frag \
-    shaders/shader.vert
+    shaders/shader.vert \
+    shaders/leaf.frag \
+    shaders/leaf.vert \
+    species.txt
 
 RESOURCES += \
     resources.qrc
@@ -0,0 +1,206 @@
+#include "forest.h"
+#include "forestcache.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+// How many symbols the turtle reads between looks at the clock
+#define SLICE_SYMBOLS 512
+
+Forest::Forest()
+{
+    m_templates = 0;
+    m_species.assign(1, Species());
+    m_seed = 0;
+    m_numFinished = 0;
+    m_treeStarted = false;
+
+    // Streaming lets a tree be started without deriving it first.
+    m_maker.setStreaming(true);
+}
+
+uint64_t Forest::treeSeed(uint64_t forestSeed, int tree)
+{
+    return Random::mix(forestSeed, tree);
+}
+
+void Forest::generate(int numTrees, uint64_t seed, int numThreads)
+{
+    m_branches.assign(numTrees, InstanceStore());
+    m_leaves.assign(numTrees, InstanceStore());
+    m_templateRefs.assign(numTrees, std::vector<TemplateRef>());
+    m_seed = seed;
+
+    std::vector<int> trees(numTrees);
+    for(int tree = 0; tree < numTrees; tree++){
+        trees[tree] = tree;
+    }
+    build(trees, numThreads);
+}
+
+void Forest::regenerate(const std::vector<int> &trees, int numThreads)
+{
+    for(size_t i = 0; i < trees.size(); i++){
+        m_branches[trees[i]].clear();
+        m_leaves[trees[i]].clear();
+        m_templateRefs[trees[i]].clear();
+    }
+    build(trees, numThreads);
+}
+
+/**
+ * @brief Forest::build builds the given trees
+ * Each worker owns a TreeMaker and keeps taking the next unbuilt tree until none are left.
+ */
+void Forest::build(const std::vector<int> &trees, int numThreads)
+{
+    int numTrees = (int)trees.size();
+    if(numThreads < 1){
+        numThreads = 1;
+    }
+    if(numThreads > numTrees){
+        numThreads = numTrees;
+    }
+
+    std::atomic<int> next(0);
+    auto worker = [&](){
+        TreeMaker treemaker;
+        int i;
+        while((i = next++) < numTrees){
+            startTree(treemaker, trees[i]);
+            treemaker.makeTree();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for(int t = 1; t < numThreads; t++){
+        workers.push_back(std::thread(worker));
+    }
+    worker();
+    for(size_t t = 0; t < workers.size(); t++){
+        workers[t].join();
+    }
+}
+
+// Sets maker up for one tree and resets it.
+void Forest::startTree(TreeMaker &maker, int tree)
+{
+    const Species &species = treeSpecies(tree);
+    maker.setSpecies(species);
+    maker.setTemplates(species == Species() ? m_templates : 0, &m_templateRefs[tree]);
+    if(tree < (int)m_sites.size()){
+        maker.setPosition(m_sites[tree].x, m_sites[tree].y);
+    } else {
+        maker.clearPosition();
+    }
+    maker.reset(species.trunkRadius, &m_branches[tree], &m_leaves[tree], treeSeed(m_seed, tree));
+}
+
+void Forest::setSpecies(const std::vector<Species> &species)
+{
+    if(species.empty()){
+        m_species.assign(1, Species());
+    } else {
+        m_species = species;
+    }
+}
+
+void Forest::changedTrees(const std::vector<Species> &species, std::vector<int> *trees) const
+{
+    Species builtIn;
+    trees->clear();
+    for(int tree = 0; tree < numTrees(); tree++){
+        const Species &s = species.empty() ? builtIn : species[tree % species.size()];
+        if(s != treeSpecies(tree)){
+            trees->push_back(tree);
+        }
+    }
+}
+
+void Forest::begin(int numTrees, uint64_t seed)
+{
+    m_branches.assign(numTrees, InstanceStore());
+    m_leaves.assign(numTrees, InstanceStore());
+    m_templateRefs.assign(numTrees, std::vector<TemplateRef>());
+    m_seed = seed;
+    m_numFinished = 0;
+    m_treeStarted = false;
+}
+
+/**
+ * @brief Forest::advance builds trees in order until the time is up
+ * The turtle is run in short slices between looks at the clock, and a tree that isn't
+ * done when time runs out is carried on with on the next call.  With templates or a
+ * grammar the string can't be streamed, and each slice before the turtle's is instead
+ * one iteration of its derivation.
+ */
+bool Forest::advance(int microseconds)
+{
+    std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() + std::chrono::microseconds(microseconds);
+
+    while(m_numFinished < numTrees()){
+        int tree = m_numFinished;
+        if(!m_treeStarted){
+            startTree(m_maker, tree);
+            m_maker.beginTree();
+            m_treeStarted = true;
+        }
+        if(m_maker.advance(SLICE_SYMBOLS)){
+            m_numFinished++;
+            m_treeStarted = false;
+        }
+        if(std::chrono::steady_clock::now() >= deadline){
+            break;
+        }
+    }
+    return m_numFinished == numTrees();
+}
+
+void Forest::load(const ForestCache &cache)
+{
+    int numTrees = cache.numTrees();
+    m_branches.assign(numTrees, InstanceStore());
+    m_leaves.assign(numTrees, InstanceStore());
+    m_templateRefs.assign(numTrees, std::vector<TemplateRef>());
+    m_seed = cache.header().seed;
+
+    for(int tree = 0; tree < numTrees; tree++){
+        const ForestCacheTree &t = cache.tree(tree);
+        m_branches[tree].assign(cache.branchPositions() + t.firstBranch, cache.branchOrientations() + t.firstBranch,
+                                cache.branchRadii() + t.firstBranch, cache.branchLengths() + t.firstBranch,
+                                cache.branchInfo() + t.firstBranch, t.numBranches);
+        m_leaves[tree].assign(cache.leafPositions() + t.firstLeaf, cache.leafOrientations() + t.firstLeaf,
+                              cache.leafRadii() + t.firstLeaf, cache.leafLengths() + t.firstLeaf,
+                              0, t.numLeaves);
+        m_templateRefs[tree].assign(cache.templateRefs() + t.firstRef,
+                                    cache.templateRefs() + t.firstRef + t.numRefs);
+    }
+
+    m_numFinished = numTrees;
+    m_treeStarted = false;
+}
+
+void Forest::merge(InstanceStore *branches, InstanceStore *leaves) const
+{
+    size_t numBranches = branches->size();
+    size_t numLeaves = leaves->size();
+    for(size_t i = 0; i < m_branches.size(); i++){
+        numBranches += m_branches[i].size();
+        numLeaves += m_leaves[i].size();
+    }
+    branches->reserve(numBranches);
+    leaves->reserve(numLeaves);
+
+    for(size_t i = 0; i < m_branches.size(); i++){
+        branches->append(m_branches[i]);
+        leaves->append(m_leaves[i]);
+    }
+}
+
+void Forest::mergeTemplateRefs(std::vector<TemplateRef> *refs) const
+{
+    for(size_t i = 0; i < m_templateRefs.size(); i++){
+        refs->insert(refs->end(), m_templateRefs[i].begin(), m_templateRefs[i].end());
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef FOREST_H
+#define FOREST_H
+
+#include "treemaker.h"
+
+class ForestCache;
+
+/**
+ * Builds a forest of trees on a pool of worker threads.
+ *
+ * Every tree is seeded from the forest seed and its own index alone, and the trees are
+ * merged in index order, so the same seed gives the same forest for any thread count.
+ */
+class Forest
+{
+public:
+    Forest();
+
+    // Generates numTrees trees using up to numThreads threads.
+    void generate(int numTrees, uint64_t seed, int numThreads);
+
+    // Generates the trees a slice at a time on the calling thread, for when there are no
+    // threads to spare.  begin sets the forest up, then each call to advance builds for
+    // about the given number of microseconds.  The result is the same as generate's.
+    void begin(int numTrees, uint64_t seed);
+
+    // Returns true once every tree is done.
+    bool advance(int microseconds);
+
+    // How many trees, from the first on, are done.  They may be used while the rest are built.
+    int numFinished() const { return m_numFinished; }
+
+    // Replaces the trees with those of an open cache, finished as if by generate.  The
+    // templates and species must be set as they were when the cache was written.
+    void load(const ForestCache &cache);
+
+    // Appends every tree, in order, to the given stores.
+    void merge(InstanceStore *branches, InstanceStore *leaves) const;
+
+    // Makes the trees refer to the library's templates for their last iterations.  Null
+    // grows whole trees again.  The library must outlive any generate that uses it.
+    void setTemplates(const TemplateLibrary *library) { m_templates = library; }
+
+    // Gives the trees their species.  Tree i is of species i % species.size(), and an
+    // empty list means the built in species.  Only trees of the built in species use
+    // templates, since those are grown from it.
+    void setSpecies(const std::vector<Species> &species);
+    const Species &treeSpecies(int tree) const { return m_species[tree % m_species.size()]; }
+
+    // Plants tree i at sites[i] on the ground, as from Placement.  Trees past the end of
+    // sites, and every tree when it is empty, stand where their seed puts them.
+    void setSites(const std::vector<glm::vec2> &sites) { m_sites = sites; }
+    const std::vector<glm::vec2> &sites() const { return m_sites; }
+
+    // Lists the trees that would come out differently under species.
+    void changedTrees(const std::vector<Species> &species, std::vector<int> *trees) const;
+
+    // Rebuilds only the given trees, with the seed of the last generate.
+    void regenerate(const std::vector<int> &trees, int numThreads);
+
+    // Appends the template references of every tree, in order.
+    void mergeTemplateRefs(std::vector<TemplateRef> *refs) const;
+
+    int numTrees() const { return (int)m_branches.size(); }
+    const InstanceStore &treeBranches(int tree) const { return m_branches[tree]; }
+    const InstanceStore &treeLeaves(int tree) const { return m_leaves[tree]; }
+    const std::vector<TemplateRef> &treeTemplateRefs(int tree) const { return m_templateRefs[tree]; }
+    const TemplateLibrary *templates() const { return m_templates; }
+    uint64_t seed() const { return m_seed; }
+
+    // The seed tree i of a forest is built from
+    static uint64_t treeSeed(uint64_t forestSeed, int tree);
+
+private:
+    void build(const std::vector<int> &trees, int numThreads);
+    void startTree(TreeMaker &maker, int tree);
+
+    // One entry per tree
+    std::vector<InstanceStore> m_branches;
+    std::vector<InstanceStore> m_leaves;
+    std::vector<std::vector<TemplateRef> > m_templateRefs;
+
+    const TemplateLibrary *m_templates;
+    std::vector<Species> m_species;
+    std::vector<glm::vec2> m_sites;
+    uint64_t m_seed;
+
+    // State of a time sliced generation
+    TreeMaker m_maker;
+    int m_numFinished;
+    bool m_treeStarted;
+};
+
+#endif // FOREST_H
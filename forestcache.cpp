@@ -0,0 +1,425 @@
+#include "forestcache.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <time.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+static const char MAGIC[4] = {'T', 'R', 'E', 'E'};
+
+// Rounds offset up to the alignment of every array
+static uint64_t align(uint64_t offset)
+{
+    return (offset + 15) & ~(uint64_t)15;
+}
+
+ForestCache::ForestCache()
+{
+    m_data = 0;
+    m_size = 0;
+}
+
+ForestCache::~ForestCache()
+{
+    close();
+}
+
+// Mixes the bits of a float into h
+static uint64_t mixFloat(uint64_t h, float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return Random::mix(h, bits);
+}
+
+uint64_t ForestCache::key(int numTrees, uint64_t seed, const TemplateLibrary *templates,
+                          const std::vector<Species> &species, const std::vector<glm::vec2> &sites)
+{
+    uint64_t h = Random::mix(FOREST_CACHE_VERSION, numTrees);
+    h = Random::mix(h, seed);
+    if(templates){
+        h = Random::mix(h, templates->iterations());
+        h = Random::mix(h, templates->numTemplates());
+        h = Random::mix(h, templates->seed());
+    }
+    // No species means the built in one, as in Forest::setSpecies
+    h = Random::mix(h, species.size());
+    if(species.empty()){
+        h = Random::mix(h, Species().hash());
+    }
+    for(size_t i = 0; i < species.size(); i++){
+        h = Random::mix(h, species[i].hash());
+    }
+    h = Random::mix(h, sites.size());
+    for(size_t i = 0; i < sites.size(); i++){
+        h = mixFloat(mixFloat(h, sites[i].x), sites[i].y);
+    }
+    return h;
+}
+
+std::string ForestCache::path(const std::string &directory, uint64_t key)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "forest-%016llx.cache", (unsigned long long)key);
+    return directory.empty() ? std::string(name) : directory + "/" + name;
+}
+
+// Whether name is one that path makes
+static bool isCacheName(const std::string &name)
+{
+    static const char prefix[] = "forest-", suffix[] = ".cache";
+    size_t p = sizeof(prefix) - 1, s = sizeof(suffix) - 1;
+    return name.size() > p + s && name.compare(0, p, prefix) == 0 &&
+           name.compare(name.size() - s, s, suffix) == 0;
+}
+
+/**
+ * @brief ForestCache::evict keeps the cache directory from growing without end
+ * The files are ordered by when they were last written or opened, and the oldest are
+ * deleted.  Only names path makes are counted, so nothing else in the directory is touched.
+ */
+void ForestCache::evict(const std::string &directory, int maxFiles)
+{
+    std::string prefix = directory.empty() ? std::string() : directory + "/";
+    std::vector<std::pair<time_t, std::string> > files;
+
+#ifdef _WIN32
+    WIN32_FIND_DATAA found;
+    HANDLE search = FindFirstFileA((prefix + "forest-*.cache").c_str(), &found);
+    if(search == INVALID_HANDLE_VALUE){
+        return;
+    }
+    do {
+        if(isCacheName(found.cFileName)){
+            // 100ns ticks, which sort the same as seconds would
+            ULARGE_INTEGER ticks;
+            ticks.LowPart = found.ftLastWriteTime.dwLowDateTime;
+            ticks.HighPart = found.ftLastWriteTime.dwHighDateTime;
+            files.push_back(std::make_pair((time_t)(ticks.QuadPart / 10000000), prefix + found.cFileName));
+        }
+    } while(FindNextFileA(search, &found));
+    FindClose(search);
+#else
+    DIR *dir = opendir(directory.empty() ? "." : directory.c_str());
+    if(!dir){
+        return;
+    }
+    while(struct dirent *entry = readdir(dir)){
+        struct stat info;
+        std::string filename = prefix + entry->d_name;
+        if(isCacheName(entry->d_name) && stat(filename.c_str(), &info) == 0){
+            files.push_back(std::make_pair(info.st_mtime, filename));
+        }
+    }
+    closedir(dir);
+#endif
+
+    if((int)files.size() <= maxFiles){
+        return;
+    }
+    std::sort(files.begin(), files.end());
+    for(size_t i = 0; i + maxFiles < files.size(); i++){
+        remove(files[i].second.c_str());
+    }
+}
+
+static bool writeBytes(FILE *file, const void *data, size_t size)
+{
+    return size == 0 || fwrite(data, 1, size, file) == size;
+}
+
+// Writes size bytes of data at offset, padding the file out to offset first.
+static bool writeAt(FILE *file, uint64_t offset, const void *data, size_t size)
+{
+    static const char zeros[16] = {0};
+    long position = ftell(file);
+    if(position < 0 || (uint64_t)position > offset || offset - position > sizeof(zeros) ||
+       !writeBytes(file, zeros, (size_t)(offset - position))){
+        return false;
+    }
+    return writeBytes(file, data, size);
+}
+
+/**
+ * @brief ForestCache::write saves every tree of forest
+ * The arrays are laid out once from the counts, then each tree's part of each array is
+ * written in turn.  The file is written under a temporary name and renamed when done, so
+ * a reader never maps half a forest.
+ */
+bool ForestCache::write(const std::string &filename, const Forest &forest, uint64_t key)
+{
+    int numTrees = forest.numTrees();
+    // Value initialized, which zeroes the padding too, so the same forest always writes
+    // the same bytes
+    std::vector<ForestCacheTree> trees(numTrees, ForestCacheTree());
+    uint64_t numBranches = 0, numLeaves = 0, numRefs = 0;
+    for(int t = 0; t < numTrees; t++){
+        const InstanceStore &branches = forest.treeBranches(t);
+        const InstanceStore &leaves = forest.treeLeaves(t);
+        const std::vector<TemplateRef> &refs = forest.treeTemplateRefs(t);
+
+        ForestCacheTree &tree = trees[t];
+        tree.seed = Forest::treeSeed(forest.seed(), t);
+        tree.firstBranch = numBranches;
+        tree.numBranches = branches.size();
+        tree.firstLeaf = numLeaves;
+        tree.numLeaves = leaves.size();
+        tree.firstRef = numRefs;
+        tree.numRefs = refs.size();
+        numBranches += branches.size();
+        numLeaves += leaves.size();
+        numRefs += refs.size();
+    }
+
+    ForestCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = FOREST_CACHE_VERSION;
+    header.key = key;
+    header.seed = forest.seed();
+    header.numTrees = numTrees;
+    header.headerSize = sizeof(ForestCacheHeader);
+    header.numBranches = numBranches;
+    header.numLeaves = numLeaves;
+    header.numRefs = numRefs;
+
+    uint64_t offset = sizeof(ForestCacheHeader);
+    uint64_t *const offsets[] = {
+        &header.treesOffset,
+        &header.branchPositionsOffset, &header.branchOrientationsOffset,
+        &header.branchRadiiOffset, &header.branchLengthsOffset, &header.branchInfoOffset,
+        &header.leafPositionsOffset, &header.leafOrientationsOffset,
+        &header.leafRadiiOffset, &header.leafLengthsOffset,
+        &header.refsOffset
+    };
+    const uint64_t sizes[] = {
+        numTrees * sizeof(ForestCacheTree),
+        numBranches * sizeof(glm::vec3), numBranches * sizeof(glm::quat),
+        numBranches * sizeof(float), numBranches * sizeof(float), numBranches * sizeof(BranchInfo),
+        numLeaves * sizeof(glm::vec3), numLeaves * sizeof(glm::quat),
+        numLeaves * sizeof(float), numLeaves * sizeof(float),
+        numRefs * sizeof(TemplateRef)
+    };
+    for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++){
+        offset = align(offset);
+        *offsets[i] = offset;
+        offset += sizes[i];
+    }
+    header.fileSize = offset;
+
+    std::string temporary = filename + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if(!file){
+        return false;
+    }
+
+    bool ok = writeAt(file, 0, &header, sizeof(header)) &&
+              writeAt(file, header.treesOffset, trees.data(), sizes[0]);
+
+    // Each array is the trees' arrays back to back, so after the padding in front of it
+    // every tree's part follows on from the last.
+    ok = ok && writeAt(file, header.branchPositionsOffset, 0, 0);
+    for(int t = 0; ok && t < numTrees; t++){
+        const InstanceStore &b = forest.treeBranches(t);
+        ok = writeBytes(file, b.positions(), b.size() * sizeof(glm::vec3));
+    }
+    ok = ok && writeAt(file, header.branchOrientationsOffset, 0, 0);
+    for(int t = 0; ok && t < numTrees; t++){
+        const InstanceStore &b = forest.treeBranches(t);
+        ok = writeBytes(file, b.orientations(), b.size() * sizeof(glm::quat));
+    }
+    ok = ok && writeAt(file, header.branchRadiiOffset, 0, 0);
+    for(int t = 0; ok && t < numTrees; t++){
+        const InstanceStore &b = forest.treeBranches(t);
+        ok = writeBytes(file, b.radii(), b.size() * sizeof(float));
+    }
+    ok = ok && writeAt(file, header.branchLengthsOffset, 0, 0);
+    for(int t = 0; ok && t < numTrees; t++){
+        const InstanceStore &b = forest.treeBranches(t);
+        ok = writeBytes(file, b.lengths(), b.size() * sizeof(float));
+    }
+    ok = ok && writeAt(file, header.branchInfoOffset, 0, 0);
+    for(int t = 0; ok && t < numTrees; t++){
+        const InstanceStore &b = forest.treeBranches(t);
+        ok = b.size() == 0 || writeBytes(file, &b.info(0), b.size() * sizeof(BranchInfo));
+    }
+    ok = ok && writeAt(file, header.leafPositionsOffset, 0, 0);
+    for(int t = 0; ok && t < numTrees; t++){
+        const InstanceStore &l = forest.treeLeaves(t);
+        ok = writeBytes(file, l.positions(), l.size() * sizeof(glm::vec3));
+    }
+    ok = ok && writeAt(file, header.leafOrientationsOffset, 0, 0);
+    for(int t = 0; ok && t < numTrees; t++){
+        const InstanceStore &l = forest.treeLeaves(t);
+        ok = writeBytes(file, l.orientations(), l.size() * sizeof(glm::quat));
+    }
+    ok = ok && writeAt(file, header.leafRadiiOffset, 0, 0);
+    for(int t = 0; ok && t < numTrees; t++){
+        const InstanceStore &l = forest.treeLeaves(t);
+        ok = writeBytes(file, l.radii(), l.size() * sizeof(float));
+    }
+    ok = ok && writeAt(file, header.leafLengthsOffset, 0, 0);
+    for(int t = 0; ok && t < numTrees; t++){
+        const InstanceStore &l = forest.treeLeaves(t);
+        ok = writeBytes(file, l.lengths(), l.size() * sizeof(float));
+    }
+    ok = ok && writeAt(file, header.refsOffset, 0, 0);
+    for(int t = 0; ok && t < numTrees; t++){
+        const std::vector<TemplateRef> &refs = forest.treeTemplateRefs(t);
+        ok = writeBytes(file, refs.data(), refs.size() * sizeof(TemplateRef));
+    }
+    ok = ok && writeAt(file, header.fileSize, 0, 0);
+
+    ok = (fclose(file) == 0) && ok;
+    if(ok && rename(temporary.c_str(), filename.c_str()) != 0){
+        // Windows won't rename over an existing file
+        remove(filename.c_str());
+        ok = rename(temporary.c_str(), filename.c_str()) == 0;
+    }
+    if(!ok){
+        remove(temporary.c_str());
+    }
+    return ok;
+}
+
+bool ForestCache::open(const std::string &filename, uint64_t key, int numTemplates)
+{
+    close();
+
+#ifdef _WIN32
+    FILE *file = fopen(filename.c_str(), "rb");
+    if(!file){
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    m_buffer.resize(size > 0 ? size : 0);
+    bool read = size > 0 && fread(m_buffer.data(), 1, size, file) == (size_t)size;
+    fclose(file);
+    if(!read){
+        m_buffer.clear();
+        return false;
+    }
+    m_data = m_buffer.data();
+    m_size = m_buffer.size();
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd < 0){
+        return false;
+    }
+    struct stat info;
+    void *data = MAP_FAILED;
+    if(fstat(fd, &info) == 0 && info.st_size > 0){
+        data = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    // The mapping stays valid once the file is closed
+    ::close(fd);
+    if(data == MAP_FAILED){
+        return false;
+    }
+    m_data = (const char *)data;
+    m_size = info.st_size;
+#endif
+
+    if(!validate(key, numTemplates)){
+        close();
+        return false;
+    }
+
+    // Marks the file as used for evict
+#ifdef _WIN32
+    _utime(filename.c_str(), 0);
+#else
+    utime(filename.c_str(), 0);
+#endif
+    return true;
+}
+
+void ForestCache::close()
+{
+    if(!m_data){
+        return;
+    }
+#ifdef _WIN32
+    m_buffer.clear();
+#else
+    munmap((void *)m_data, m_size);
+#endif
+    m_data = 0;
+    m_size = 0;
+}
+
+/**
+ * @brief ForestCache::validate checks that the mapped file is whole and is the one asked for
+ * Every array and every tree's ranges must lie inside the file, and every template ref
+ * must name one of the numTemplates templates, so that nothing read from a damaged file
+ * can reach past the end of the mapping or of the template library.
+ */
+bool ForestCache::validate(uint64_t key, int numTemplates) const
+{
+    if(m_size < sizeof(ForestCacheHeader)){
+        return false;
+    }
+    const ForestCacheHeader &h = header();
+    if(memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != FOREST_CACHE_VERSION ||
+       h.headerSize != sizeof(ForestCacheHeader) || h.fileSize != m_size || h.key != key){
+        return false;
+    }
+
+    const uint64_t offsets[] = {
+        h.treesOffset,
+        h.branchPositionsOffset, h.branchOrientationsOffset, h.branchRadiiOffset,
+        h.branchLengthsOffset, h.branchInfoOffset,
+        h.leafPositionsOffset, h.leafOrientationsOffset, h.leafRadiiOffset, h.leafLengthsOffset,
+        h.refsOffset
+    };
+    const uint64_t counts[] = {
+        h.numTrees,
+        h.numBranches, h.numBranches, h.numBranches, h.numBranches, h.numBranches,
+        h.numLeaves, h.numLeaves, h.numLeaves, h.numLeaves,
+        h.numRefs
+    };
+    const uint64_t itemSizes[] = {
+        sizeof(ForestCacheTree),
+        sizeof(glm::vec3), sizeof(glm::quat), sizeof(float), sizeof(float), sizeof(BranchInfo),
+        sizeof(glm::vec3), sizeof(glm::quat), sizeof(float), sizeof(float),
+        sizeof(TemplateRef)
+    };
+    for(size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++){
+        // Dividing instead of multiplying, so a huge count can't wrap round to a small size
+        if(offsets[i] % 16 != 0 || offsets[i] > m_size ||
+           counts[i] > (m_size - offsets[i]) / itemSizes[i]){
+            return false;
+        }
+    }
+
+    for(int t = 0; t < numTrees(); t++){
+        const ForestCacheTree &tr = tree(t);
+        if(tr.firstBranch > h.numBranches || tr.numBranches > h.numBranches - tr.firstBranch ||
+           tr.firstLeaf > h.numLeaves || tr.numLeaves > h.numLeaves - tr.firstLeaf ||
+           tr.firstRef > h.numRefs || tr.numRefs > h.numRefs - tr.firstRef){
+            return false;
+        }
+    }
+
+    const TemplateRef *refs = templateRefs();
+    for(uint64_t r = 0; r < h.numRefs; r++){
+        if(refs[r].templateIndex >= (uint32_t)numTemplates){
+            return false;
+        }
+    }
+    return true;
+}
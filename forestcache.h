@@ -0,0 +1,116 @@
+#ifndef FORESTCACHE_H
+#define FORESTCACHE_H
+
+#include <string>
+#include "forest.h"
+
+// Bumped whenever the file layout changes, or the generator makes different trees from
+// the same seed, so that old files are regenerated instead of read.
+#define FOREST_CACHE_VERSION 3
+
+// The most files ForestCache::evict leaves in a directory.  A forest of the default size
+// is a few tens of megabytes.
+#define FOREST_CACHE_MAX_FILES 16
+
+// The start of every cache file
+struct ForestCacheHeader
+{
+    char magic[4];          // "TREE"
+    uint32_t version;       // FOREST_CACHE_VERSION
+    uint64_t key;           // ForestCache::key of the forest
+    uint64_t seed;
+    uint32_t numTrees;
+    uint32_t headerSize;    // sizeof(ForestCacheHeader), which also catches a change of byte order
+    uint64_t fileSize;
+
+    uint64_t numBranches, numLeaves, numRefs;
+
+    // Where each array starts, from the start of the file.  Every one is 16 byte aligned.
+    uint64_t treesOffset;
+    uint64_t branchPositionsOffset, branchOrientationsOffset, branchRadiiOffset, branchLengthsOffset;
+    uint64_t branchInfoOffset;
+    uint64_t leafPositionsOffset, leafOrientationsOffset, leafRadiiOffset, leafLengthsOffset;
+    uint64_t refsOffset;
+};
+
+// One tree of a cache file, the ranges being of the forest wide arrays
+struct ForestCacheTree
+{
+    uint64_t seed;
+    uint64_t firstBranch, numBranches;
+    uint64_t firstLeaf, numLeaves;
+    uint64_t firstRef, numRefs;
+};
+
+/**
+ * Generated forests saved to disk, so that a forest already made once never needs its
+ * L-systems run again.
+ *
+ * A file is a header, a table of trees with their seeds and ranges, then every array of
+ * the forest exactly as InstanceStore keeps it in memory, the trees one after another.
+ * Nothing is parsed on load.  The file is mapped and the arrays are used where they lie,
+ * so they can be copied into a Forest or handed to glBufferData as they are.
+ *
+ * Files are named by key, which covers everything the trees are generated from.  Every
+ * seed or species edit makes a new one, so evict throws out the least recently used
+ * files once there are too many.  open touches a file, so a forest that keeps being
+ * read back stays.
+ */
+class ForestCache
+{
+public:
+    ForestCache();
+    ~ForestCache();
+
+    // Identifies the forest generate would make from these
+    static uint64_t key(int numTrees, uint64_t seed, const TemplateLibrary *templates,
+                        const std::vector<Species> &species, const std::vector<glm::vec2> &sites);
+
+    // The name of the file in directory for key
+    static std::string path(const std::string &directory, uint64_t key);
+
+    // Writes every tree of forest.  The file appears complete or not at all.
+    static bool write(const std::string &filename, const Forest &forest, uint64_t key);
+
+    // Deletes the cache files in directory that were used longest ago, until at most
+    // maxFiles are left.
+    static void evict(const std::string &directory, int maxFiles);
+
+    // Maps a file written by write.  Fails, leaving nothing open, if it is missing, of
+    // another version, not for key, or refers to a template past numTemplates.
+    bool open(const std::string &filename, uint64_t key, int numTemplates);
+    void close();
+    bool isOpen() const { return m_data != 0; }
+
+    const ForestCacheHeader &header() const { return *(const ForestCacheHeader *)m_data; }
+    int numTrees() const { return (int)header().numTrees; }
+    const ForestCacheTree &tree(int t) const { return array<ForestCacheTree>(header().treesOffset)[t]; }
+
+    const glm::vec3 *branchPositions() const { return array<glm::vec3>(header().branchPositionsOffset); }
+    const glm::quat *branchOrientations() const { return array<glm::quat>(header().branchOrientationsOffset); }
+    const float *branchRadii() const { return array<float>(header().branchRadiiOffset); }
+    const float *branchLengths() const { return array<float>(header().branchLengthsOffset); }
+    const BranchInfo *branchInfo() const { return array<BranchInfo>(header().branchInfoOffset); }
+
+    const glm::vec3 *leafPositions() const { return array<glm::vec3>(header().leafPositionsOffset); }
+    const glm::quat *leafOrientations() const { return array<glm::quat>(header().leafOrientationsOffset); }
+    const float *leafRadii() const { return array<float>(header().leafRadiiOffset); }
+    const float *leafLengths() const { return array<float>(header().leafLengthsOffset); }
+
+    const TemplateRef *templateRefs() const { return array<TemplateRef>(header().refsOffset); }
+
+private:
+    template <class T>
+    const T *array(uint64_t offset) const { return (const T *)(m_data + offset); }
+
+    bool validate(uint64_t key, int numTemplates) const;
+
+    const char *m_data;
+    size_t m_size;
+#ifdef _WIN32
+    // No mmap, so the file is read in whole
+    std::vector<char> m_buffer;
+#endif
+};
+
+#endif // FORESTCACHE_H
@@ -0,0 +1,377 @@
+#include "forestworker.h"
+#include "forestcache.h"
+#include <algorithm>
+#include <float.h>
+#include <string.h>
+
+// How many branches, at most, are culled as one
+#define CLUSTER_BRANCHES 64
+
+// Forests with fewer trees than this are culled on one thread, as starting others would
+// take longer than the culling, even with the threads already waiting
+#define PARALLEL_MIN_TREES 16384
+
+VisibleSet::VisibleSet()
+{
+    numTrees = numClusters = numRefs = 0;
+    numBranches = numRefBranches = 0;
+}
+
+void ForestBuffers::swap(ForestBuffers &other)
+{
+    std::swap(branches, other.branches);
+    std::swap(leaves, other.leaves);
+    std::swap(refLeaves, other.refLeaves);
+    branchMatrices.swap(other.branchMatrices);
+    templateRefs.swap(other.templateRefs);
+    refMatrices.swap(other.refMatrices);
+    refBranchMatrices.swap(other.refBranchMatrices);
+    std::swap(mesh, other.mesh);
+    trees.swap(other.trees);
+    std::swap(treeBounds, other.treeBounds);
+    clusters.swap(other.clusters);
+    std::swap(clusterBounds, other.clusterBounds);
+    refClusters.swap(other.refClusters);
+    std::swap(refBounds, other.refBounds);
+}
+
+void ForestBuffers::clear()
+{
+    branches.clear();
+    leaves.clear();
+    refLeaves.clear();
+    branchMatrices.clear();
+    templateRefs.clear();
+    refMatrices.clear();
+    refBranchMatrices.clear();
+    mesh.clear();
+    trees.clear();
+    treeBounds.clear();
+    clusters.clear();
+    clusterBounds.clear();
+    refClusters.clear();
+    refBounds.clear();
+}
+
+/**
+ * @brief ForestBuffers::append adds one finished tree, with everything needed to draw it
+ * Branches are stored depth first, so a run of them is mostly one limb and its twigs and
+ * makes a fairly tight cluster.  Each templated subtree is a cluster of its own.
+ */
+void ForestBuffers::append(const Forest &forest, int tree)
+{
+    const InstanceStore &treeBranches = forest.treeBranches(tree);
+    size_t first = branches.size();
+    size_t firstLeaf = leaves.size();
+    branches.append(treeBranches);
+    leaves.append(forest.treeLeaves(tree));
+
+    // The trees don't move, so their model matrices are built once here instead of per frame
+    branchMatrices.resize(branches.size());
+    treeBranches.buildMatrices(branchMatrices.data() + first);
+    mesh.appendTree(treeBranches);
+
+    TreeParts parts;
+    glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+    parts.firstCluster = (uint32_t)clusters.size();
+    parts.numBranches = (uint32_t)treeBranches.size();
+    for(size_t i = first; i < branches.size(); i += CLUSTER_BRANCHES){
+        BranchCluster cluster;
+        cluster.first = (uint32_t)i;
+        cluster.count = (uint32_t)std::min(branches.size() - i, (size_t)CLUSTER_BRANCHES);
+        glm::vec3 clusterLo(FLT_MAX), clusterHi(-FLT_MAX);
+        branches.growBounds(&clusterLo, &clusterHi, i, i + cluster.count);
+        lo = glm::min(lo, clusterLo);
+        hi = glm::max(hi, clusterHi);
+        clusters.push_back(cluster);
+        clusterBounds.append(clusterLo, clusterHi);
+    }
+    parts.numClusters = (uint32_t)clusters.size() - parts.firstCluster;
+    parts.firstLeaf = (uint32_t)firstLeaf;
+    parts.numLeaves = (uint32_t)(leaves.size() - firstLeaf);
+    leaves.growBounds(&lo, &hi, firstLeaf, leaves.size());
+
+    const std::vector<TemplateRef> &refs = forest.treeTemplateRefs(tree);
+    parts.firstRef = (uint32_t)templateRefs.size();
+    parts.numRefs = (uint32_t)refs.size();
+    parts.numRefBranches = 0;
+    parts.firstRefLeaf = (uint32_t)refLeaves.size();
+    for(size_t i = 0; i < refs.size(); i++){
+        templateRefs.push_back(refs[i]);
+        refMatrices.push_back(TemplateLibrary::refMatrix(refs[i]));
+    }
+    if(forest.templates() && !refs.empty()){
+        size_t firstRefLeaf = refLeaves.size();
+        refBranches.clear();
+        forest.templates()->expand(refs, &refBranches, &refLeaves);
+        size_t firstRefBranch = refBranchMatrices.size();
+        refBranchMatrices.resize(firstRefBranch + refBranches.size());
+        refBranches.buildMatrices(refBranchMatrices.data() + firstRefBranch);
+        parts.numRefBranches = (uint32_t)refBranches.size();
+
+        // expand places the refs' branches one after another
+        size_t start = 0;
+        for(size_t i = 0; i < refs.size(); i++){
+            BranchCluster cluster;
+            cluster.first = (uint32_t)(firstRefBranch + start);
+            cluster.count = (uint32_t)forest.templates()->branchCount(refs[i]);
+            glm::vec3 clusterLo(FLT_MAX), clusterHi(-FLT_MAX);
+            refBranches.growBounds(&clusterLo, &clusterHi, start, start + cluster.count);
+            lo = glm::min(lo, clusterLo);
+            hi = glm::max(hi, clusterHi);
+            refClusters.push_back(cluster);
+            refBounds.append(clusterLo, clusterHi);
+            start += cluster.count;
+        }
+        refLeaves.growBounds(&lo, &hi, firstRefLeaf, refLeaves.size());
+        parts.numRefLeaves = (uint32_t)(refLeaves.size() - firstRefLeaf);
+    } else {
+        parts.numRefLeaves = 0;
+        // Nothing to draw, but every ref still needs its cluster
+        BranchCluster empty = {0, 0};
+        while(refClusters.size() < templateRefs.size()){
+            refClusters.push_back(empty);
+            refBounds.append(glm::vec3(0.0f), glm::vec3(0.0f));
+        }
+    }
+
+    // A tree with nothing in it gets an empty box at the origin, so the infinite bounds
+    // never reach the planes
+    if(lo.x > hi.x){
+        lo = hi = glm::vec3(0.0f);
+    }
+    trees.push_back(parts);
+    treeBounds.append(lo, hi);
+}
+
+/**
+ * @brief ForestBuffers::cull finds what of the forest may be on screen
+ * The trees are split into one chunk per thread.  Each chunk's trees, and so its clusters
+ * and refs, are a contiguous range, so each thread writes its results where that range
+ * starts in the output arrays, and they are then moved down to follow on from each other.
+ */
+void ForestBuffers::cull(const Frustum &frustum, VisibleSet *visible, WorkerPool *pool) const
+{
+    size_t numTrees = trees.size();
+    int numChunks = (pool && numTrees >= PARALLEL_MIN_TREES) ? pool->numThreads() : 1;
+
+    if(visible->trees.size() < numTrees){
+        visible->trees.resize(numTrees);
+        visible->crossing.resize(numTrees);
+    }
+    if(visible->clusters.size() < clusters.size()){
+        visible->clusters.resize(clusters.size());
+    }
+    if(visible->refs.size() < refClusters.size()){
+        visible->refs.resize(refClusters.size());
+    }
+    visible->chunks.resize(numChunks);
+
+    auto cullChunk = [&](int c){
+        cullTrees(frustum, numTrees * c / numChunks, numTrees * (c + 1) / numChunks,
+                  visible, &visible->chunks[c]);
+    };
+    if(numChunks > 1){
+        pool->run(numChunks, cullChunk);
+    } else {
+        cullChunk(0);
+    }
+
+    visible->numTrees = visible->numClusters = visible->numRefs = 0;
+    visible->numBranches = visible->numRefBranches = 0;
+    for(int c = 0; c < numChunks; c++){
+        const VisibleSet::Chunk &chunk = visible->chunks[c];
+        size_t first = numTrees * c / numChunks;
+        if(chunk.numTrees > 0){
+            // The destination never starts after the source, so copying forward is safe
+            const TreeParts &tree = trees[first];
+            std::copy(&visible->trees[first], &visible->trees[first] + chunk.numTrees,
+                      &visible->trees[visible->numTrees]);
+            std::copy(visible->clusters.begin() + tree.firstCluster,
+                      visible->clusters.begin() + tree.firstCluster + chunk.numClusters,
+                      visible->clusters.begin() + visible->numClusters);
+            std::copy(visible->refs.begin() + tree.firstRef,
+                      visible->refs.begin() + tree.firstRef + chunk.numRefs,
+                      visible->refs.begin() + visible->numRefs);
+        }
+        visible->numTrees += chunk.numTrees;
+        visible->numClusters += chunk.numClusters;
+        visible->numRefs += chunk.numRefs;
+        visible->numBranches += chunk.numBranches;
+        visible->numRefBranches += chunk.numRefBranches;
+    }
+}
+
+/**
+ * @brief ForestBuffers::cullTrees culls the trees from first up to end
+ * Only the clusters of a tree that crosses the edge of the frustum are tested themselves,
+ * since those of a tree wholly inside it are too.  Results are written from where the
+ * range of trees, clusters and refs starts.
+ */
+void ForestBuffers::cullTrees(const Frustum &frustum, size_t first, size_t end, VisibleSet *visible,
+                              VisibleSet::Chunk *chunk) const
+{
+    memset(chunk, 0, sizeof(*chunk));
+    if(first == end){
+        return;
+    }
+
+    uint32_t *outTrees = &visible->trees[first];
+    uint8_t *crossing = &visible->crossing[first];
+    uint32_t *outClusters = visible->clusters.data() + trees[first].firstCluster;
+    uint32_t *outRefs = visible->refs.data() + trees[first].firstRef;
+
+    chunk->numTrees = frustum.cull(treeBounds, first, end, outTrees, crossing);
+
+    for(size_t k = 0; k < chunk->numTrees; k++){
+        const TreeParts &tree = trees[outTrees[k]];
+        if(crossing[k]){
+            size_t n = frustum.cull(clusterBounds, tree.firstCluster, tree.firstCluster + tree.numClusters,
+                                    outClusters + chunk->numClusters);
+            for(size_t i = 0; i < n; i++){
+                chunk->numBranches += clusters[outClusters[chunk->numClusters++]].count;
+            }
+            n = frustum.cull(refBounds, tree.firstRef, tree.firstRef + tree.numRefs,
+                             outRefs + chunk->numRefs);
+            for(size_t i = 0; i < n; i++){
+                chunk->numRefBranches += refClusters[outRefs[chunk->numRefs++]].count;
+            }
+        } else {
+            for(uint32_t c = 0; c < tree.numClusters; c++){
+                outClusters[chunk->numClusters++] = tree.firstCluster + c;
+            }
+            for(uint32_t r = 0; r < tree.numRefs; r++){
+                outRefs[chunk->numRefs++] = tree.firstRef + r;
+            }
+            chunk->numBranches += tree.numBranches;
+            chunk->numRefBranches += tree.numRefBranches;
+        }
+    }
+}
+
+ForestWorker::ForestWorker()
+{
+    m_requested = false;
+    m_quit = false;
+    m_ready = false;
+    m_busy = false;
+    m_built = false;
+    m_thread = std::thread(&ForestWorker::run, this);
+}
+
+ForestWorker::~ForestWorker()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_wake.notify_all();
+    m_thread.join();
+}
+
+void ForestWorker::request(int numTrees, uint64_t seed, const TemplateLibrary *templates,
+                           const std::vector<Species> &species, const std::vector<glm::vec2> &sites)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Request r = {numTrees, seed, templates, species, sites};
+        m_request = r;
+        m_requested = true;
+        m_busy = true;
+    }
+    m_wake.notify_all();
+}
+
+void ForestWorker::setCacheDirectory(const std::string &directory)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_cacheDirectory = directory;
+}
+
+bool ForestWorker::take(ForestBuffers &front)
+{
+    // The common case of nothing new is answered without locking.
+    if(!m_ready){
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        front.swap(m_back);
+        m_ready = false;
+    }
+    m_wake.notify_all();
+    return true;
+}
+
+/**
+ * @brief ForestWorker::run is the worker thread's loop
+ * It sleeps until there is a request and the back buffer is free, then builds the forest
+ * into the back buffer and marks it ready.
+ */
+void ForestWorker::run()
+{
+    // Generation gets every core but the render thread's.
+    int numThreads = (int)std::thread::hardware_concurrency() - 1;
+    if(numThreads < 1){
+        numThreads = 1;
+    }
+
+    while(true){
+        Request r;
+        std::string cacheDirectory;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [this](){ return m_quit || (m_requested && !m_ready); });
+            if(m_quit){
+                return;
+            }
+            r = m_request;
+            m_requested = false;
+            cacheDirectory = m_cacheDirectory;
+        }
+
+        std::vector<int> changed;
+        bool sameForest = m_built && r.numTrees == m_forest.numTrees() && r.seed == m_forest.seed() &&
+                          r.templates == m_forest.templates() && r.sites == m_forest.sites();
+        if(sameForest){
+            m_forest.changedTrees(r.species, &changed);
+        }
+        m_forest.setTemplates(r.templates);
+        m_forest.setSpecies(r.species);
+        m_forest.setSites(r.sites);
+
+        // A forest that was built before is read back whole, which beats even rebuilding
+        // a few of its trees.
+        uint64_t key = ForestCache::key(r.numTrees, r.seed, r.templates, r.species, r.sites);
+        std::string cacheFile = cacheDirectory.empty() ? std::string() : ForestCache::path(cacheDirectory, key);
+        ForestCache cache;
+        bool cached = !cacheFile.empty() &&
+                      cache.open(cacheFile, key, r.templates ? r.templates->numTemplates() : 0);
+        if(cached){
+            m_forest.load(cache);
+            cache.close();
+        } else if(sameForest){
+            m_forest.regenerate(changed, numThreads);
+        } else {
+            m_forest.generate(r.numTrees, r.seed, numThreads);
+        }
+        m_built = true;
+
+        if(!cacheFile.empty() && !cached){
+            ForestCache::write(cacheFile, m_forest, key);
+            ForestCache::evict(cacheDirectory, FOREST_CACHE_MAX_FILES);
+        }
+
+        // The back buffer is reused, so its memory is kept from one forest to the next.
+        m_back.clear();
+        for(int tree = 0; tree < m_forest.numTrees(); tree++){
+            m_back.append(m_forest, tree);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_ready = true;
+            m_busy = m_requested;
+        }
+    }
+}
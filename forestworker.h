@@ -0,0 +1,169 @@
+#ifndef FORESTWORKER_H
+#define FORESTWORKER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "forest.h"
+#include "treemesh.h"
+#include "frustum.h"
+#include "parallel.h"
+
+// A run of branches that are culled together, with its box in ForestBuffers
+struct BranchCluster
+{
+    // The range of model matrices the cluster covers
+    uint32_t first, count;
+};
+
+// Where the parts of one tree are in ForestBuffers
+struct TreeParts
+{
+    uint32_t firstCluster, numClusters;
+    uint32_t firstRef, numRefs;
+    // How many matrices its clusters and refs cover
+    uint32_t numBranches, numRefBranches;
+    // Its runs of leaves and refLeaves
+    uint32_t firstLeaf, numLeaves;
+    uint32_t firstRefLeaf, numRefLeaves;
+};
+
+// The parts of a forest that may be on screen, as found by ForestBuffers::cull.  The
+// arrays are only ever grown, so only the counted entries at the start of each mean
+// anything.
+struct VisibleSet
+{
+    VisibleSet();
+
+    std::vector<uint32_t> trees;
+    size_t numTrees;
+    // Indices of ForestBuffers::clusters
+    std::vector<uint32_t> clusters;
+    size_t numClusters;
+    // Indices of templateRefs, and so of refClusters
+    std::vector<uint32_t> refs;
+    size_t numRefs;
+    // How many matrices the visible clusters and refs cover
+    size_t numBranches, numRefBranches;
+
+    // Scratch for cull: whether each visible tree crosses the edge of the frustum, and
+    // what each thread found
+    std::vector<uint8_t> crossing;
+    struct Chunk
+    {
+        size_t numTrees, numClusters, numRefs;
+        size_t numBranches, numRefBranches;
+    };
+    std::vector<Chunk> chunks;
+};
+
+// Everything needed to draw one forest
+struct ForestBuffers
+{
+    InstanceStore branches;
+    InstanceStore leaves;
+    // The leaves of the templated subtrees, placed in the world so they are drawn with the rest
+    InstanceStore refLeaves;
+    std::vector<glm::mat4x4> branchMatrices;
+    std::vector<TemplateRef> templateRefs;
+    std::vector<glm::mat4x4> refMatrices;
+    // Model matrices of the branches of every templated subtree, placed in the world
+    std::vector<glm::mat4x4> refBranchMatrices;
+    // The branches of each tree as one mesh
+    TreeMesh mesh;
+
+    // For culling.  One entry per tree, a cluster per run of branchMatrices and one per
+    // template reference, covering its range of refBranchMatrices.  Each has a box in the
+    // bounds array beside it, and a tree's box takes in its leaves too.
+    std::vector<TreeParts> trees;
+    BoxArray treeBounds;
+    std::vector<BranchCluster> clusters;
+    BoxArray clusterBounds;
+    std::vector<BranchCluster> refClusters;
+    BoxArray refBounds;
+
+    // Scratch for append
+    InstanceStore refBranches;
+
+    void swap(ForestBuffers &other);
+    void clear();
+
+    // Appends one finished tree of forest, with its matrices and mesh.
+    void append(const Forest &forest, int tree);
+
+    // Finds the trees, clusters and refs that are at least partly inside frustum, in
+    // order.  Large forests are split between the threads of pool, if there is one.
+    void cull(const Frustum &frustum, VisibleSet *visible, WorkerPool *pool = 0) const;
+
+private:
+    void cullTrees(const Frustum &frustum, size_t first, size_t end, VisibleSet *visible,
+                   VisibleSet::Chunk *chunk) const;
+};
+
+/**
+ * Generates forests on a background thread.
+ *
+ * The worker fills a back buffer while the render thread keeps drawing its own.  When a
+ * forest is done the render thread swaps it in with take, and the old buffers become the
+ * next back buffer.  Only two sets of buffers ever exist, and neither side waits on the
+ * other for longer than a swap.
+ */
+class ForestWorker
+{
+public:
+    ForestWorker();
+    ~ForestWorker();
+
+    // Asks for a forest.  A request made while another is being built replaces any
+    // request still waiting, so only the newest is built next.  When only the species
+    // differ from the last forest built, only the trees whose species changed are rebuilt.
+    // Trees are planted at sites as in Forest::setSites.
+    void request(int numTrees, uint64_t seed, const TemplateLibrary *templates,
+                 const std::vector<Species> &species = std::vector<Species>(),
+                 const std::vector<glm::vec2> &sites = std::vector<glm::vec2>());
+
+    // Forests are saved to directory once built, and read back from it instead of being
+    // built again when the same forest is asked for.  Empty turns the cache off.
+    void setCacheDirectory(const std::string &directory);
+
+    // If a new forest is ready, swaps it into front and returns true.
+    bool take(ForestBuffers &front);
+
+    // True while a request is waiting or being built
+    bool busy() const { return m_busy; }
+
+private:
+    void run();
+
+    struct Request
+    {
+        int numTrees;
+        uint64_t seed;
+        const TemplateLibrary *templates;
+        std::vector<Species> species;
+        std::vector<glm::vec2> sites;
+    };
+
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+
+    // Guarded by m_mutex
+    Request m_request;
+    bool m_requested;
+    bool m_quit;
+    std::string m_cacheDirectory;
+
+    // Set by the worker once m_back holds a finished forest.  The worker doesn't touch
+    // m_back again until take has cleared it.
+    std::atomic<bool> m_ready;
+    std::atomic<bool> m_busy;
+
+    // The last forest built, kept so that a species change can rebuild only part of it
+    Forest m_forest;
+    bool m_built;
+    ForestBuffers m_back;
+};
+
+#endif // FORESTWORKER_H
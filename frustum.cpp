@@ -0,0 +1,202 @@
+#include "frustum.h"
+
+#ifdef __AVX__
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+Frustum::Frustum()
+{
+    // Every plane faces the same way with no offset, so nothing is culled until set
+    for(int i = 0; i < 6; i++){
+        m_planes[i] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    }
+}
+
+Frustum::Frustum(const glm::mat4x4 &viewProjection)
+{
+    set(viewProjection);
+}
+
+/**
+ * @brief Frustum::set finds the planes of a projection * view matrix
+ * A point is in clip space when -w <= x, y, z <= w, and each of those six inequalities is
+ * a plane in world space made from the w row plus or minus one of the others.
+ */
+void Frustum::set(const glm::mat4x4 &viewProjection)
+{
+    // glm is column major, so row i is element i of each column
+    glm::vec4 rows[4];
+    for(int i = 0; i < 4; i++){
+        rows[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i],
+                            viewProjection[2][i], viewProjection[3][i]);
+    }
+
+    for(int i = 0; i < 3; i++){
+        m_planes[2 * i] = rows[3] + rows[i];
+        m_planes[2 * i + 1] = rows[3] - rows[i];
+    }
+
+    // Unit normals, so the planes could also be used for distances
+    for(int i = 0; i < 6; i++){
+        m_planes[i] /= glm::length(glm::vec3(m_planes[i]));
+    }
+}
+
+void BoxArray::clear()
+{
+    for(int axis = 0; axis < 3; axis++){
+        m_centres[axis].clear();
+        m_extents[axis].clear();
+    }
+}
+
+void BoxArray::reserve(size_t n)
+{
+    for(int axis = 0; axis < 3; axis++){
+        m_centres[axis].reserve(n);
+        m_extents[axis].reserve(n);
+    }
+}
+
+void BoxArray::append(const glm::vec3 &lo, const glm::vec3 &hi)
+{
+    for(int axis = 0; axis < 3; axis++){
+        m_centres[axis].push_back((lo[axis] + hi[axis]) * 0.5f);
+        m_extents[axis].push_back((hi[axis] - lo[axis]) * 0.5f);
+    }
+}
+
+// Adds the boxes of one group from index on to visible, given which of them are outside
+// and which cross an edge as bit masks.  Every box is written, but n only moves past the
+// ones that aren't outside, so there is no branch on each box.
+static inline size_t compact(uint32_t index, int lanes, int outside, int crosses,
+                             uint32_t *visible, uint8_t *crossing, size_t n)
+{
+    for(int lane = 0; lane < lanes; lane++){
+        visible[n] = index + lane;
+        if(crossing){
+            crossing[n] = (uint8_t)((crosses >> lane) & 1);
+        }
+        n += ((outside >> lane) & 1) ^ 1;
+    }
+    return n;
+}
+
+/**
+ * @brief Frustum::cull tests many boxes against the planes at once
+ * A box of centre c and half size e is wholly behind a plane when its centre is further
+ * behind it than |n.x| e.x + |n.y| e.y + |n.z| e.z, which is how far its corners reach
+ * along the normal.  It crosses the plane when the centre is closer than that.  Each lane
+ * of a register is one box, so every plane takes a handful of multiplies for four or eight.
+ */
+size_t Frustum::cull(const BoxArray &boxes, size_t first, size_t end, uint32_t *visible,
+                     uint8_t *crossing) const
+{
+    const float *cx = boxes.centres(0);
+    const float *cy = boxes.centres(1);
+    const float *cz = boxes.centres(2);
+    const float *ex = boxes.extents(0);
+    const float *ey = boxes.extents(1);
+    const float *ez = boxes.extents(2);
+
+    glm::vec3 reach[6];
+    for(int p = 0; p < 6; p++){
+        reach[p] = glm::abs(glm::vec3(m_planes[p]));
+    }
+
+    size_t n = 0;
+    size_t i = first;
+
+#ifdef __AVX__
+    __m256 normals8[6][4];
+    __m256 reach8[6][3];
+    for(int p = 0; p < 6; p++){
+        for(int c = 0; c < 4; c++){
+            normals8[p][c] = _mm256_set1_ps(m_planes[p][c]);
+        }
+        for(int c = 0; c < 3; c++){
+            reach8[p][c] = _mm256_set1_ps(reach[p][c]);
+        }
+    }
+
+    for(; i + 8 <= end; i += 8){
+        __m256 x = _mm256_loadu_ps(cx + i);
+        __m256 y = _mm256_loadu_ps(cy + i);
+        __m256 z = _mm256_loadu_ps(cz + i);
+        __m256 sx = _mm256_loadu_ps(ex + i);
+        __m256 sy = _mm256_loadu_ps(ey + i);
+        __m256 sz = _mm256_loadu_ps(ez + i);
+
+        __m256 outside = _mm256_setzero_ps();
+        __m256 crosses = _mm256_setzero_ps();
+        for(int p = 0; p < 6; p++){
+            __m256 distance = _mm256_add_ps(
+                        _mm256_add_ps(_mm256_mul_ps(normals8[p][0], x), _mm256_mul_ps(normals8[p][1], y)),
+                        _mm256_add_ps(_mm256_mul_ps(normals8[p][2], z), normals8[p][3]));
+            __m256 radius = _mm256_add_ps(
+                        _mm256_add_ps(_mm256_mul_ps(reach8[p][0], sx), _mm256_mul_ps(reach8[p][1], sy)),
+                        _mm256_mul_ps(reach8[p][2], sz));
+            outside = _mm256_or_ps(outside, _mm256_cmp_ps(_mm256_add_ps(distance, radius),
+                                                          _mm256_setzero_ps(), _CMP_LT_OQ));
+            crosses = _mm256_or_ps(crosses, _mm256_cmp_ps(distance, radius, _CMP_LT_OQ));
+        }
+
+        n = compact((uint32_t)i, 8, _mm256_movemask_ps(outside), _mm256_movemask_ps(crosses),
+                    visible, crossing, n);
+    }
+#endif
+
+#ifdef __SSE__
+    __m128 normals4[6][4];
+    __m128 reach4[6][3];
+    for(int p = 0; p < 6; p++){
+        for(int c = 0; c < 4; c++){
+            normals4[p][c] = _mm_set1_ps(m_planes[p][c]);
+        }
+        for(int c = 0; c < 3; c++){
+            reach4[p][c] = _mm_set1_ps(reach[p][c]);
+        }
+    }
+
+    for(; i + 4 <= end; i += 4){
+        __m128 x = _mm_loadu_ps(cx + i);
+        __m128 y = _mm_loadu_ps(cy + i);
+        __m128 z = _mm_loadu_ps(cz + i);
+        __m128 sx = _mm_loadu_ps(ex + i);
+        __m128 sy = _mm_loadu_ps(ey + i);
+        __m128 sz = _mm_loadu_ps(ez + i);
+
+        __m128 outside = _mm_setzero_ps();
+        __m128 crosses = _mm_setzero_ps();
+        for(int p = 0; p < 6; p++){
+            __m128 distance = _mm_add_ps(
+                        _mm_add_ps(_mm_mul_ps(normals4[p][0], x), _mm_mul_ps(normals4[p][1], y)),
+                        _mm_add_ps(_mm_mul_ps(normals4[p][2], z), normals4[p][3]));
+            __m128 radius = _mm_add_ps(
+                        _mm_add_ps(_mm_mul_ps(reach4[p][0], sx), _mm_mul_ps(reach4[p][1], sy)),
+                        _mm_mul_ps(reach4[p][2], sz));
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), _mm_setzero_ps()));
+            crosses = _mm_or_ps(crosses, _mm_cmplt_ps(distance, radius));
+        }
+
+        n = compact((uint32_t)i, 4, _mm_movemask_ps(outside), _mm_movemask_ps(crosses),
+                    visible, crossing, n);
+    }
+#endif
+
+    // What is left, or everything without SSE
+    for(; i < end; i++){
+        int outside = 0;
+        int crosses = 0;
+        for(int p = 0; p < 6; p++){
+            float distance = m_planes[p].x * cx[i] + m_planes[p].y * cy[i] + m_planes[p].z * cz[i] + m_planes[p].w;
+            float radius = reach[p].x * ex[i] + reach[p].y * ey[i] + reach[p].z * ez[i];
+            outside |= distance + radius < 0.0f;
+            crosses |= distance < radius;
+        }
+        n = compact((uint32_t)i, 1, outside, crosses, visible, crossing, n);
+    }
+    return n;
+}
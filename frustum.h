@@ -0,0 +1,68 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+// Only glm, not Common.h, so the generator builds without Qt or OpenGL
+#ifndef GLM_FORCE_RADIANS
+#define GLM_FORCE_RADIANS
+#endif
+#include <glm/glm.hpp>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Axis aligned boxes kept as centres and half sizes, one array per component, so that
+ * Frustum::cull can load the same component of several boxes at once.
+ */
+class BoxArray
+{
+public:
+    void clear();
+    void reserve(size_t n);
+    void append(const glm::vec3 &lo, const glm::vec3 &hi);
+    size_t size() const { return m_centres[0].size(); }
+
+    const float *centres(int axis) const { return m_centres[axis].data(); }
+    const float *extents(int axis) const { return m_extents[axis].data(); }
+
+private:
+    std::vector<float> m_centres[3];
+    std::vector<float> m_extents[3];
+};
+
+/**
+ * The six planes bounding what a camera sees, for throwing away what is off screen
+ * before it is drawn.
+ *
+ * The planes are taken straight from the rows of projection * view (Gribb and Hartmann),
+ * with their normals pointing into the frustum.  Boxes are tested against each plane by
+ * their corner furthest along its normal, so a box is only called outside when it is
+ * wholly behind one plane.  A few boxes near the corners of the frustum pass when they
+ * are in fact outside, which only costs drawing them.
+ *
+ * cull does the same test for a whole BoxArray, eight boxes at a time with AVX, or four
+ * with SSE, where the compiler targets them.
+ */
+class Frustum
+{
+public:
+    Frustum();
+    explicit Frustum(const glm::mat4x4 &viewProjection);
+
+    void set(const glm::mat4x4 &viewProjection);
+
+    // Writes the index of every box of boxes from first up to end that isn't outside to
+    // visible, in order, and returns how many there are.  visible needs room for end -
+    // first indices.  If crossing isn't null, crossing[k] is set to 1 when box visible[k]
+    // crosses the edge of the frustum, and 0 when it is wholly inside.
+    size_t cull(const BoxArray &boxes, size_t first, size_t end, uint32_t *visible,
+                uint8_t *crossing = 0) const;
+
+    // Plane i as (normal, distance), so a point p is inside it when dot(normal, p) + distance >= 0.
+    // In order left, right, bottom, top, near, far.
+    const glm::vec4 &plane(int i) const { return m_planes[i]; }
+
+private:
+    glm::vec4 m_planes[6];
+};
+
+#endif // FRUSTUM_H
@@ -0,0 +1,155 @@
+#include "instancestore.h"
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+InstanceStore::InstanceStore()
+{
+}
+
+void InstanceStore::append(const glm::vec3 &position, const glm::quat &orientation, float radius, float length)
+{
+    m_positions.push_back(position);
+    m_orientations.push_back(orientation);
+    m_radii.push_back(radius);
+    m_lengths.push_back(length);
+}
+
+void InstanceStore::append(const glm::vec3 &position, const glm::quat &orientation, float radius, float length,
+                           const BranchInfo &info)
+{
+    append(position, orientation, radius, length);
+    m_info.push_back(info);
+}
+
+void InstanceStore::append(const InstanceStore &other)
+{
+    m_positions.insert(m_positions.end(), other.m_positions.begin(), other.m_positions.end());
+    m_orientations.insert(m_orientations.end(), other.m_orientations.begin(), other.m_orientations.end());
+    m_radii.insert(m_radii.end(), other.m_radii.begin(), other.m_radii.end());
+    m_lengths.insert(m_lengths.end(), other.m_lengths.begin(), other.m_lengths.end());
+    m_info.insert(m_info.end(), other.m_info.begin(), other.m_info.end());
+}
+
+void InstanceStore::assign(const glm::vec3 *positions, const glm::quat *orientations, const float *radii,
+                           const float *lengths, const BranchInfo *info, size_t n)
+{
+    m_positions.assign(positions, positions + n);
+    m_orientations.assign(orientations, orientations + n);
+    m_radii.assign(radii, radii + n);
+    m_lengths.assign(lengths, lengths + n);
+    if(info){
+        m_info.assign(info, info + n);
+    } else {
+        m_info.clear();
+    }
+}
+
+void InstanceStore::clear()
+{
+    m_positions.clear();
+    m_orientations.clear();
+    m_radii.clear();
+    m_lengths.clear();
+    m_info.clear();
+}
+
+void InstanceStore::reserve(size_t n)
+{
+    m_positions.reserve(n);
+    m_orientations.reserve(n);
+    m_radii.reserve(n);
+    m_lengths.reserve(n);
+}
+
+/**
+ * @brief InstanceStore::growBounds grows a box around every instance
+ * The cylinder's axis runs half its length either side of the position, and the radius
+ * is added all round, which is a little loose but never too small.
+ */
+void InstanceStore::growBounds(glm::vec3 *lo, glm::vec3 *hi, size_t first, size_t end) const
+{
+    for(size_t i = first; i < end; i++){
+        glm::vec3 axis = m_orientations[i] * glm::vec3(0.0f, 0.0f, m_lengths[i] / 2);
+        glm::vec3 extent = glm::abs(axis) + glm::vec3(m_radii[i]);
+        *lo = glm::min(*lo, m_positions[i] - extent);
+        *hi = glm::max(*hi, m_positions[i] + extent);
+    }
+}
+
+glm::mat4x4 InstanceStore::modelMatrix(size_t i) const
+{
+    glm::mat4x4 m = glm::mat4_cast(m_orientations[i]);
+    m[0] *= m_radii[i];
+    m[1] *= m_radii[i];
+    m[2] *= m_lengths[i];
+    m[3] = glm::vec4(m_positions[i], 1.0f);
+    return m;
+}
+
+/**
+ * @brief InstanceStore::buildMatrices turns every instance into its model matrix
+ * The SSE path transposes four quaternions into one register per component, builds the
+ * four rotation * scale matrices side by side, then transposes the columns back out.
+ */
+void InstanceStore::buildMatrices(glm::mat4x4 *out) const
+{
+    size_t n = size();
+    size_t i = 0;
+
+#ifdef __SSE__
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 two = _mm_set1_ps(2.0f);
+
+    for(; i + 4 <= n; i += 4){
+        // glm::quat is laid out x, y, z, w
+        __m128 qx = _mm_loadu_ps(&m_orientations[i].x);
+        __m128 qy = _mm_loadu_ps(&m_orientations[i + 1].x);
+        __m128 qz = _mm_loadu_ps(&m_orientations[i + 2].x);
+        __m128 qw = _mm_loadu_ps(&m_orientations[i + 3].x);
+        _MM_TRANSPOSE4_PS(qx, qy, qz, qw);
+
+        __m128 radius = _mm_loadu_ps(&m_radii[i]);
+        __m128 length = _mm_loadu_ps(&m_lengths[i]);
+
+        __m128 xx = _mm_mul_ps(qx, qx), yy = _mm_mul_ps(qy, qy), zz = _mm_mul_ps(qz, qz);
+        __m128 xy = _mm_mul_ps(qx, qy), xz = _mm_mul_ps(qx, qz), yz = _mm_mul_ps(qy, qz);
+        __m128 wx = _mm_mul_ps(qw, qx), wy = _mm_mul_ps(qw, qy), wz = _mm_mul_ps(qw, qz);
+
+        // The same terms as glm::mat3_cast, with the x and y columns scaled by the radius
+        // and the z column by the length.
+        __m128 c[4][4];
+        c[0][0] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), radius);
+        c[0][1] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xy, wz)), radius);
+        c[0][2] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xz, wy)), radius);
+        c[0][3] = zero;
+        c[1][0] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xy, wz)), radius);
+        c[1][1] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))), radius);
+        c[1][2] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(yz, wx)), radius);
+        c[1][3] = zero;
+        c[2][0] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xz, wy)), length);
+        c[2][1] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(yz, wx)), length);
+        c[2][2] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))), length);
+        c[2][3] = zero;
+        c[3][0] = _mm_set_ps(m_positions[i + 3].x, m_positions[i + 2].x, m_positions[i + 1].x, m_positions[i].x);
+        c[3][1] = _mm_set_ps(m_positions[i + 3].y, m_positions[i + 2].y, m_positions[i + 1].y, m_positions[i].y);
+        c[3][2] = _mm_set_ps(m_positions[i + 3].z, m_positions[i + 2].z, m_positions[i + 1].z, m_positions[i].z);
+        c[3][3] = one;
+
+        // Each register now holds one component for all four instances.  Transposing a
+        // column's four registers gives that column of each of the four matrices.
+        for(int col = 0; col < 4; col++){
+            _MM_TRANSPOSE4_PS(c[col][0], c[col][1], c[col][2], c[col][3]);
+            for(int k = 0; k < 4; k++){
+                _mm_storeu_ps(&out[i + k][col][0], c[col][k]);
+            }
+        }
+    }
+#endif
+
+    for(; i < n; i++){
+        out[i] = modelMatrix(i);
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef INSTANCESTORE_H
+#define INSTANCESTORE_H
+
+// Only glm, not Common.h, so the generator builds without Qt or OpenGL
+#ifndef GLM_FORCE_RADIANS
+#define GLM_FORCE_RADIANS
+#endif
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <stdint.h>
+#include <vector>
+
+// Where a branch sits in its tree.  Branches are stored depth first, so everything that
+// grows out of a branch directly follows it, and its leaves are contiguous too.
+struct BranchInfo
+{
+    uint64_t key;       // The key every random draw of the branch is made from
+    uint64_t level;     // The trunk is level 0.  As wide as key, so caches get no padding.
+};
+
+/**
+ * Contiguous storage for the instances (branches or leaves) that make up the trees.
+ *
+ * Each instance is a position, an orientation and a (radius, radius, length) scale,
+ * kept in separate arrays so that each one can be handed straight to OpenGL.  That is
+ * 36 bytes an instance instead of a full 64 byte matrix.  Instances are only ever
+ * appended.
+ */
+class InstanceStore
+{
+public:
+    InstanceStore();
+
+    void append(const glm::vec3 &position, const glm::quat &orientation, float radius, float length);
+
+    void append(const glm::vec3 &position, const glm::quat &orientation, float radius, float length,
+                const BranchInfo &info);
+
+    // Appends every instance of another store
+    void append(const InstanceStore &other);
+
+    // Replaces every instance with n copied from the given arrays.  info may be null.
+    void assign(const glm::vec3 *positions, const glm::quat *orientations, const float *radii,
+                const float *lengths, const BranchInfo *info, size_t n);
+
+    void clear();
+    void reserve(size_t n);
+    size_t size() const { return m_positions.size(); }
+
+    // Only stores of branches have info
+    bool hasInfo() const { return !m_info.empty(); }
+    const BranchInfo &info(size_t i) const { return m_info[i]; }
+
+    // Grows the box from lo to hi until it holds every instance, each taken as a cylinder
+    // of its radius and length.
+    void growBounds(glm::vec3 *lo, glm::vec3 *hi) const { growBounds(lo, hi, 0, size()); }
+    // The same for the instances from first up to end
+    void growBounds(glm::vec3 *lo, glm::vec3 *hi, size_t first, size_t end) const;
+
+    // Returns the model matrix of instance i, translate * rotate * scale.
+    glm::mat4x4 modelMatrix(size_t i) const;
+
+    // Writes the model matrix of every instance to out, four at a time with SSE where
+    // available.  out must have room for size() matrices.
+    void buildMatrices(glm::mat4x4 *out) const;
+
+    // Direct access to the arrays, for uploading to the GPU
+    const glm::vec3 *positions() const { return m_positions.data(); }
+    const glm::quat *orientations() const { return m_orientations.data(); }
+    const float *radii() const { return m_radii.data(); }
+    const float *lengths() const { return m_lengths.data(); }
+
+private:
+    std::vector<glm::vec3> m_positions;
+    std::vector<glm::quat> m_orientations;
+    std::vector<float> m_radii;
+    std::vector<float> m_lengths;
+
+    // Not needed for drawing, so kept apart from the arrays above
+    std::vector<BranchInfo> m_info;
+};
+
+#endif // INSTANCESTORE_H
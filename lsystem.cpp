@@ -0,0 +1,330 @@
+#include "lsystem.h"
+#include "parallel.h"
+#include <chrono>
+#include <string.h>
+
+// Strings shorter than this are not worth handing to the pool.  The built in grammar's
+// strings reach it around iteration 10.
+#define PARALLEL_MIN_SYMBOLS 16384
+
+// The hash slot stochastic successors are picked with
+#define CHOICE_SLOT 0xFFFFFFFFu
+
+LSystem::LSystem()
+{
+    m_lastStats.symbolsIn = 0;
+    m_lastStats.symbolsOut = 0;
+    m_lastStats.seconds = 0.0;
+    m_streamIters = 0;
+    m_peakStreamDepth = 0;
+    m_numThreads = 1;
+    m_pool = 0;
+    memset(m_keyed, 0, sizeof(m_keyed));
+}
+
+void LSystem::addRule(char symbol, const std::string &successor)
+{
+    m_rules[(unsigned char)symbol].successors.push_back(successor);
+    countKeys();
+}
+
+void LSystem::addFinalRule(char symbol, const std::string &successor)
+{
+    m_finalRules[(unsigned char)symbol].successors.push_back(successor);
+    countKeys();
+}
+
+void LSystem::clearRules()
+{
+    for(int i = 0; i < 256; i++){
+        m_rules[i].successors.clear();
+        m_finalRules[i].successors.clear();
+    }
+    countKeys();
+}
+
+void LSystem::countKeys()
+{
+    for(int i = 0; i < 256; i++){
+        m_keyed[i] = !m_rules[i].successors.empty() || !m_finalRules[i].successors.empty();
+    }
+
+    Production *tables[2] = {m_rules, m_finalRules};
+    for(int t = 0; t < 2; t++){
+        for(int i = 0; i < 256; i++){
+            Production &p = tables[t][i];
+            p.keyCounts.assign(p.successors.size(), 0);
+            for(size_t j = 0; j < p.successors.size(); j++){
+                for(size_t k = 0; k < p.successors[j].length(); k++){
+                    if(isKeyed(p.successors[j][k])){
+                        p.keyCounts[j]++;
+                    }
+                }
+            }
+        }
+    }
+}
+
+const LSystem::Production &LSystem::rule(char symbol, bool finalIteration) const
+{
+    unsigned char s = (unsigned char)symbol;
+    if(finalIteration && !m_finalRules[s].successors.empty()){
+        return m_finalRules[s];
+    }
+    return m_rules[s];
+}
+
+size_t LSystem::choose(const Production &p, uint64_t key)
+{
+    size_t n = p.successors.size();
+    return (n == 1) ? 0 : Random::hashUInt(key, CHOICE_SLOT) % n;
+}
+
+LSystem::~LSystem()
+{
+    delete m_pool;
+}
+
+void LSystem::setThreadCount(int numThreads)
+{
+    m_numThreads = numThreads < 1 ? 1 : numThreads;
+    if(m_pool && m_pool->numThreads() == m_numThreads){
+        return;
+    }
+    delete m_pool;
+    m_pool = (m_numThreads > 1) ? new WorkerPool(m_numThreads) : 0;
+}
+
+void LSystem::derive(const std::string &in, const std::vector<uint64_t> &inKeys,
+                     std::string &out, std::vector<uint64_t> &outKeys, bool finalIteration)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    if(m_numThreads > 1 && in.length() >= PARALLEL_MIN_SYMBOLS){
+        deriveParallel(in, inKeys, out, outKeys, finalIteration);
+    } else {
+        deriveSerial(in, inKeys, out, outKeys, finalIteration);
+    }
+
+    m_lastStats.symbolsIn = in.length();
+    m_lastStats.symbolsOut = out.length();
+    m_lastStats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * @brief LSystem::deriveSerial rewrites in into out in two passes
+ * The first pass picks the successors and sums their lengths, so out is sized exactly
+ * once.  The second pass copies the successors into place and hands out the keys.
+ */
+void LSystem::deriveSerial(const std::string &in, const std::vector<uint64_t> &inKeys,
+                           std::string &out, std::vector<uint64_t> &outKeys, bool finalIteration)
+{
+    size_t l = in.length();
+    size_t length = 0;
+    size_t numKeys = 0;
+    size_t key = 0;
+
+    // Length pre-pass
+    for(size_t i = 0; i < l; i++){
+        if(!isKeyed(in[i])){
+            length += 1;
+            continue;
+        }
+        const Production &p = rule(in[i], finalIteration);
+        if(p.successors.empty()){
+            // Keyed, but with nothing to do this iteration.  The key is kept.
+            length += 1;
+            numKeys += 1;
+            key++;
+            continue;
+        }
+        size_t choice = choose(p, inKeys[key++]);
+        length += p.successors[choice].length();
+        numKeys += p.keyCounts[choice];
+    }
+
+    out.resize(length);
+    outKeys.resize(numKeys);
+    char *dst = &out[0];
+    uint64_t *dstKey = outKeys.data();
+    key = 0;
+
+    // Copy pass
+    for(size_t i = 0; i < l; i++){
+        if(!isKeyed(in[i])){
+            *dst++ = in[i];
+            continue;
+        }
+        const Production &p = rule(in[i], finalIteration);
+        uint64_t k = inKeys[key++];
+        if(p.successors.empty()){
+            *dst++ = in[i];
+            *dstKey++ = k;
+            continue;
+        }
+        const std::string &s = p.successors[choose(p, k)];
+        uint32_t child = 0;
+        for(size_t j = 0; j < s.length(); j++){
+            if(isKeyed(s[j])){
+                *dstKey++ = Random::childKey(k, child++);
+            }
+        }
+        memcpy(dst, s.data(), s.length());
+        dst += s.length();
+    }
+}
+
+/**
+ * @brief LSystem::deriveParallel rewrites in into out with one chunk per thread
+ * 1. Count the keyed symbols in each chunk and scan the counts into key offsets.
+ * 2. Sum the successor lengths and output keys of each chunk and scan them into offsets.
+ * 3. Scatter every chunk's successors and keys to its offsets in parallel.
+ */
+void LSystem::deriveParallel(const std::string &in, const std::vector<uint64_t> &inKeys,
+                             std::string &out, std::vector<uint64_t> &outKeys, bool finalIteration)
+{
+    const int numChunks = m_numThreads;
+    const size_t l = in.length();
+    const char *src = in.data();
+
+    m_chunkInKeys.assign(numChunks + 1, 0);
+    m_chunkLengths.assign(numChunks + 1, 0);
+    m_chunkOutKeys.assign(numChunks + 1, 0);
+
+    // Keyed symbols per chunk
+    m_pool->run(numChunks, [&](int c){
+        size_t count = 0;
+        for(size_t i = l * c / numChunks; i < l * (c + 1) / numChunks; i++){
+            if(isKeyed(src[i])){
+                count++;
+            }
+        }
+        m_chunkInKeys[c + 1] = count;
+    });
+
+    // Exclusive scan into the index of each chunk's first input key
+    for(int c = 0; c < numChunks; c++){
+        m_chunkInKeys[c + 1] += m_chunkInKeys[c];
+    }
+
+    // Output length and key count per chunk
+    m_pool->run(numChunks, [&](int c){
+        size_t length = 0;
+        size_t numKeys = 0;
+        size_t key = m_chunkInKeys[c];
+        for(size_t i = l * c / numChunks; i < l * (c + 1) / numChunks; i++){
+            if(!isKeyed(src[i])){
+                length += 1;
+                continue;
+            }
+            const Production &p = rule(src[i], finalIteration);
+            if(p.successors.empty()){
+                length += 1;
+                numKeys += 1;
+                key++;
+                continue;
+            }
+            size_t choice = choose(p, inKeys[key++]);
+            length += p.successors[choice].length();
+            numKeys += p.keyCounts[choice];
+        }
+        m_chunkLengths[c + 1] = length;
+        m_chunkOutKeys[c + 1] = numKeys;
+    });
+
+    // Exclusive scans into the output offsets of each chunk
+    for(int c = 0; c < numChunks; c++){
+        m_chunkLengths[c + 1] += m_chunkLengths[c];
+        m_chunkOutKeys[c + 1] += m_chunkOutKeys[c];
+    }
+
+    out.resize(m_chunkLengths[numChunks]);
+    outKeys.resize(m_chunkOutKeys[numChunks]);
+    char *base = &out[0];
+    uint64_t *keyBase = outKeys.data();
+
+    // Scatter
+    m_pool->run(numChunks, [&](int c){
+        char *dst = base + m_chunkLengths[c];
+        uint64_t *dstKey = keyBase + m_chunkOutKeys[c];
+        size_t key = m_chunkInKeys[c];
+        for(size_t i = l * c / numChunks; i < l * (c + 1) / numChunks; i++){
+            if(!isKeyed(src[i])){
+                *dst++ = src[i];
+                continue;
+            }
+            const Production &p = rule(src[i], finalIteration);
+            uint64_t k = inKeys[key++];
+            if(p.successors.empty()){
+                *dst++ = src[i];
+                *dstKey++ = k;
+                continue;
+            }
+            const std::string &s = p.successors[choose(p, k)];
+            uint32_t child = 0;
+            for(size_t j = 0; j < s.length(); j++){
+                if(isKeyed(s[j])){
+                    *dstKey++ = Random::childKey(k, child++);
+                }
+            }
+            memcpy(dst, s.data(), s.length());
+            dst += s.length();
+        }
+    });
+}
+
+void LSystem::beginStream(const std::string &axiom, const std::vector<uint64_t> &keys, int numIters)
+{
+    m_streamAxiom = axiom;
+    m_streamKeys = keys;
+    m_streamIters = numIters;
+    m_stream.clear();
+    m_stream.reserve(numIters + 1);
+
+    // The axiom's keys are given rather than derived, so its frame has no key of its own.
+    StreamFrame root = {m_streamAxiom.data(), 0, m_streamAxiom.length(), 0, 0, 0};
+    m_stream.push_back(root);
+    m_peakStreamDepth = 1;
+}
+
+/**
+ * @brief LSystem::nextSymbol pulls one symbol out of the streaming derivation
+ * A symbol read at level i < numIters is replaced by its successor, which becomes a new
+ * frame at level i + 1.  Only symbols that reach the last level are returned.
+ */
+char LSystem::nextSymbol()
+{
+    while(!m_stream.empty()){
+        StreamFrame &top = m_stream.back();
+        if(top.pos == top.length){
+            m_stream.pop_back();
+            continue;
+        }
+
+        char symbol = top.symbols[top.pos++];
+        int level = top.level;
+        if(level == m_streamIters || !isKeyed(symbol)){
+            return symbol;
+        }
+
+        uint64_t key = (m_stream.size() == 1) ? m_streamKeys[top.child++] : Random::childKey(top.key, top.child++);
+
+        // Keyed symbols may still have nothing to do until the final iteration.
+        while(level < m_streamIters && rule(symbol, level + 1 == m_streamIters).successors.empty()){
+            level++;
+        }
+        if(level == m_streamIters){
+            return symbol;
+        }
+
+        const Production &p = rule(symbol, level + 1 == m_streamIters);
+        const std::string &s = p.successors[choose(p, key)];
+
+        StreamFrame frame = {s.data(), 0, s.length(), level + 1, key, 0};
+        m_stream.push_back(frame);
+        if(m_stream.size() > m_peakStreamDepth){
+            m_peakStreamDepth = m_stream.size();
+        }
+    }
+    return '\0';
+}
@@ -0,0 +1,136 @@
+#ifndef LSYSTEM_H
+#define LSYSTEM_H
+
+#include <string>
+#include <vector>
+#include "random.h"
+
+class WorkerPool;
+
+/**
+ * A table driven L-system rewriter.
+ *
+ * Every symbol maps to a list of successor strings.  Symbols with no rule are copied
+ * through unchanged, symbols with more than one successor are stochastic.  A second
+ * table can override rules on the final iteration.
+ *
+ * Stochastic choices are not drawn from a generator.  Every symbol that has a rule
+ * carries a 64 bit key, and its successor is picked by hashing that key.  The j'th
+ * such symbol in a successor gets the key Random::childKey(parent key, j), so the
+ * key of a symbol only depends on its path through the derivation.  Any part of a
+ * derivation can therefore be redone on its own, and all derivation modes agree.
+ */
+class LSystem
+{
+public:
+    LSystem();
+    ~LSystem();
+
+    // Adds a successor for a symbol.  Adding several makes the rule stochastic.
+    void addRule(char symbol, const std::string &successor);
+
+    // Adds a successor that is only used on the last iteration of a derivation.
+    void addFinalRule(char symbol, const std::string &successor);
+
+    // Removes every rule.
+    void clearRules();
+
+    // True if the symbol has a rule, and so carries a key.
+    bool isKeyed(char symbol) const { return m_keyed[(unsigned char)symbol]; }
+
+    // Rewrites every symbol of in once and writes the result to out.  inKeys holds the
+    // keys of the keyed symbols of in, in order, and outKeys receives those of out.
+    void derive(const std::string &in, const std::vector<uint64_t> &inKeys,
+                std::string &out, std::vector<uint64_t> &outKeys, bool finalIteration);
+
+    // Sets how many threads derive may use.  Long strings are then split into chunks that
+    // are rewritten in parallel on a pool kept for the purpose.  The result is identical
+    // to the single threaded one.
+    void setThreadCount(int numThreads);
+    int threadCount() const { return m_numThreads; }
+
+    // Starts a streaming derivation of axiom.  Nothing is materialized, instead
+    // nextSymbol expands symbols depth first as they are consumed.
+    void beginStream(const std::string &axiom, const std::vector<uint64_t> &keys, int numIters);
+
+    // Returns the next symbol of the fully derived string, or '\0' at the end.
+    char nextSymbol();
+
+    // The deepest the expansion stack has been since beginStream
+    size_t peakStreamDepth() const { return m_peakStreamDepth; }
+
+    // Throughput numbers for the most recent call to derive
+    struct DeriveStats
+    {
+        size_t symbolsIn;
+        size_t symbolsOut;
+        double seconds;
+    };
+    const DeriveStats &lastStats() const { return m_lastStats; }
+
+protected:
+
+    struct Production
+    {
+        std::vector<std::string> successors;
+        // How many keyed symbols each successor contains
+        std::vector<size_t> keyCounts;
+    };
+
+    // Returns the rule for a symbol, preferring the final table on the last iteration.
+    const Production &rule(char symbol, bool finalIteration) const;
+
+    // Picks the successor of a symbol from its key.
+    static size_t choose(const Production &p, uint64_t key);
+
+    // Recounts the keyed symbols of every successor after the rules change.
+    void countKeys();
+
+    // Indexed directly by symbol
+    Production m_rules[256];
+    Production m_finalRules[256];
+    bool m_keyed[256];
+
+    void deriveSerial(const std::string &in, const std::vector<uint64_t> &inKeys,
+                      std::string &out, std::vector<uint64_t> &outKeys, bool finalIteration);
+    void deriveParallel(const std::string &in, const std::vector<uint64_t> &inKeys,
+                        std::string &out, std::vector<uint64_t> &outKeys, bool finalIteration);
+
+    int m_numThreads;
+    // Made by setThreadCount when there is more than one thread
+    WorkerPool *m_pool;
+
+    // Per chunk counts for the parallel path, turned into offsets by an exclusive scan.
+    std::vector<size_t> m_chunkInKeys;
+    std::vector<size_t> m_chunkLengths;
+    std::vector<size_t> m_chunkOutKeys;
+
+    DeriveStats m_lastStats;
+
+    // One partially consumed successor string in a streaming derivation
+    struct StreamFrame
+    {
+        const char *symbols;
+        size_t pos;
+        size_t length;
+        int level;
+        // Key of the symbol this frame is the successor of, and how many of its keyed
+        // symbols have been read so far.
+        uint64_t key;
+        uint32_t child;
+    };
+
+    // Holds at most one frame per iteration, so it never grows with the string length.
+    std::vector<StreamFrame> m_stream;
+    std::string m_streamAxiom;
+    std::vector<uint64_t> m_streamKeys;
+    int m_streamIters;
+    size_t m_peakStreamDepth;
+
+private:
+    // The pool can't be shared
+    LSystem(const LSystem &);
+    LSystem &operator=(const LSystem &);
+};
+
+#endif // LSYSTEM_H
@@ -0,0 +1,88 @@
+#include "parallel.h"
+
+WorkerPool::WorkerPool(int numThreads)
+{
+    m_job = 0;
+    m_jobSize = 0;
+    m_busy = 0;
+    m_generation = 0;
+    m_quit = false;
+    for(int t = 1; t < numThreads; t++){
+        m_threads.push_back(std::thread(&WorkerPool::work, this, t));
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_wake.notify_all();
+    for(size_t t = 0; t < m_threads.size(); t++){
+        m_threads[t].join();
+    }
+}
+
+/**
+ * @brief WorkerPool::run hands fn to the waiting threads and does its own share
+ * Only the threads with an index below n are counted as busy, so a job smaller than the
+ * pool doesn't wait on threads that have nothing to do.
+ */
+void WorkerPool::run(int n, const std::function<void(int)> &fn)
+{
+    if(n > numThreads()){
+        n = numThreads();
+    }
+    if(n > 1){
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_job = &fn;
+            m_jobSize = n;
+            m_busy = n - 1;
+            m_generation++;
+        }
+        m_wake.notify_all();
+    }
+
+    if(n > 0){
+        fn(0);
+    }
+
+    if(n > 1){
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [this](){ return m_busy == 0; });
+        m_job = 0;
+    }
+}
+
+void WorkerPool::work(int index)
+{
+    unsigned seen = 0;
+    while(true){
+        const std::function<void(int)> *job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [&](){ return m_quit || m_generation != seen; });
+            if(m_quit){
+                return;
+            }
+            seen = m_generation;
+            if(index >= m_jobSize){
+                continue;
+            }
+            job = m_job;
+        }
+
+        (*job)(index);
+
+        bool last;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            last = (--m_busy == 0);
+        }
+        if(last){
+            m_done.notify_one();
+        }
+    }
+}
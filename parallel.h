@@ -0,0 +1,47 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Threads that are started once and kept waiting for work, for jobs run so often, like
+ * culling every frame or each iteration of a derivation, that starting and joining
+ * threads each time would cost as much as the job.
+ *
+ * Only one thread may call run at a time.
+ */
+class WorkerPool
+{
+public:
+    // A pool of numThreads, the calling thread of run being one of them
+    explicit WorkerPool(int numThreads);
+    ~WorkerPool();
+
+    int numThreads() const { return (int)m_threads.size() + 1; }
+
+    // Runs fn(0) .. fn(n - 1) and waits for all of them, n being at most numThreads.
+    // fn(0) runs on the calling thread.
+    void run(int n, const std::function<void(int)> &fn);
+
+private:
+    void work(int index);
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+
+    // The job being run, and how many of the pool's threads are still on it.  Each new
+    // job bumps m_generation, which is what wakes the threads.
+    const std::function<void(int)> *m_job;
+    int m_jobSize;
+    int m_busy;
+    unsigned m_generation;
+    bool m_quit;
+};
+
+#endif // PARALLEL_H
@@ -0,0 +1,792 @@
+#include "parametriclsystem.h"
+#include <algorithm>
+#include <sstream>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The same slot LSystem picks successors with, so equivalent grammars derive equal strings.
+#define CHOICE_SLOT 0xFFFFFFFFu
+
+// rand() draws from here up, clear of the slots the turtle uses with the same key.
+#define RAND_SLOT 0x80000000u
+
+// Limits that let the interpreter work from fixed size arrays
+#define MAX_STACK 32
+#define MAX_PRODUCTIONS 32
+#define MAX_ARITY 16
+
+/**
+ * Turns grammar source into bytecode for a ParametricLSystem.  Expressions are parsed by
+ * recursive descent and emitted in postfix order as they are recognized.
+ */
+class GrammarParser
+{
+public:
+    GrammarParser(ParametricLSystem &target) : m_target(target), m_line(0), m_depth(0) {}
+
+    bool parse(const std::string &source);
+
+    std::string error() const { return m_error; }
+
+private:
+    bool parseLine();
+    bool parseProduction();
+    bool parseModules(char predecessor);
+    bool checkBranches();
+    bool setArity(char symbol, int arity);
+    void emitLiteral(std::string &literal);
+    bool sameCondition(uint32_t a, uint32_t b) const;
+
+    bool parseOr();
+    bool parseAnd();
+    bool parseComparison();
+    bool parseSum();
+    bool parseProduct();
+    bool parseUnary();
+    bool parsePrimary();
+
+    void emit(ParametricLSystem::Opcode op, uint32_t arg = 0, int stackChange = 0);
+    void skipSpace();
+    bool accept(const char *token);
+    bool fail(const std::string &message);
+
+    ParametricLSystem &m_target;
+
+    std::string m_text;
+    size_t m_pos;
+    int m_line;
+    std::string m_error;
+
+    // Parameter names of the production being parsed
+    std::vector<std::string> m_names;
+    int m_depth;
+
+    std::vector<ParametricLSystem::Production> m_bySymbol[256];
+    bool m_hasAxiom;
+
+    // The symbols of every successor, for checking them once all are known
+    struct Successor
+    {
+        char predecessor;   // '\0' for the axiom
+        std::string symbols;
+        int line;
+    };
+    std::vector<Successor> m_successors;
+};
+
+bool GrammarParser::parse(const std::string &source)
+{
+    m_target.m_code.clear();
+    m_target.m_constants.clear();
+    m_target.m_productions.clear();
+    m_target.m_literals.clear();
+    m_target.m_literalSymbols.clear();
+    for(int i = 0; i < 256; i++){
+        m_target.m_arity[i] = -1;
+    }
+    m_hasAxiom = false;
+
+    // Offset 0 is a lone OP_END, the condition of every production without one.
+    emit(ParametricLSystem::OP_END);
+
+    std::istringstream lines(source);
+    while(std::getline(lines, m_text)){
+        m_line++;
+        size_t comment = m_text.find('#');
+        if(comment != std::string::npos){
+            m_text.erase(comment);
+        }
+        m_pos = 0;
+        // emit can fail too, on an expression that is too deep
+        if(!parseLine() || !m_error.empty()){
+            return false;
+        }
+    }
+    if(!m_hasAxiom){
+        m_line = 0;
+        return fail("no axiom");
+    }
+    if(!checkBranches()){
+        return false;
+    }
+
+    // Flatten the productions so each symbol's are contiguous.
+    for(int s = 0; s < 256; s++){
+        m_target.m_first[s] = (uint32_t)m_target.m_productions.size();
+        m_target.m_productions.insert(m_target.m_productions.end(), m_bySymbol[s].begin(), m_bySymbol[s].end());
+        if(m_target.m_arity[s] < 0){
+            m_target.m_arity[s] = 0;
+        }
+    }
+    m_target.m_first[256] = (uint32_t)m_target.m_productions.size();
+
+    // Which symbols are keyed is only known now.
+    for(size_t i = 0; i < m_target.m_literals.size(); i++){
+        ParametricLSystem::Literal &l = m_target.m_literals[i];
+        for(uint32_t j = 0; j < l.length; j++){
+            l.numKeys += m_target.isKeyed(m_target.m_literalSymbols[l.offset + j]);
+        }
+    }
+    for(int s = 0; s < 256; s++){
+        // Copying a module through is the least any symbol can turn into.
+        ParametricLSystem::Bound &bound = m_target.m_bounds[s];
+        bound.numSymbols = 1;
+        bound.numParams = m_target.m_arity[s];
+        bound.numKeys = m_target.isKeyed((char)s);
+
+        for(uint32_t i = m_target.m_first[s]; i < m_target.m_first[s + 1]; i++){
+            uint32_t numSymbols, numParams, numKeys;
+            m_target.countOutput(m_target.m_productions[i].successor, numSymbols, numParams, numKeys);
+            bound.numSymbols = std::max(bound.numSymbols, numSymbols);
+            bound.numParams = std::max(bound.numParams, numParams);
+            bound.numKeys = std::max(bound.numKeys, numKeys);
+        }
+    }
+    return true;
+}
+
+bool GrammarParser::parseLine()
+{
+    skipSpace();
+    if(m_pos == m_text.length()){
+        return true;
+    }
+
+    if(accept("axiom:")){
+        // The axiom is a successor with no predecessor, run once per tree.
+        m_names.clear();
+        m_target.m_axiomCode = (uint32_t)m_target.m_code.size();
+        m_hasAxiom = true;
+        return parseModules('\0');
+    }
+    if(accept("iterations:")){
+        skipSpace();
+        char *end;
+        long n = strtol(m_text.c_str() + m_pos, &end, 10);
+        if(end == m_text.c_str() + m_pos || n < 0){
+            return fail("expected an iteration count");
+        }
+        m_pos = end - m_text.c_str();
+        m_target.m_iterations = (int)n;
+        skipSpace();
+        return (m_pos == m_text.length()) ? true : fail("unexpected text after the iteration count");
+    }
+    return parseProduction();
+}
+
+// symbol(name, ...) : condition -> successor
+bool GrammarParser::parseProduction()
+{
+    char symbol = m_text[m_pos++];
+    m_names.clear();
+
+    skipSpace();
+    if(accept("(")){
+        do {
+            skipSpace();
+            size_t start = m_pos;
+            while(m_pos < m_text.length() && (isalnum((unsigned char)m_text[m_pos]) || m_text[m_pos] == '_')){
+                m_pos++;
+            }
+            if(m_pos == start){
+                return fail("expected a parameter name");
+            }
+            m_names.push_back(m_text.substr(start, m_pos - start));
+            skipSpace();
+        } while(accept(","));
+        if(!accept(")")){
+            return fail("expected )");
+        }
+    }
+    if(!setArity(symbol, (int)m_names.size())){
+        return false;
+    }
+
+    ParametricLSystem::Production p;
+    p.condition = 0;
+    skipSpace();
+    if(accept(":")){
+        p.condition = (uint32_t)m_target.m_code.size();
+        m_depth = 0;
+        if(!parseOr()){
+            return false;
+        }
+        emit(ParametricLSystem::OP_END);
+        skipSpace();
+    }
+    if(!accept("->")){
+        return fail("expected ->");
+    }
+
+    p.successor = (uint32_t)m_target.m_code.size();
+    if(!parseModules(symbol)){
+        return false;
+    }
+
+    std::vector<ParametricLSystem::Production> &list = m_bySymbol[(unsigned char)symbol];
+    if(list.size() == MAX_PRODUCTIONS){
+        return fail("too many productions for one symbol");
+    }
+    p.sameCondition = !list.empty() && sameCondition(list.back().condition, p.condition);
+    list.push_back(p);
+    return true;
+}
+
+// A list of modules up to the end of the line.  Runs of symbols without parameters are
+// copied by a single OP_LITERAL, the rest are OP_SYMBOL followed by an OP_EMIT per parameter.
+bool GrammarParser::parseModules(char predecessor)
+{
+    Successor successor = {predecessor, std::string(), m_line};
+    std::string literal;
+    while(true){
+        skipSpace();
+        if(m_pos == m_text.length()){
+            break;
+        }
+        char symbol = m_text[m_pos++];
+        if(symbol == '(' || symbol == ')' || symbol == ','){
+            return fail(std::string("unexpected ") + symbol);
+        }
+        successor.symbols += symbol;
+
+        int arity = 0;
+        if(m_pos < m_text.length() && m_text[m_pos] == '('){
+            m_pos++;
+            emitLiteral(literal);
+            emit(ParametricLSystem::OP_SYMBOL, (unsigned char)symbol);
+            do {
+                m_depth = 0;
+                if(!parseOr()){
+                    return false;
+                }
+                emit(ParametricLSystem::OP_EMIT, 0, -1);
+                arity++;
+                skipSpace();
+            } while(accept(","));
+            if(!accept(")")){
+                return fail("expected )");
+            }
+        } else {
+            literal += symbol;
+        }
+        if(!setArity(symbol, arity)){
+            return false;
+        }
+    }
+    emitLiteral(literal);
+    emit(ParametricLSystem::OP_END);
+    m_successors.push_back(successor);
+    return true;
+}
+
+// Makes sure the turtle never opens a branch nothing set up.  Each [ takes the parameters
+// of one of the branches an a, b or c adds, and a symbol with a production that starts with
+// [ may open one, so it takes one too and hands it on to its successors.  The axiom has the
+// trunk's.  Brackets must also balance within each successor.
+bool GrammarParser::checkBranches()
+{
+    bool opens[256] = {false};
+    for(size_t i = 0; i < m_successors.size(); i++){
+        const Successor &s = m_successors[i];
+        if(s.predecessor != '\0' && !s.symbols.empty() && s.symbols[0] == '['){
+            opens[(unsigned char)s.predecessor] = true;
+        }
+    }
+    for(size_t i = 0; i < m_successors.size(); i++){
+        const Successor &s = m_successors[i];
+        m_line = s.line;
+        int available = (s.predecessor == '\0' || opens[(unsigned char)s.predecessor]) ? 1 : 0;
+        int depth = 0;
+        for(size_t j = 0; j < s.symbols.length(); j++){
+            char c = s.symbols[j];
+            if(c == 'a' || c == 'b' || c == 'c'){
+                available += c - 'a' + 1;
+            } else if(c == ']' && --depth < 0){
+                return fail("unmatched ]");
+            } else if(c == '[' || opens[(unsigned char)c]){
+                depth += (c == '[');
+                if(available-- == 0){
+                    return fail(std::string("nothing sets up the branch of ") + c);
+                }
+            }
+        }
+        if(depth != 0){
+            return fail("unmatched [");
+        }
+    }
+    return true;
+}
+
+void GrammarParser::emitLiteral(std::string &literal)
+{
+    if(literal.empty()){
+        return;
+    }
+    // The keyed symbols in it are counted once the grammar is complete.
+    ParametricLSystem::Literal l = {(uint32_t)m_target.m_literalSymbols.length(), (uint32_t)literal.length(), 0};
+    m_target.m_literalSymbols += literal;
+    emit(ParametricLSystem::OP_LITERAL, (uint32_t)m_target.m_literals.size());
+    m_target.m_literals.push_back(l);
+    literal.clear();
+}
+
+// True if the conditions at a and b are the same code, and neither calls rand().
+bool GrammarParser::sameCondition(uint32_t a, uint32_t b) const
+{
+    const std::vector<uint32_t> &code = m_target.m_code;
+    while(code[a] == code[b]){
+        if((code[a] & 0xFF) == ParametricLSystem::OP_RAND){
+            return false;
+        }
+        if(code[a] == ParametricLSystem::encode(ParametricLSystem::OP_END)){
+            return true;
+        }
+        a++;
+        b++;
+    }
+    return false;
+}
+
+bool GrammarParser::setArity(char symbol, int arity)
+{
+    int &known = m_target.m_arity[(unsigned char)symbol];
+    if(arity > MAX_ARITY){
+        return fail("too many parameters");
+    }
+    if(known >= 0 && known != arity){
+        std::ostringstream message;
+        message << "'" << symbol << "' has " << arity << " parameters here but " << known << " elsewhere";
+        return fail(message.str());
+    }
+    known = arity;
+    return true;
+}
+
+bool GrammarParser::parseOr()
+{
+    if(!parseAnd()) return false;
+    while(accept("||")){
+        if(!parseAnd()) return false;
+        emit(ParametricLSystem::OP_OR, 0, -1);
+    }
+    return true;
+}
+
+bool GrammarParser::parseAnd()
+{
+    if(!parseComparison()) return false;
+    while(accept("&&")){
+        if(!parseComparison()) return false;
+        emit(ParametricLSystem::OP_AND, 0, -1);
+    }
+    return true;
+}
+
+bool GrammarParser::parseComparison()
+{
+    if(!parseSum()) return false;
+    while(true){
+        ParametricLSystem::Opcode op;
+        // Two character operators first, so <= isn't read as <
+        if(accept("<=")) op = ParametricLSystem::OP_LE;
+        else if(accept(">=")) op = ParametricLSystem::OP_GE;
+        else if(accept("==")) op = ParametricLSystem::OP_EQ;
+        else if(accept("!=")) op = ParametricLSystem::OP_NE;
+        else if(accept("<")) op = ParametricLSystem::OP_LT;
+        else if(accept(">")) op = ParametricLSystem::OP_GT;
+        else return true;
+        if(!parseSum()) return false;
+        emit(op, 0, -1);
+    }
+}
+
+bool GrammarParser::parseSum()
+{
+    if(!parseProduct()) return false;
+    while(true){
+        skipSpace();
+        ParametricLSystem::Opcode op;
+        if(accept("+")) op = ParametricLSystem::OP_ADD;
+        // A - that starts -> ends the condition instead
+        else if(m_text.compare(m_pos, 2, "->") != 0 && accept("-")) op = ParametricLSystem::OP_SUB;
+        else return true;
+        if(!parseProduct()) return false;
+        emit(op, 0, -1);
+    }
+}
+
+bool GrammarParser::parseProduct()
+{
+    if(!parseUnary()) return false;
+    while(true){
+        ParametricLSystem::Opcode op;
+        if(accept("*")) op = ParametricLSystem::OP_MUL;
+        else if(accept("/")) op = ParametricLSystem::OP_DIV;
+        else return true;
+        if(!parseUnary()) return false;
+        emit(op, 0, -1);
+    }
+}
+
+bool GrammarParser::parseUnary()
+{
+    if(accept("-")){
+        if(!parseUnary()) return false;
+        emit(ParametricLSystem::OP_NEG);
+        return true;
+    }
+    if(accept("!")){
+        if(!parseUnary()) return false;
+        emit(ParametricLSystem::OP_NOT);
+        return true;
+    }
+    return parsePrimary();
+}
+
+bool GrammarParser::parsePrimary()
+{
+    skipSpace();
+    if(accept("(")){
+        if(!parseOr()) return false;
+        return accept(")") ? true : fail("expected )");
+    }
+    if(m_pos == m_text.length()){
+        return fail("expected an expression");
+    }
+
+    char c = m_text[m_pos];
+    if(isdigit((unsigned char)c) || c == '.'){
+        char *end;
+        float value = strtof(m_text.c_str() + m_pos, &end);
+        m_pos = end - m_text.c_str();
+        // Equal constants share a slot, so equal expressions compile to equal code.
+        std::vector<float> &constants = m_target.m_constants;
+        size_t index = std::find(constants.begin(), constants.end(), value) - constants.begin();
+        if(index == constants.size()){
+            constants.push_back(value);
+        }
+        emit(ParametricLSystem::OP_CONST, (uint32_t)index, 1);
+        return true;
+    }
+    if(isalpha((unsigned char)c) || c == '_'){
+        size_t start = m_pos;
+        while(m_pos < m_text.length() && (isalnum((unsigned char)m_text[m_pos]) || m_text[m_pos] == '_')){
+            m_pos++;
+        }
+        std::string name = m_text.substr(start, m_pos - start);
+        if(name == "rand"){
+            if(!accept("(") || !accept(")")){
+                return fail("expected rand()");
+            }
+            emit(ParametricLSystem::OP_RAND, 0, 1);
+            return true;
+        }
+        for(size_t i = 0; i < m_names.size(); i++){
+            if(m_names[i] == name){
+                emit(ParametricLSystem::OP_PARAM, (uint32_t)i, 1);
+                return true;
+            }
+        }
+        return fail("unknown parameter " + name);
+    }
+    return fail(std::string("unexpected ") + c);
+}
+
+void GrammarParser::emit(ParametricLSystem::Opcode op, uint32_t arg, int stackChange)
+{
+    std::vector<uint32_t> &code = m_target.m_code;
+
+    // A binary operator right after a parameter and a constant, as in n - 1, takes those
+    // two as its operands.  The three become one OP_PARAM_CONST.
+    size_t n = code.size();
+    if(op >= ParametricLSystem::OP_ADD && op <= ParametricLSystem::OP_OR && op != ParametricLSystem::OP_NEG && n >= 2
+            && (code[n - 2] & 0xFF) == ParametricLSystem::OP_PARAM && (code[n - 2] >> 8) < 256
+            && (code[n - 1] & 0xFF) == ParametricLSystem::OP_CONST && (code[n - 1] >> 8) < 256){
+        uint32_t fused = (code[n - 2] >> 8) | ((code[n - 1] >> 8) << 8) | ((uint32_t)op << 16);
+        code.resize(n - 2);
+        code.push_back(ParametricLSystem::encode(ParametricLSystem::OP_PARAM_CONST, fused));
+        m_depth += stackChange;
+        return;
+    }
+
+    code.push_back(ParametricLSystem::encode(op, arg));
+    m_depth += stackChange;
+    if(m_depth > MAX_STACK){
+        fail("expression too deep");
+    }
+}
+
+void GrammarParser::skipSpace()
+{
+    while(m_pos < m_text.length() && isspace((unsigned char)m_text[m_pos])){
+        m_pos++;
+    }
+}
+
+// Skips whitespace, then consumes token if it is next.
+bool GrammarParser::accept(const char *token)
+{
+    skipSpace();
+    size_t l = strlen(token);
+    if(m_text.compare(m_pos, l, token) == 0){
+        m_pos += l;
+        return true;
+    }
+    return false;
+}
+
+bool GrammarParser::fail(const std::string &message)
+{
+    if(m_error.empty()){
+        std::ostringstream s;
+        s << "line " << m_line << ": " << message;
+        m_error = s.str();
+    }
+    return false;
+}
+
+
+ParametricLSystem::ParametricLSystem()
+{
+    // An empty grammar whose axiom is empty
+    m_code.push_back(encode(OP_END));
+    m_axiomCode = 0;
+    m_iterations = 0;
+    for(int i = 0; i < 256; i++){
+        m_arity[i] = 0;
+        m_first[i] = 0;
+        m_bounds[i].numSymbols = 1;
+        m_bounds[i].numParams = 0;
+        m_bounds[i].numKeys = 0;
+    }
+    m_first[256] = 0;
+}
+
+bool ParametricLSystem::compile(const std::string &source, std::string *error)
+{
+    // Parse into a copy, so a bad grammar leaves this one untouched.
+    ParametricLSystem next;
+    next.m_iterations = 0;
+    GrammarParser parser(next);
+    if(!parser.parse(source)){
+        if(error){
+            *error = parser.error();
+        }
+        return false;
+    }
+    *this = next;
+    return true;
+}
+
+void ParametricLSystem::axiom(uint64_t seed, ModuleString &out) const
+{
+    uint32_t numSymbols, numParams, numKeys;
+    countOutput(m_axiomCode, numSymbols, numParams, numKeys);
+    out.symbols.resize(numSymbols);
+    out.params.resize(numParams);
+    out.keys.resize(numKeys);
+
+    Output o = {&out.symbols[0], out.params.data(), out.keys.data()};
+    uint32_t slot = 0;
+    uint32_t child = 0;
+    run(m_axiomCode, 0, seed, slot, &o, child);
+}
+
+void ParametricLSystem::countOutput(uint32_t pc, uint32_t &numSymbols, uint32_t &numParams, uint32_t &numKeys) const
+{
+    numSymbols = numParams = numKeys = 0;
+    for(; (m_code[pc] & 0xFF) != OP_END; pc++){
+        if((m_code[pc] & 0xFF) == OP_SYMBOL){
+            numSymbols++;
+            numKeys += isKeyed((char)(m_code[pc] >> 8));
+        } else if((m_code[pc] & 0xFF) == OP_LITERAL){
+            numSymbols += m_literals[m_code[pc] >> 8].length;
+            numKeys += m_literals[m_code[pc] >> 8].numKeys;
+        } else if((m_code[pc] & 0xFF) == OP_EMIT){
+            numParams++;
+        }
+    }
+}
+
+inline float ParametricLSystem::binary(Opcode op, float a, float b)
+{
+    switch(op){
+    case OP_ADD: return a + b;
+    case OP_SUB: return a - b;
+    case OP_MUL: return a * b;
+    case OP_DIV: return a / b;
+    case OP_LT: return a < b;
+    case OP_LE: return a <= b;
+    case OP_GT: return a > b;
+    case OP_GE: return a >= b;
+    case OP_EQ: return a == b;
+    case OP_NE: return a != b;
+    case OP_AND: return (a != 0.0f) && (b != 0.0f);
+    case OP_OR: return (a != 0.0f) || (b != 0.0f);
+    default: return 0.0f;
+    }
+}
+
+/**
+ * @brief ParametricLSystem::run is the bytecode interpreter
+ * @param params the predecessor's parameters
+ * @param key the predecessor's key, which rand() and the keys of the output come from
+ * @param out where OP_SYMBOL and OP_EMIT write, unused by conditions
+ */
+inline float ParametricLSystem::run(uint32_t pc, const float *params, uint64_t key, uint32_t &slot,
+                             Output *out, uint32_t &child) const
+{
+    float stack[MAX_STACK + 1];
+    int top = 0;
+    const uint32_t *code = m_code.data();
+
+    while(true){
+        uint32_t instruction = code[pc++];
+        uint32_t arg = instruction >> 8;
+        switch(instruction & 0xFF){
+        case OP_END:
+            return (top == 0) ? 1.0f : stack[top - 1];
+        case OP_CONST:
+            stack[top++] = m_constants[arg];
+            break;
+        case OP_PARAM:
+            stack[top++] = params[arg];
+            break;
+        case OP_RAND:
+            stack[top++] = Random::hashFloat(key, RAND_SLOT + slot++);
+            break;
+        case OP_ADD: top--; stack[top - 1] = stack[top - 1] + stack[top]; break;
+        case OP_SUB: top--; stack[top - 1] = stack[top - 1] - stack[top]; break;
+        case OP_MUL: top--; stack[top - 1] = stack[top - 1] * stack[top]; break;
+        case OP_DIV: top--; stack[top - 1] = stack[top - 1] / stack[top]; break;
+        case OP_NEG: stack[top - 1] = -stack[top - 1]; break;
+        case OP_LT: top--; stack[top - 1] = stack[top - 1] < stack[top]; break;
+        case OP_LE: top--; stack[top - 1] = stack[top - 1] <= stack[top]; break;
+        case OP_GT: top--; stack[top - 1] = stack[top - 1] > stack[top]; break;
+        case OP_GE: top--; stack[top - 1] = stack[top - 1] >= stack[top]; break;
+        case OP_EQ: top--; stack[top - 1] = stack[top - 1] == stack[top]; break;
+        case OP_NE: top--; stack[top - 1] = stack[top - 1] != stack[top]; break;
+        case OP_AND: top--; stack[top - 1] = (stack[top - 1] != 0.0f) && (stack[top] != 0.0f); break;
+        case OP_OR: top--; stack[top - 1] = (stack[top - 1] != 0.0f) || (stack[top] != 0.0f); break;
+        case OP_NOT: stack[top - 1] = (stack[top - 1] == 0.0f); break;
+        case OP_SYMBOL:
+            *out->symbols++ = (char)arg;
+            if(isKeyed((char)arg)){
+                *out->keys++ = Random::childKey(key, child++);
+            }
+            break;
+        case OP_PARAM_CONST:
+            stack[top++] = binary((Opcode)(arg >> 16), params[arg & 0xFF], m_constants[(arg >> 8) & 0xFF]);
+            break;
+        case OP_LITERAL: {
+            const Literal &l = m_literals[arg];
+            memcpy(out->symbols, m_literalSymbols.data() + l.offset, l.length);
+            out->symbols += l.length;
+            for(uint32_t j = 0; j < l.numKeys; j++){
+                *out->keys++ = Random::childKey(key, child++);
+            }
+            break;
+        }
+        case OP_EMIT:
+            *out->params++ = stack[--top];
+            break;
+        }
+    }
+}
+
+inline bool ParametricLSystem::test(uint32_t pc, const float *params, uint64_t key, uint32_t &slot) const
+{
+    if(pc == 0){
+        return true;
+    }
+    // The common case of comparing a parameter to a constant is done in place.
+    if((m_code[pc] & 0xFF) == OP_PARAM_CONST && m_code[pc + 1] == OP_END){
+        uint32_t arg = m_code[pc] >> 8;
+        return binary((Opcode)(arg >> 16), params[arg & 0xFF], m_constants[(arg >> 8) & 0xFF]) != 0.0f;
+    }
+    uint32_t child = 0;
+    return run(pc, params, key, slot, 0, child) != 0.0f;
+}
+
+/**
+ * @brief ParametricLSystem::derive rewrites every module once
+ * Each keyed module evaluates the conditions of its productions, picks one of the
+ * matches by its key and runs that production's successor program into out.  Modules
+ * with no matching production are copied through, key and all.
+ */
+void ParametricLSystem::derive(const ModuleString &in, ModuleString &out) const
+{
+    // Size the output for the largest thing each module could turn into, so the main
+    // loop can write through raw pointers without checking for room.
+    size_t maxSymbols = 0, maxParams = 0, maxKeys = 0;
+    for(size_t i = 0; i < in.symbols.length(); i++){
+        const Bound &b = m_bounds[(unsigned char)in.symbols[i]];
+        maxSymbols += b.numSymbols;
+        maxParams += b.numParams;
+        maxKeys += b.numKeys;
+    }
+    out.symbols.resize(maxSymbols);
+    out.params.resize(maxParams);
+    out.keys.resize(maxKeys);
+
+    // Everything is read and written through locals.  Stores through a char pointer may
+    // alias anything, which would otherwise reload the tables after every symbol.
+    Output o = {&out.symbols[0], out.params.data(), out.keys.data()};
+    const char *symbols = in.symbols.data();
+    const size_t length = in.symbols.length();
+    const float *params = in.params.data();
+    const uint64_t *keys = in.keys.data();
+    const int *arity = m_arity;
+    const uint32_t *firstProduction = m_first;
+    const Production *productions = m_productions.data();
+    uint32_t matches[MAX_PRODUCTIONS];
+
+    for(size_t i = 0; i < length; i++){
+        unsigned char s = (unsigned char)symbols[i];
+        int n = arity[s];
+        uint32_t first = firstProduction[s];
+        uint32_t last = firstProduction[s + 1];
+
+        if(first == last){
+            *o.symbols++ = (char)s;
+            for(int j = 0; j < n; j++){
+                *o.params++ = params[j];
+            }
+            params += n;
+            continue;
+        }
+
+        uint64_t k = *keys++;
+        uint32_t slot = 0;
+        uint32_t child = 0;
+
+        uint32_t numMatches = 0;
+        bool match = false;
+        for(uint32_t p = first; p < last; p++){
+            const Production &production = productions[p];
+            if(!production.sameCondition){
+                match = test(production.condition, params, k, slot);
+            }
+            if(match){
+                matches[numMatches++] = p;
+            }
+        }
+
+        if(numMatches == 0){
+            *o.symbols++ = (char)s;
+            for(int j = 0; j < n; j++){
+                *o.params++ = params[j];
+            }
+            *o.keys++ = k;
+        } else {
+            uint32_t choice = (numMatches == 1) ? 0 : Random::hashUInt(k, CHOICE_SLOT) % numMatches;
+            run(productions[matches[choice]].successor, params, k, slot, &o, child);
+        }
+        params += n;
+    }
+
+    out.symbols.resize(o.symbols - &out.symbols[0]);
+    out.params.resize(o.params - out.params.data());
+    out.keys.resize(o.keys - out.keys.data());
+}
@@ -0,0 +1,153 @@
+#ifndef PARAMETRICLSYSTEM_H
+#define PARAMETRICLSYSTEM_H
+
+#include <string>
+#include <vector>
+#include "random.h"
+
+/**
+ * A parametric L-system whose productions are compiled to bytecode.
+ *
+ * Grammars are plain text, one statement per line, with # starting a comment:
+ *
+ *     axiom: !(5)
+ *     iterations: 6
+ *     !(n) : n > 0 -> [b!(n-1)!(n-1)]
+ *     !(n) : n > 0 -> [c!(n-1)!(n-1)!(n-1)]
+ *     !(n) : n == 0 -> [x]
+ *
+ * A module is a symbol with zero or more float parameters, and each symbol always has
+ * the same number of them.  A production's condition and successor parameters are
+ * expressions over the predecessor's parameters, numbers, rand(), + - * /, comparisons,
+ * && || and !.  When several productions of a symbol match, one is picked with equal odds.
+ *
+ * Keys work as in LSystem: every symbol with a production carries one, successors are
+ * picked by hashing it, and rand() draws from it, so a derivation is reproducible.
+ *
+ * Every [ must take the parameters of a branch set up by an a, b or c, or by the symbol
+ * the successor replaces when one of its productions starts with [.  compile rejects
+ * grammars that open branches nothing set up or leave brackets unbalanced.
+ *
+ * The flexibility costs time: the grammar above derives about 4x slower than the same
+ * rules through LSystem's tables (1.4 ms against 0.3 ms for 50 trees of 7 iterations).
+ */
+class ParametricLSystem
+{
+public:
+    ParametricLSystem();
+
+    // A derived string.  Parameters and keys are stored back to back in module order.
+    struct ModuleString
+    {
+        std::string symbols;
+        std::vector<float> params;
+        // Keys of the keyed modules
+        std::vector<uint64_t> keys;
+
+        void clear() { symbols.clear(); params.clear(); keys.clear(); }
+    };
+
+    // Replaces the grammar with the given source.  On a syntax error the old grammar is
+    // kept, false is returned and error describes the problem.
+    bool compile(const std::string &source, std::string *error = 0);
+
+    // The axiom of the grammar, with keys for its keyed modules made from seed.
+    void axiom(uint64_t seed, ModuleString &out) const;
+
+    int iterations() const { return m_iterations; }
+
+    // Number of parameters the modules of a symbol have
+    int arity(char symbol) const { return m_arity[(unsigned char)symbol]; }
+
+    // True if the symbol has a production, and so carries a key.
+    bool isKeyed(char symbol) const { return m_first[(unsigned char)symbol] != m_first[(unsigned char)symbol + 1]; }
+
+    // Rewrites every module of in once and writes the result to out.
+    void derive(const ModuleString &in, ModuleString &out) const;
+
+protected:
+
+    enum Opcode
+    {
+        OP_END,
+        OP_CONST,       // Push m_constants[arg]
+        OP_PARAM,       // Push the predecessor's parameter arg
+        OP_RAND,        // Push the next random draw of the predecessor's key
+        OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_NEG,
+        OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE,
+        OP_AND, OP_OR, OP_NOT,
+        OP_PARAM_CONST, // Push params[a] op m_constants[b], with a, b and op packed into arg
+        OP_SYMBOL,      // Append the module arg to the output
+        OP_LITERAL,     // Append the parameterless modules of m_literals[arg]
+        OP_EMIT         // Pop a value into the output parameters
+    };
+
+    // One instruction is the opcode in the low byte and its argument above it.
+    static uint32_t encode(Opcode op, uint32_t arg = 0) { return (uint32_t)op | (arg << 8); }
+
+    struct Production
+    {
+        // Offsets into m_code.  A production without a condition has condition == 0,
+        // where a lone OP_END that leaves nothing on the stack is found.
+        uint32_t condition;
+        uint32_t successor;
+        // True if the condition is the previous production's and draws nothing, so its
+        // result can be reused.
+        bool sameCondition;
+    };
+
+    // A run of modules without parameters, stored in m_literalSymbols
+    struct Literal
+    {
+        uint32_t offset;
+        uint32_t length;
+        uint32_t numKeys;
+    };
+
+    // The most a module of some symbol can turn into in one step
+    struct Bound
+    {
+        uint32_t numSymbols;
+        uint32_t numParams;
+        uint32_t numKeys;
+    };
+
+    // Where successor programs write.  The buffers must have room for what they emit.
+    struct Output
+    {
+        char *symbols;
+        float *params;
+        uint64_t *keys;
+    };
+
+    // Runs code until OP_END.  Returns the value on top of the stack, or 1 if it is empty.
+    float run(uint32_t pc, const float *params, uint64_t key, uint32_t &slot, Output *out, uint32_t &child) const;
+
+    // Evaluates the condition at pc.
+    bool test(uint32_t pc, const float *params, uint64_t key, uint32_t &slot) const;
+
+    // Applies a binary operator
+    static float binary(Opcode op, float a, float b);
+
+    // Counts what the program at pc emits.
+    void countOutput(uint32_t pc, uint32_t &numSymbols, uint32_t &numParams, uint32_t &numKeys) const;
+
+    // The productions of symbol s are m_productions[m_first[s]] up to m_productions[m_first[s + 1]].
+    std::vector<Production> m_productions;
+    uint32_t m_first[257];
+
+    std::vector<uint32_t> m_code;
+    std::vector<float> m_constants;
+    std::vector<Literal> m_literals;
+    std::string m_literalSymbols;
+    int m_arity[256];
+    Bound m_bounds[256];
+
+    // The axiom is compiled like a successor, so rand() in it differs per tree.
+    uint32_t m_axiomCode;
+    int m_iterations;
+
+    friend class GrammarParser;
+};
+
+#endif // PARAMETRICLSYSTEM_H
@@ -0,0 +1,143 @@
+#include "placement.h"
+#include "random.h"
+#include <glm/gtc/constants.hpp>
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+
+// How many spots each site tries around itself before it is dropped
+#define ATTEMPTS 30
+
+Placement::Placement()
+{
+    m_columns = m_rows = 0;
+    m_cellSize = 1.0f;
+    m_border = 0;
+    m_firstActive = 0;
+
+    float golden = glm::pi<float>() * (3.0f - sqrt(5.0f));
+    m_stepCos = cos(golden);
+    m_stepSin = sin(golden);
+}
+
+int Placement::cellOf(const glm::vec2 &p) const
+{
+    int column = std::min((int)((p.x - m_origin.x) / m_cellSize), m_columns - 2 * m_border - 1);
+    int row = std::min((int)((p.y - m_origin.y) / m_cellSize), m_rows - 2 * m_border - 1);
+    return (row + m_border) * m_columns + column + m_border;
+}
+
+bool Placement::fits(const glm::vec2 &p, float spacing) const
+{
+    const Cell *cell = &m_grid[cellOf(p)];
+    for(size_t i = 0; i < m_neighbours.size(); i++){
+        const Cell &other = cell[m_neighbours[i]];
+        glm::vec2 d = other.position - p;
+        float minimum = std::max(spacing, other.spacing);
+        // An empty cell has no spacing, so is never too close
+        if(glm::dot(d, d) < minimum * minimum && other.spacing > 0.0f){
+            return false;
+        }
+    }
+    return true;
+}
+
+void Placement::placeSite(const glm::vec2 &p, float spacing)
+{
+    Cell cell = {p, spacing};
+    m_grid[cellOf(p)] = cell;
+    m_active.push_back((uint32_t)m_sites.size());
+    m_sites.push_back(p);
+}
+
+/**
+ * @brief Placement::scatter places every site
+ * The cells are the smallest spacing over root two across, so no two sites can share one.
+ * A site can then only be too close to sites within the largest spacing of it, which is
+ * at most m_border cells out.
+ */
+void Placement::scatter(float width, float depth, const std::vector<float> &spacings, uint64_t seed,
+                        size_t maxSites)
+{
+    m_sites.clear();
+    m_active.clear();
+    m_firstActive = 0;
+    if(spacings.empty() || maxSites == 0 || width <= 0.0f || depth <= 0.0f){
+        return;
+    }
+
+    float minSpacing = spacings[0];
+    float maxSpacing = spacings[0];
+    for(size_t i = 1; i < spacings.size(); i++){
+        minSpacing = std::min(minSpacing, spacings[i]);
+        maxSpacing = std::max(maxSpacing, spacings[i]);
+    }
+
+    m_cellSize = minSpacing / glm::root_two<float>();
+    m_border = (int)ceil(maxSpacing / m_cellSize);
+    m_columns = std::max((int)ceil(width / m_cellSize), 1) + 2 * m_border;
+    m_rows = std::max((int)ceil(depth / m_cellSize), 1) + 2 * m_border;
+    m_origin = glm::vec2(-width / 2, -depth / 2);
+    m_extent = glm::vec2(width, depth);
+    Cell empty = {glm::vec2(0.0f), 0.0f};
+    m_grid.assign((size_t)m_columns * m_rows, empty);
+
+    // Only cells whose nearest point is within the largest spacing can hold a site that is
+    // too close.  Checking the nearest first finds most of them after a look or two.
+    std::vector<std::pair<int, int> > byDistance;
+    for(int r = -m_border; r <= m_border; r++){
+        for(int c = -m_border; c <= m_border; c++){
+            int gapR = std::max(abs(r) - 1, 0);
+            int gapC = std::max(abs(c) - 1, 0);
+            int gap = gapR * gapR + gapC * gapC;
+            if(gap * m_cellSize * m_cellSize < maxSpacing * maxSpacing){
+                byDistance.push_back(std::make_pair(r * r + c * c, r * m_columns + c));
+            }
+        }
+    }
+    std::sort(byDistance.begin(), byDistance.end());
+    m_neighbours.clear();
+    for(size_t i = 0; i < byDistance.size(); i++){
+        m_neighbours.push_back(byDistance[i].second);
+    }
+
+    Random random(seed);
+    glm::vec2 first = m_origin + glm::vec2(random.nextFloat(), random.nextFloat()) * m_extent;
+    placeSite(first, spacings[0]);
+
+    while(m_firstActive < m_active.size() && m_sites.size() < maxSites){
+        // Working from the oldest site grows an even front, and keeps the cells being
+        // looked at close together in memory.
+        uint32_t parent = m_active[m_firstActive];
+        float parentSpacing = m_grid[cellOf(m_sites[parent])].spacing;
+        float spacing = spacings[m_sites.size() % spacings.size()];
+        float ring = std::max(spacing, parentSpacing);
+
+        // The tries go round the parent by the golden angle from a random start, which
+        // spreads them evenly without a cos and sin each.
+        float start = random.nextFloat() * 2.0f * glm::pi<float>();
+        glm::vec2 direction(cos(start), sin(start));
+
+        bool placed = false;
+        for(int attempt = 0; attempt < ATTEMPTS; attempt++){
+            direction = glm::vec2(direction.x * m_stepCos - direction.y * m_stepSin,
+                                  direction.x * m_stepSin + direction.y * m_stepCos);
+            // Uniform over the area of the ring from one to two spacings out
+            float distance = ring * sqrt(1.0f + 3.0f * random.nextFloat());
+            glm::vec2 p = m_sites[parent] + distance * direction;
+
+            if(p.x < m_origin.x || p.y < m_origin.y ||
+               p.x >= m_origin.x + m_extent.x || p.y >= m_origin.y + m_extent.y || !fits(p, spacing)){
+                continue;
+            }
+
+            placeSite(p, spacing);
+            placed = true;
+            break;
+        }
+
+        if(!placed){
+            m_firstActive++;
+        }
+    }
+}
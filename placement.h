@@ -0,0 +1,66 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <vector>
+#include "instancestore.h"
+
+/**
+ * Spreads trees over the ground by Poisson-disk sampling, so that none stand closer
+ * together than their species allows, but the gaps still look random.
+ *
+ * Sites are grown outward from a random first one (Bridson's algorithm).  The oldest site
+ * that may still have room around it tries spots in the ring just beyond its spacing,
+ * and is dropped once enough of them fail in a row.  A background grid with room for one site per cell
+ * means each try only looks at the handful of cells around it, so scattering takes time
+ * in proportion to the number of sites, however large the area.
+ *
+ * Site i is for a tree of species i % spacings.size(), as Forest assigns them, and two
+ * sites are never closer than the larger of their species' spacings.
+ */
+class Placement
+{
+public:
+    Placement();
+
+    // Scatters sites over the width by depth rectangle centred on the origin, until it is
+    // full or maxSites are placed.  The same arguments always give the same sites.
+    void scatter(float width, float depth, const std::vector<float> &spacings, uint64_t seed,
+                 size_t maxSites = (size_t)-1);
+
+    // Ground positions, x and z in world space
+    const std::vector<glm::vec2> &sites() const { return m_sites; }
+
+private:
+    // True if a site of the given spacing at p is far enough from every site placed
+    bool fits(const glm::vec2 &p, float spacing) const;
+    void placeSite(const glm::vec2 &p, float spacing);
+    int cellOf(const glm::vec2 &p) const;
+
+    std::vector<glm::vec2> m_sites;
+    // Sites that may still have room around them, oldest first from m_firstActive on
+    std::vector<uint32_t> m_active;
+    size_t m_firstActive;
+
+    // The site in each cell, kept in the cell so that a look around touches only the grid.
+    // Empty cells have no spacing.
+    struct Cell
+    {
+        glm::vec2 position;
+        float spacing;
+    };
+    std::vector<Cell> m_grid;
+    int m_columns, m_rows;
+    float m_cellSize;
+    glm::vec2 m_origin, m_extent;
+    // The grid has this many empty cells around the area, so looking around a site never
+    // needs to check the edges.
+    int m_border;
+    // The cells that may hold a site too close to one in the cell at 0, as index offsets
+    // from it, the nearest first
+    std::vector<int> m_neighbours;
+
+    // The turn between one try and the next
+    float m_stepCos, m_stepSin;
+};
+
+#endif // PLACEMENT_H
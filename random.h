@@ -0,0 +1,77 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <stdint.h>
+
+/**
+ * A small, fast random number generator (xoshiro128**) with its own state, so that
+ * every tree can draw from an independent stream that is reproducible from a seed.
+ */
+class Random
+{
+public:
+    Random(uint64_t seed = 0) { setSeed(seed); }
+
+    // The state is filled from the seed with splitmix64, as xoshiro's authors recommend.
+    void setSeed(uint64_t seed)
+    {
+        for(int i = 0; i < 4; i++){
+            m_state[i] = (uint32_t)splitMix(seed);
+        }
+    }
+
+    uint32_t next()
+    {
+        uint32_t result = rotl(m_state[1] * 5, 7) * 9;
+        uint32_t t = m_state[1] << 9;
+
+        m_state[2] ^= m_state[0];
+        m_state[3] ^= m_state[1];
+        m_state[1] ^= m_state[2];
+        m_state[0] ^= m_state[3];
+        m_state[2] ^= t;
+        m_state[3] = rotl(m_state[3], 11);
+
+        return result;
+    }
+
+    // Between 0.0 and 1.0
+    float nextFloat() { return (next() >> 8) * (1.0f / 16777215.0f); }
+
+    // Mixes a seed and an index into a new, well separated seed.
+    static uint64_t mix(uint64_t seed, uint64_t index)
+    {
+        uint64_t x = seed + index * 0x9E3779B97F4A7C15ULL;
+        return splitMix(x);
+    }
+
+    // Stateless draws.  These only depend on their arguments, so any of them can be
+    // recomputed on its own, in any order, on any thread.
+
+    // The key of the index'th child of the thing identified by key
+    static uint64_t childKey(uint64_t key, uint32_t index) { return mix(key, index); }
+
+    // A random integer that depends only on key and slot
+    static uint32_t hashUInt(uint64_t key, uint32_t slot)
+    {
+        return (uint32_t)(mix(key ^ 0x5851F42D4C957F2DULL, slot) >> 32);
+    }
+
+    // Between 0.0 and 1.0, depending only on key and slot
+    static float hashFloat(uint64_t key, uint32_t slot) { return (hashUInt(key, slot) >> 8) * (1.0f / 16777215.0f); }
+
+private:
+    static uint32_t rotl(uint32_t x, int k) { return (x << k) | (x >> (32 - k)); }
+
+    static uint64_t splitMix(uint64_t &x)
+    {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    uint32_t m_state[4];
+};
+
+#endif // RANDOM_H
@@ -0,0 +1,20 @@
+#version 330 core
+
+in vec2 texc;
+in vec3 color;
+
+out vec4 fragColor;
+
+uniform sampler2D tex; // The leaf texture, transparent around the leaf
+
+void main(){
+    vec4 texColor = texture(tex, texc);
+
+    // Alpha tested rather than blended, so leaves need no sorting
+    if(texColor.a < 0.5)
+    {
+        discard;
+    }
+
+    fragColor = vec4(color * texColor.rgb, 1.0);
+}
@@ -0,0 +1,52 @@
+#version 330 core
+
+in vec2 corner; // Corner of the unit leaf quad, across in x and along in y
+
+// Per leaf, advanced once per instance
+in vec3 leafPosition;    // Where the leaf grows from
+in vec4 leafOrientation; // Quaternion turning the quad's y onto the leaf's z-axis
+
+out vec2 texc;
+out vec3 color; // Lighting for this vertex
+
+// Transformation matrices
+uniform mat4 p;
+uniform mat4 v;
+
+uniform vec2 leafSize; // Width and length of every leaf
+
+// Light data, from a buffer shared with the main shader.  The layout must match LightBlock.
+const int MAX_LIGHTS = 10;
+layout(std140) uniform Lights
+{
+    int lightTypes[MAX_LIGHTS];         // 0 for point, 1 for directional
+    vec3 lightPositions[MAX_LIGHTS];    // For point lights
+    vec3 lightDirections[MAX_LIGHTS];   // For directional lights
+    vec3 lightAttenuations[MAX_LIGHTS]; // Constant, linear, and quadratic term
+    vec3 lightColors[MAX_LIGHTS];
+};
+
+uniform vec3 ambient_color;
+
+// Rotates a vector by a unit quaternion
+vec3 rotate(vec4 q, vec3 u)
+{
+    return u + 2.0 * cross(q.xyz, cross(q.xyz, u) + q.w * u);
+}
+
+void main(){
+    // loadTexture leaves the top row of the image at t = 0, and the image has the tip on top
+    texc = vec2(corner.x + 0.5, 1.0 - corner.y);
+
+    // The quad lies in the leaf's xz plane, starting at its base and growing along z
+    vec3 local = vec3(corner.x * leafSize.x, 0.0, corner.y * leafSize.y);
+    vec3 position_worldSpace = leafPosition + rotate(leafOrientation, local);
+    vec3 normal_worldSpace = rotate(leafOrientation, vec3(0.0, 1.0, 0.0));
+
+    gl_Position = p * v * vec4(position_worldSpace, 1.0);
+
+    // Leaves are thin, so both faces are lit alike.  Only the first light, which is
+    // directional, reaches them.
+    float diffuse = abs(dot(normal_worldSpace, -lightDirections[0]));
+    color = clamp(ambient_color + lightColors[0] * diffuse, 0.0, 1.0);
+}
@@ -17,13 +17,16 @@ uniform bool useNormalMap = false;
 
 uniform mat4 v;
 
-// Light data
+// Light data, from a buffer shared with the leaf shader.  The layout must match LightBlock.
 const int MAX_LIGHTS = 10;
-uniform int lightTypes[MAX_LIGHTS];         // 0 for point, 1 for directional
-uniform vec3 lightPositions[MAX_LIGHTS];    // For point lights
-uniform vec3 lightDirections[MAX_LIGHTS];   // For directional lights
-uniform vec3 lightAttenuations[MAX_LIGHTS]; // Constant, linear, and quadratic term
-uniform vec3 lightColors[MAX_LIGHTS];
+layout(std140) uniform Lights
+{
+    int lightTypes[MAX_LIGHTS];         // 0 for point, 1 for directional
+    vec3 lightPositions[MAX_LIGHTS];    // For point lights
+    vec3 lightDirections[MAX_LIGHTS];   // For directional lights
+    vec3 lightAttenuations[MAX_LIGHTS]; // Constant, linear, and quadratic term
+    vec3 lightColors[MAX_LIGHTS];
+};
 
 // Material data
 uniform vec3 ambient_color;
@@ -7,6 +7,7 @@ in vec3 tangent; // The tangent vector to the normal
 in vec3 bitangent; // The bitangent vector to the normal
 
 in float arrowOffset; // Sideways offset for billboarded normal arrows
+in mat4 instanceModel; // Model matrix of each instance, used instead of m when instancing
 
 out vec3 color; // Computed color for this vertex
 out vec2 texc;
@@ -21,13 +22,16 @@ uniform mat4 p;
 uniform mat4 v;
 uniform mat4 m;
 
-// Light data
+// Light data, from a buffer shared with the leaf shader.  The layout must match LightBlock.
 const int MAX_LIGHTS = 10;
-uniform int lightTypes[MAX_LIGHTS];         // 0 for point, 1 for directional
-uniform vec3 lightPositions[MAX_LIGHTS];    // For point lights
-uniform vec3 lightDirections[MAX_LIGHTS];   // For directional lights
-uniform vec3 lightAttenuations[MAX_LIGHTS]; // Constant, linear, and quadratic term
-uniform vec3 lightColors[MAX_LIGHTS];
+layout(std140) uniform Lights
+{
+    int lightTypes[MAX_LIGHTS];         // 0 for point, 1 for directional
+    vec3 lightPositions[MAX_LIGHTS];    // For point lights
+    vec3 lightDirections[MAX_LIGHTS];   // For directional lights
+    vec3 lightAttenuations[MAX_LIGHTS]; // Constant, linear, and quadratic term
+    vec3 lightColors[MAX_LIGHTS];
+};
 
 // Material data
 uniform vec3 ambient_color;
@@ -37,19 +41,22 @@ uniform float shininess;
 
 uniform bool useLighting;     // Whether to calculate lighting using lighting equation
 uniform bool useArrowOffsets; // True if rendering the arrowhead of a normal for Shapes
+uniform bool useInstancing = false; // True if each instance brings its own model matrix
 uniform vec3 allBlack = vec3(1);
 
 void main(){
     texc = texCoord;
 
-    vec4 position_cameraSpace = v * m * vec4(position, 1.0);
-    vec4 normal_cameraSpace = vec4(normalize(mat3(transpose(inverse(v * m))) * normal), 0);
+    mat4 model = useInstancing ? instanceModel : m;
 
-    vec4 position_worldSpace = m * vec4(position, 1.0);
-    vec4 normal_worldSpace = vec4(normalize(mat3(transpose(inverse(m))) * normal), 0);
+    vec4 position_cameraSpace = v * model * vec4(position, 1.0);
+    vec4 normal_cameraSpace = vec4(normalize(mat3(transpose(inverse(v * model))) * normal), 0);
+
+    vec4 position_worldSpace = model * vec4(position, 1.0);
+    vec4 normal_worldSpace = vec4(normalize(mat3(transpose(inverse(model))) * normal), 0);
 
     // Normal mapping round two
-    mat3 MV3x3 = mat3(transpose(inverse(v * m)));
+    mat3 MV3x3 = mat3(transpose(inverse(v * model)));
 
     vec3 vertexNormal_cameraspace = MV3x3 * normalize(normal);
     vec3 vertexTangent_cameraspace = MV3x3 * normalize(tangent);
@@ -43,9 +43,6 @@ void Skybox::draw(Camera *camera)
     glm::mat4 V = camera->getViewMatrix();
     glm::mat4 P = camera->getProjectionMatrix();
 
-    GLuint Vloc = glGetUniformLocation(m_shader, "V");
-    GLuint Ploc = glGetUniformLocation(m_shader, "P");
-
     // Take the camera translation out of the view matrix
     V = V - (V * glm::mat4(
                 0.0f,  0.0f,  0.0f, 0.0f,
@@ -55,13 +52,13 @@ void Skybox::draw(Camera *camera)
                 ));
 
     glUniformMatrix4fv(
-                Vloc, // Shader variable
+                m_Vloc, // Shader variable
                 1, // Number of matricies
                 GL_FALSE, //
                 glm::value_ptr(V) // Pointer to the first element
             );
     glUniformMatrix4fv(
-                Ploc, // Shader variable
+                m_Ploc, // Shader variable
                 1, // Number of matricies
                 GL_FALSE, //
                 glm::value_ptr(P) // Pointer to the first element
@@ -86,6 +83,9 @@ void Skybox::loadShader()
     m_shader = ResourceLoader::loadShaders(
             ":/shaders/skybox.vert",
             ":/shaders/skybox.frag");
+
+    m_Vloc = glGetUniformLocation(m_shader, "V");
+    m_Ploc = glGetUniformLocation(m_shader, "P");
 }
 
 void Skybox::loadBuffer()
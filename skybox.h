@@ -22,6 +22,8 @@ private:
 
     // The program ID of the OpenGL shader
     GLuint m_shader;
+    // Where the shader's V and P uniforms are
+    GLint m_Vloc, m_Ploc;
 
     // VAO and VBO
     GLuint m_vao;
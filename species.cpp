@@ -0,0 +1,261 @@
+#include "species.h"
+#include <sstream>
+#include <string.h>
+
+constexpr StaticRule BuiltInGrammar::rules[];
+
+Species::Species()
+{
+    name = "default";
+    iterations = 6;
+    trunkRadius = 1.0f;
+
+    for(int i = 0; i < BuiltInGrammar::numRules; i++){
+        const StaticRule &r = BuiltInGrammar::rules[i];
+        Rule rule = {r.symbol, r.successor, r.final};
+        rules.push_back(rule);
+    }
+
+    minLength = 5.0f;
+    maxLength = 15.0f;
+    aMaxPhi = 60.0f;
+    aRatio = 0.75f;
+    bMinRatio = 0.3f;
+    bMaxRatio = 0.9f;
+    bBend = 45.0f;
+    cMinSpread = 35.0f;
+    cMaxSpread = 160.0f;
+    cMinPhi = 25.0f;
+    cMaxPhi = 80.0f;
+    cMinRatio = 0.25f;
+    cMaxRatio = 0.7f;
+    leafMaxPhi = 30.0f;
+    spacing = 6.0f;
+}
+
+bool Species::Rule::operator==(const Rule &other) const
+{
+    return symbol == other.symbol && successor == other.successor && final == other.final;
+}
+
+bool Species::operator==(const Species &other) const
+{
+    return iterations == other.iterations && trunkRadius == other.trunkRadius &&
+           rules == other.rules &&
+           minLength == other.minLength && maxLength == other.maxLength &&
+           aMaxPhi == other.aMaxPhi && aRatio == other.aRatio &&
+           bMinRatio == other.bMinRatio && bMaxRatio == other.bMaxRatio && bBend == other.bBend &&
+           cMinSpread == other.cMinSpread && cMaxSpread == other.cMaxSpread &&
+           cMinPhi == other.cMinPhi && cMaxPhi == other.cMaxPhi &&
+           cMinRatio == other.cMinRatio && cMaxRatio == other.cMaxRatio &&
+           leafMaxPhi == other.leafMaxPhi;
+}
+
+// Mixes the bits of a float into h
+static uint64_t mixFloat(uint64_t h, float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return Random::mix(h, bits);
+}
+
+uint64_t Species::hash() const
+{
+    uint64_t h = Random::mix(iterations, rules.size());
+    h = mixFloat(h, trunkRadius);
+    for(size_t i = 0; i < rules.size(); i++){
+        h = Random::mix(h, ((uint64_t)rules[i].symbol << 1) | rules[i].final);
+        h = Random::mix(h, rules[i].successor.length());
+        for(size_t c = 0; c < rules[i].successor.length(); c++){
+            h = Random::mix(h, (unsigned char)rules[i].successor[c]);
+        }
+    }
+
+    float params[] = {minLength, maxLength, aMaxPhi, aRatio, bMinRatio, bMaxRatio, bBend,
+                      cMinSpread, cMaxSpread, cMinPhi, cMaxPhi, cMinRatio, cMaxRatio, leafMaxPhi};
+    for(size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++){
+        h = mixFloat(h, params[i]);
+    }
+    return h;
+}
+
+// Sets error to message, for the given line of the file, and returns false.
+static bool fail(int line, const std::string &message, std::string *error)
+{
+    if(error){
+        std::ostringstream s;
+        s << "line " << line << ": " << message;
+        *error = s.str();
+    }
+    return false;
+}
+
+// Reads exactly count numbers from values into out.
+static bool readNumbers(std::istringstream &values, float *out, int count)
+{
+    for(int i = 0; i < count; i++){
+        if(!(values >> out[i])){
+            return false;
+        }
+    }
+    std::string rest;
+    return !(values >> rest);
+}
+
+bool Species::checkBranches(char symbol, const std::string &successor, std::string *why)
+{
+    int depth = 0;
+    int pending = 0;
+    for(size_t i = 0; i < successor.length(); i++){
+        char c = successor[i];
+        if(c == 'a' || c == 'b' || c == 'c'){
+            pending += c - 'a' + 1;
+        } else if(c == '[' || c == '!'){
+            depth += (c == '[');
+            // The first [ of a successor of ! opens the branch the ! stood for
+            bool ownBranch = (c == '[' && i == 0 && symbol == '!');
+            if(!ownBranch && pending-- == 0){
+                *why = std::string("nothing sets up the branch of ") + c;
+                return false;
+            }
+        } else if(c == ']' && --depth < 0){
+            *why = "unmatched ]";
+            return false;
+        }
+    }
+    if(depth != 0){
+        *why = "unmatched [";
+        return false;
+    }
+    return true;
+}
+
+// Reads "symbol -> successor" into rule.
+static bool readRule(std::istringstream &values, Species::Rule *rule)
+{
+    std::string symbol, arrow;
+    if(!(values >> symbol >> arrow) || symbol.length() != 1 || arrow != "->"){
+        return false;
+    }
+    rule->symbol = symbol[0];
+    // The successor can be empty, which erases the symbol.
+    values >> rule->successor;
+    std::string rest;
+    return !(values >> rest);
+}
+
+bool Species::parse(const std::string &source, std::vector<Species> *species, std::string *error)
+{
+    std::vector<Species> parsed;
+    // Set once the current species gives its own rules
+    bool ownRules = false;
+
+    std::istringstream lines(source);
+    std::string text;
+    int line = 0;
+    while(std::getline(lines, text)){
+        line++;
+        size_t comment = text.find('#');
+        if(comment != std::string::npos){
+            text.erase(comment);
+        }
+        size_t colon = text.find(':');
+        std::istringstream values(colon == std::string::npos ? text : text.substr(colon + 1));
+        std::string key;
+        if(colon == std::string::npos){
+            // Only blank lines can go without a key.
+            if(values >> key){
+                return fail(line, "expected a statement", error);
+            }
+            continue;
+        }
+        std::istringstream keyText(text.substr(0, colon));
+        keyText >> key;
+
+        bool ok = true;
+        if(key == "species"){
+            parsed.push_back(Species());
+            ownRules = false;
+            ok = !!(values >> parsed.back().name);
+        } else if(parsed.empty()){
+            return fail(line, "expected species first", error);
+        } else {
+            Species &s = parsed.back();
+            if(key == "iterations"){
+                float n;
+                ok = readNumbers(values, &n, 1) && n == (int)n;
+                if(ok && (n < 1 || n > MAX_SPECIES_ITERATIONS)){
+                    std::ostringstream range;
+                    range << "iterations must be from 1 to " << MAX_SPECIES_ITERATIONS;
+                    return fail(line, range.str(), error);
+                }
+                s.iterations = (int)n;
+            } else if(key == "trunk_radius"){
+                ok = readNumbers(values, &s.trunkRadius, 1);
+            } else if(key == "length"){
+                float range[2];
+                ok = readNumbers(values, range, 2);
+                s.minLength = range[0];
+                s.maxLength = range[1];
+            } else if(key == "a_phi"){
+                ok = readNumbers(values, &s.aMaxPhi, 1);
+            } else if(key == "a_ratio"){
+                ok = readNumbers(values, &s.aRatio, 1);
+            } else if(key == "b_ratio"){
+                float range[2];
+                ok = readNumbers(values, range, 2);
+                s.bMinRatio = range[0];
+                s.bMaxRatio = range[1];
+            } else if(key == "b_bend"){
+                ok = readNumbers(values, &s.bBend, 1);
+            } else if(key == "c_spread"){
+                float range[2];
+                ok = readNumbers(values, range, 2);
+                s.cMinSpread = range[0];
+                s.cMaxSpread = range[1];
+            } else if(key == "c_phi"){
+                float range[2];
+                ok = readNumbers(values, range, 2);
+                s.cMinPhi = range[0];
+                s.cMaxPhi = range[1];
+            } else if(key == "c_ratio"){
+                float range[2];
+                ok = readNumbers(values, range, 2);
+                s.cMinRatio = range[0];
+                s.cMaxRatio = range[1];
+            } else if(key == "leaf_phi"){
+                ok = readNumbers(values, &s.leafMaxPhi, 1);
+            } else if(key == "spacing"){
+                ok = readNumbers(values, &s.spacing, 1) && s.spacing > 0;
+            } else if(key == "rule" || key == "final"){
+                if(!ownRules){
+                    s.rules.clear();
+                    ownRules = true;
+                }
+                Rule rule;
+                rule.final = (key == "final");
+                ok = readRule(values, &rule);
+                std::string why;
+                if(ok && !checkBranches(rule.symbol, rule.successor, &why)){
+                    return fail(line, "bad successor " + rule.successor + ": " + why, error);
+                }
+                s.rules.push_back(rule);
+            } else {
+                return fail(line, "unknown statement " + key, error);
+            }
+        }
+
+        if(!ok){
+            return fail(line, "bad value for " + key, error);
+        }
+    }
+
+    if(parsed.empty()){
+        if(error){
+            *error = "no species";
+        }
+        return false;
+    }
+    species->swap(parsed);
+    return true;
+}
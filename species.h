@@ -0,0 +1,104 @@
+#ifndef SPECIES_H
+#define SPECIES_H
+
+#include <string>
+#include <vector>
+#include "staticlsystem.h"
+
+// The most iterations a species file may ask for.  Each iteration of the built in rules
+// makes about two and a half times the branches, so 12 is already some 60000 a tree.
+#define MAX_SPECIES_ITERATIONS 12
+
+// The productions of the built in tree, fixed at compile time so StaticLSystem can derive
+// them.  Species uses them as its default rules.
+struct BuiltInGrammar
+{
+    static constexpr StaticRule rules[] = {
+        // Each branch splits into two or three, with equal odds.
+        {'!', "[b!!]", false},
+        {'!', "[c!!!]", false},
+        // The last iteration caps every branch with a leaf.
+        {'!', "[x]", true}
+    };
+    static constexpr int numRules = 3;
+};
+
+/**
+ * Everything that sets one kind of tree apart: the productions of its L-system and the
+ * ranges the turtle draws its branches from.  A default constructed Species is the
+ * built in tree.
+ *
+ * Species files are plain text, one statement per line, with # starting a comment.
+ * Every species starts with its name, and any statement left out keeps the built in value:
+ *
+ *     species: birch
+ *     iterations: 7       # 1 to MAX_SPECIES_ITERATIONS
+ *     trunk_radius: 0.8
+ *     length: 8 20        # min and max, as multiples of the branch radius
+ *     a_phi: 60           # max bend of an a branch, in degrees
+ *     a_ratio: 0.75       # radius of an a branch relative to its parent
+ *     b_ratio: 0.3 0.9    # the two b branches' ratios add up to min + max
+ *     b_bend: 45          # bend of a b branch per unit of ratio it loses
+ *     c_spread: 35 160    # angle between neighbouring c branches around the parent
+ *     c_phi: 25 80
+ *     c_ratio: 0.25 0.7
+ *     leaf_phi: 30
+ *     spacing: 6          # closest another tree may stand to one of these
+ *     rule: ! -> [b!!]    # several rules for a symbol are picked with equal odds
+ *     rule: ! -> [c!!!]
+ *     final: ! -> [x]     # used on the last iteration instead
+ *
+ * A species that gives any rule or final rule replaces all of the built in ones.
+ *
+ * Successors must keep their brackets balanced, and every branch must be set up before it
+ * is opened: each [ and each ! takes the parameters of one of the branches an a, b or c
+ * before it adds (one, two or three).  A successor of ! may start with a [ anyway, that
+ * being the branch the ! stood for.  So "[b!!]" is fine, while "[!]" or "[[x]]" is not.
+ */
+struct Species
+{
+    Species();
+
+    struct Rule
+    {
+        char symbol;
+        std::string successor;
+        bool final;
+
+        bool operator==(const Rule &other) const;
+    };
+
+    std::string name;
+    int iterations;
+    float trunkRadius;
+    std::vector<Rule> rules;
+
+    float minLength, maxLength;
+    float aMaxPhi, aRatio;
+    float bMinRatio, bMaxRatio, bBend;
+    float cMinSpread, cMaxSpread;
+    float cMinPhi, cMaxPhi;
+    float cMinRatio, cMaxRatio;
+    float leafMaxPhi;
+
+    // Only sets where trees stand, not what they look like, so == leaves it out
+    float spacing;
+
+    // True if trees of both species come out the same.  The names and spacing don't matter.
+    bool operator==(const Species &other) const;
+    bool operator!=(const Species &other) const { return !(*this == other); }
+
+    // The same for any two species that are ==, for keying caches of generated trees
+    uint64_t hash() const;
+
+    // Checks that successor, the symbols of a successor of symbol, opens no branch it
+    // hasn't set up and balances its brackets.  Otherwise returns false, with why saying
+    // what is wrong.
+    static bool checkBranches(char symbol, const std::string &successor, std::string *why);
+
+    // Reads every species of a file.  On a syntax error species is unchanged, false is
+    // returned and error describes the problem.
+    static bool parse(const std::string &source, std::vector<Species> *species, std::string *error = 0);
+};
+
+#endif // SPECIES_H
@@ -0,0 +1,200 @@
+#ifndef STATICLSYSTEM_H
+#define STATICLSYSTEM_H
+
+#include <string>
+#include <vector>
+#include <string.h>
+#include "random.h"
+
+// One production of a grammar that is fixed at compile time
+struct StaticRule
+{
+    char symbol;
+    const char *successor;
+    bool final;
+};
+
+// Length of a string, at compile time
+constexpr int staticLength(const char *s)
+{
+    return *s ? 1 + staticLength(s + 1) : 0;
+}
+
+/**
+ * An L-system whose rules are a constexpr table, for grammars that never change.
+ *
+ * A grammar is a class with the table and its size:
+ *
+ *     struct Grammar
+ *     {
+ *         static constexpr StaticRule rules[] = {{'!', "[b!!]", false}, {'!', "[x]", true}};
+ *         static constexpr int numRules = 2;
+ *     };
+ *
+ * Everything LSystem looks up per symbol is worked out by the compiler instead.  Every
+ * keyed symbol gets its own case, each successor is a copy of known length, and the keys
+ * it hands out are an unrolled loop of known count.  Knowing the longest successor also
+ * lets out be sized up front, so each key is hashed once rather than once per pass.
+ *
+ * The strings and keys derived are exactly those of an LSystem with the same rules.
+ */
+template <class Grammar>
+class StaticLSystem
+{
+public:
+    // As LSystem::derive, on one thread
+    static void derive(const std::string &in, const std::vector<uint64_t> &inKeys,
+                       std::string &out, std::vector<uint64_t> &outKeys, bool finalIteration)
+    {
+        if(finalIteration){
+            rewrite<true>(in, inKeys, out, outKeys);
+        } else {
+            rewrite<false>(in, inKeys, out, outKeys);
+        }
+    }
+
+    static constexpr bool isKeyed(char symbol, int i = 0)
+    {
+        return i < Grammar::numRules && (Grammar::rules[i].symbol == symbol || isKeyed(symbol, i + 1));
+    }
+
+private:
+    // The same slot LSystem picks successors with
+    static const uint32_t CHOICE_SLOT = 0xFFFFFFFFu;
+
+    // Number of successors symbol has in one of the tables
+    static constexpr int countRules(char symbol, bool final, int i = 0)
+    {
+        return i == Grammar::numRules ? 0 :
+               (Grammar::rules[i].symbol == symbol && Grammar::rules[i].final == final) + countRules(symbol, final, i + 1);
+    }
+
+    // Index in the table of the j'th successor of symbol
+    static constexpr int findRule(char symbol, bool final, int j, int i = 0)
+    {
+        return (Grammar::rules[i].symbol == symbol && Grammar::rules[i].final == final) ?
+               (j == 0 ? i : findRule(symbol, final, j - 1, i + 1)) : findRule(symbol, final, j, i + 1);
+    }
+
+    static constexpr int countKeyed(const char *s)
+    {
+        return *s ? isKeyed(*s) + countKeyed(s + 1) : 0;
+    }
+
+    // True if rule i is the first one of its symbol, so that each symbol gets one case
+    static constexpr bool firstOfSymbol(int i, int j = 0)
+    {
+        return j == i || (Grammar::rules[j].symbol != Grammar::rules[i].symbol && firstOfSymbol(i, j + 1));
+    }
+
+    static constexpr int maxLength(int i = 0)
+    {
+        return i == Grammar::numRules ? 1 :
+               (staticLength(Grammar::rules[i].successor) > maxLength(i + 1) ?
+                staticLength(Grammar::rules[i].successor) : maxLength(i + 1));
+    }
+
+    static constexpr int maxKeys(int i = 0)
+    {
+        return i == Grammar::numRules ? 1 :
+               (countKeyed(Grammar::rules[i].successor) > maxKeys(i + 1) ?
+                countKeyed(Grammar::rules[i].successor) : maxKeys(i + 1));
+    }
+
+    // Writes successor J of symbol S if it is the one chosen
+    template <char S, bool Final, int J, int N>
+    struct Successor
+    {
+        static void write(int choice, uint64_t key, char *&dst, uint64_t *&dstKey)
+        {
+            if(choice != J){
+                Successor<S, Final, J + 1, N>::write(choice, key, dst, dstKey);
+                return;
+            }
+            constexpr int rule = findRule(S, Final, J);
+            constexpr int length = staticLength(Grammar::rules[rule].successor);
+            constexpr int numKeys = countKeyed(Grammar::rules[rule].successor);
+            memcpy(dst, Grammar::rules[rule].successor, length);
+            dst += length;
+            for(int k = 0; k < numKeys; k++){
+                *dstKey++ = Random::childKey(key, k);
+            }
+        }
+    };
+
+    template <char S, bool Final, int N>
+    struct Successor<S, Final, N, N>
+    {
+        static void write(int, uint64_t, char *&, uint64_t *&) {}
+    };
+
+    // Rewrites one keyed symbol S
+    template <char S, bool Final>
+    struct Production
+    {
+        // The final table is used if it has a rule for S, as in LSystem::rule
+        static const bool useFinal = Final && countRules(S, true) > 0;
+        static const int numChoices = countRules(S, useFinal);
+
+        static void write(uint64_t key, char *&dst, uint64_t *&dstKey)
+        {
+            if(numChoices == 0){
+                // Keyed, but with nothing to do this iteration.  The key is kept.
+                *dst++ = S;
+                *dstKey++ = key;
+                return;
+            }
+            int choice = (numChoices == 1) ? 0 : Random::hashUInt(key, CHOICE_SLOT) % numChoices;
+            Successor<S, useFinal, 0, numChoices>::write(choice, key, dst, dstKey);
+        }
+    };
+
+    // Finds the production of symbol among the rules from I on.  The compiler turns the
+    // chain of constant comparisons into a switch.
+    template <bool Final, int I, bool Last = (I == Grammar::numRules)>
+    struct Dispatch
+    {
+        static void write(char symbol, const uint64_t *&key, char *&dst, uint64_t *&dstKey)
+        {
+            if(firstOfSymbol(I) && symbol == Grammar::rules[I].symbol){
+                Production<Grammar::rules[I].symbol, Final>::write(*key++, dst, dstKey);
+                return;
+            }
+            Dispatch<Final, I + 1>::write(symbol, key, dst, dstKey);
+        }
+    };
+
+    // No rule, so the symbol is copied through
+    template <bool Final, int I>
+    struct Dispatch<Final, I, true>
+    {
+        static void write(char symbol, const uint64_t *&, char *&dst, uint64_t *&)
+        {
+            *dst++ = symbol;
+        }
+    };
+
+    template <bool Final>
+    static void rewrite(const std::string &in, const std::vector<uint64_t> &inKeys,
+                        std::string &out, std::vector<uint64_t> &outKeys)
+    {
+        // No symbol grows longer than the longest successor, so out is sized for the
+        // worst case and trimmed afterwards.
+        out.resize(in.length() * maxLength());
+        outKeys.resize(inKeys.size() * maxKeys());
+        char *dst = &out[0];
+        uint64_t *dstKey = outKeys.data();
+        const uint64_t *key = inKeys.data();
+
+        const char *src = in.data();
+        const char *end = src + in.length();
+        for(; src != end; src++){
+            Dispatch<Final, 0>::write(*src, key, dst, dstKey);
+        }
+
+        out.resize(dst - out.data());
+        outKeys.resize(dstKey - outKeys.data());
+    }
+};
+
+#endif // STATICLSYSTEM_H
@@ -0,0 +1,57 @@
+#include "templatelibrary.h"
+#include "treemaker.h"
+
+// The hash slot a subtree's template is picked with.  Below the L-system's choice slot,
+// and above any slot the turtle uses.
+#define TEMPLATE_SLOT 0xFFFFFFFEu
+
+TemplateLibrary::TemplateLibrary()
+{
+    m_iterations = 0;
+    m_seed = 0;
+}
+
+void TemplateLibrary::build(int iterations, int numVariants, uint64_t seed)
+{
+    m_iterations = iterations;
+    m_seed = seed;
+    m_branches.assign(numVariants, InstanceStore());
+    m_leaves.assign(numVariants, InstanceStore());
+
+    TreeMaker maker;
+    for(int t = 0; t < numVariants; t++){
+        maker.makeSubtree(&m_branches[t], &m_leaves[t], Random::mix(seed, t), iterations);
+    }
+}
+
+uint32_t TemplateLibrary::pick(uint64_t key) const
+{
+    return Random::hashUInt(key, TEMPLATE_SLOT) % m_branches.size();
+}
+
+glm::mat4x4 TemplateLibrary::refMatrix(const TemplateRef &ref)
+{
+    glm::mat4x4 m = glm::mat4_cast(ref.orientation) * ref.scale;
+    m[3] = glm::vec4(ref.position, 1.0f);
+    return m;
+}
+
+void TemplateLibrary::expand(const std::vector<TemplateRef> &refs, InstanceStore *branches, InstanceStore *leaves) const
+{
+    for(size_t r = 0; r < refs.size(); r++){
+        const TemplateRef &ref = refs[r];
+        const InstanceStore &b = m_branches[ref.templateIndex];
+        const InstanceStore &l = m_leaves[ref.templateIndex];
+
+        for(size_t i = 0; branches && i < b.size(); i++){
+            branches->append(ref.position + ref.orientation * (b.positions()[i] * ref.scale),
+                             ref.orientation * b.orientations()[i],
+                             b.radii()[i] * ref.scale, b.lengths()[i] * ref.scale);
+        }
+        for(size_t i = 0; leaves && i < l.size(); i++){
+            leaves->append(ref.position + ref.orientation * (l.positions()[i] * ref.scale),
+                           ref.orientation * l.orientations()[i],
+                           l.radii()[i], l.lengths()[i]);
+        }
+    }
+}
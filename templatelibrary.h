@@ -0,0 +1,64 @@
+#ifndef TEMPLATELIBRARY_H
+#define TEMPLATELIBRARY_H
+
+#include <vector>
+#include "instancestore.h"
+
+// One use of a template: the subtree placed at position, turned by orientation and
+// scaled by scale, which is the radius its first branch would have had.
+struct TemplateRef
+{
+    glm::vec3 position;
+    glm::quat orientation;
+    float scale;
+    uint32_t templateIndex;
+};
+
+/**
+ * A small set of prebuilt subtrees that stand in for the last iterations of every tree.
+ *
+ * Each '!' of a derivation grows into a subtree that only differs from the others by its
+ * random draws, its root frame and its radius.  Instead of growing every one of them, a
+ * tree can stop early and refer to one of a few templates grown once, in their own frame,
+ * for the iterations that were skipped.  A forest then costs one template per variant
+ * plus one TemplateRef per subtree, however many branches the subtrees have.
+ */
+class TemplateLibrary
+{
+public:
+    TemplateLibrary();
+
+    // Grows numVariants subtrees of the given number of iterations.  Each starts at the
+    // origin and grows along z with a radius of 1.
+    void build(int iterations, int numVariants, uint64_t seed);
+
+    // How many iterations the templates stand in for, 0 if nothing was built
+    int iterations() const { return m_iterations; }
+    uint64_t seed() const { return m_seed; }
+
+    int numTemplates() const { return (int)m_branches.size(); }
+    const InstanceStore &templateBranches(int t) const { return m_branches[t]; }
+    const InstanceStore &templateLeaves(int t) const { return m_leaves[t]; }
+
+    // The template the subtree with the given key is replaced by
+    uint32_t pick(uint64_t key) const;
+
+    // Number of branches ref stands for
+    size_t branchCount(const TemplateRef &ref) const { return m_branches[ref.templateIndex].size(); }
+
+    // Appends the world space instances refs stand for.  Branches are scaled with their
+    // subtree, leaves are only moved and turned.  Either store may be null.
+    void expand(const std::vector<TemplateRef> &refs, InstanceStore *branches, InstanceStore *leaves) const;
+
+    // The transform of a reference, to be applied to the model matrices of its template.
+    static glm::mat4x4 refMatrix(const TemplateRef &ref);
+
+private:
+    // One entry per template, in their own frame
+    std::vector<InstanceStore> m_branches;
+    std::vector<InstanceStore> m_leaves;
+    int m_iterations;
+    uint64_t m_seed;
+};
+
+#endif // TEMPLATELIBRARY_H
@@ -1,7 +1,7 @@
 #include "treemaker.h"
 #include <math.h>
+#include <chrono>
 
-#define NUM_ITERS 6;
 #define DEG_TO_RAD (M_PI / 180)
 
 using namespace std;
@@ -9,6 +9,23 @@ using namespace std;
 
 TreeMaker::TreeMaker()
 {
+    m_streaming = false;
+    m_parametric = false;
+    m_paramIndex = 0;
+    m_symbolParams = 0;
+    m_symbolArity = 0;
+    m_templates = 0;
+    m_templateRefs = 0;
+    m_deriveIters = 0;
+    m_derivedIters = 0;
+    m_deriveFinal = true;
+    m_source = SOURCE_STRING;
+    m_growing = false;
+    m_placed = false;
+    m_compiledRules = true;
+
+    // The built in species
+    setSpecies(Species());
 }
 
 TreeMaker::~TreeMaker()
@@ -16,250 +33,588 @@ TreeMaker::~TreeMaker()
 }
 
 
-void TreeMaker::reset(float trunkRadius, std::deque<glm::mat4x4> *shapeTransformations, std::deque<glm::mat4x4> *leafTransformations)
+void TreeMaker::reset(float trunkRadius, InstanceStore *shapeTransformations, InstanceStore *leafTransformations, uint64_t seed)
 {
+    m_treeKey = seed;
     m_trunkRadius = trunkRadius;
-    current_branch_radius = m_trunkRadius;
     m_shapeTransformations = shapeTransformations;
     m_leafTransformations = leafTransformations;
+    numIters = m_species.iterations;
+
+    if(m_parametric){
+        beginGrammar();
+    } else {
+        // The trunk is the first child of the tree.
+        std::vector<uint64_t> keys(1, Random::childKey(m_treeKey, 0));
+        if(m_templates){
+            // The '!'s left over are where the templates go.
+            m_templateRefs->clear();
+            beginDerivation(keys, numIters - m_templates->iterations(), false);
+        } else {
+            beginDerivation(keys, numIters);
+        }
+    }
+
+    // When streaming, whatever can't be streamed is left for advance to derive.
+    if(!m_streaming){
+        finishDerivation();
+    }
+}
+
+// Derives "!" for the given number of iterations, its key being the first of keys.
+// Unless finish is set the final rules are not applied, so '!'s are left in the string.
+void TreeMaker::derive(const std::vector<uint64_t> &keys, int iterations, bool finish)
+{
+    beginDerivation(keys, iterations, finish);
+    finishDerivation();
+}
+
+// Sets up derive without running any of its iterations.
+void TreeMaker::beginDerivation(const std::vector<uint64_t> &keys, int iterations, bool finish)
+{
     L_string = "!";
+    L_keys = keys;
     L_index = 0;
-    numIters = NUM_ITERS;
-    for(int i = 1; i <= numIters ; i++){
+    m_deriveIters = iterations;
+    m_deriveFinal = finish;
+    m_deriveStats.clear();
+
+    // In streaming mode the string is expanded lazily as the turtle reads it instead.
+    m_derivedIters = streams() ? iterations : 0;
+}
 
-        cycleLString(i);
+// Sets up the grammar's axiom to be derived for as many iterations as it asks for.
+void TreeMaker::beginGrammar()
+{
+    m_grammar.axiom(m_treeKey, m_modules);
+    numIters = m_deriveIters = m_grammar.iterations();
+    m_derivedIters = 0;
+    m_deriveStats.clear();
+}
 
+// Runs the next iteration of the current derivation.  Returns false if none were left.
+bool TreeMaker::deriveNext()
+{
+    if(m_derivedIters >= m_deriveIters){
+        return false;
     }
+    m_derivedIters++;
 
+    if(!m_parametric){
+        cycleLString(m_derivedIters);
+        return true;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    m_grammar.derive(m_modules, m_nextModules);
+    m_modules.symbols.swap(m_nextModules.symbols);
+    m_modules.params.swap(m_nextModules.params);
+    m_modules.keys.swap(m_nextModules.keys);
+
+    LSystem::DeriveStats stats = {m_nextModules.symbols.length(), m_modules.symbols.length(),
+                                  std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()};
+    m_deriveStats.push_back(stats);
+    return true;
+}
+
+void TreeMaker::finishDerivation()
+{
+    while(deriveNext()){
+    }
 }
 
 void TreeMaker::cycleLString(int iterNum){
 
-    std::vector<char> new_result;
-    //int new_i = 0;
-
-    int l = L_string.length();
-
-    for(int i = 0; i < l; i++){
-        if((L_string[i] == '[') ||
-        (L_string[i] == 'a') ||
-        (L_string[i] == 'b') ||
-        (L_string[i] == 'c') ||
-        (L_string[i] == ']')){
-            new_result.push_back(L_string[i]);
-        } else if(L_string[i] == '!'){
-
-            if(iterNum == numIters){
-                new_result.push_back('[');
-                new_result.push_back('x');
-                new_result.push_back(']');
-                continue;
-            }
+    bool finalIteration = m_deriveFinal && iterNum == m_deriveIters;
+    if(m_builtInRules && m_compiledRules && m_lsystem.threadCount() == 1){
+        // The built in rules are compiled in, which skips the table lookups.
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        StaticLSystem<BuiltInGrammar>::derive(L_string, L_keys, m_nextString, m_nextKeys, finalIteration);
+        LSystem::DeriveStats stats = {L_string.length(), m_nextString.length(),
+                                      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()};
+        m_deriveStats.push_back(stats);
+    } else {
+        m_lsystem.derive(L_string, L_keys, m_nextString, m_nextKeys, finalIteration);
+        m_deriveStats.push_back(m_lsystem.lastStats());
+    }
 
-            new_result.push_back('[');
-            int r = rand() % 2 + 1;
-            //int r = 2;
-            new_result.push_back(r + 97);
-            for(int j = 0; j <= r; j++){
-                new_result.push_back('!');
-            }
-            new_result.push_back(']');
+    // Hand the derived buffers over.  The old ones are kept for the next pass.
+    L_string.swap(m_nextString);
+    L_keys.swap(m_nextKeys);
+}
 
-        } else if(L_string[i] == 'x'){
-            new_result.push_back('x');
-        } else if(L_string[i] == '\0'){
-            break;
+
+
+// Generates a random float between 0.0 and 1.0.  Every draw is identified by the key of
+// the branch it belongs to and its slot within that branch, so it can be redone alone.
+float TreeMaker::randomFloat(uint64_t key, uint32_t slot){
+    return Random::hashFloat(key, slot);
+}
+
+// Returns parameter i of the current symbol, or fallback if it has no such parameter.
+// The fallback is always drawn, so the rest of a branch's draws don't depend on it.
+float TreeMaker::param(int i, float fallback){
+    return (i < m_symbolArity) ? m_symbolParams[i] : fallback;
+}
+
+void TreeMaker::setStreaming(bool streaming)
+{
+    m_streaming = streaming;
+}
+
+bool TreeMaker::setGrammar(const std::string &source, std::string *error)
+{
+    if(source.empty()){
+        m_parametric = false;
+        return true;
+    }
+    if(!m_grammar.compile(source, error)){
+        return false;
+    }
+    m_parametric = true;
+    return true;
+}
+
+void TreeMaker::setTemplates(const TemplateLibrary *library, std::vector<TemplateRef> *refs)
+{
+    m_templates = library;
+    m_templateRefs = refs;
+}
+
+void TreeMaker::setSpecies(const Species &species)
+{
+    m_species = species;
+    m_builtInRules = (species.rules == Species().rules);
+    m_lsystem.clearRules();
+    for(size_t i = 0; i < species.rules.size(); i++){
+        const Species::Rule &rule = species.rules[i];
+        if(rule.final){
+            m_lsystem.addFinalRule(rule.symbol, rule.successor);
+        } else {
+            m_lsystem.addRule(rule.symbol, rule.successor);
         }
     }
+}
 
-    // Copy the iterated string over.
-    L_string = "";
-    for(int i = 0; i < new_result.size(); i++){
-        L_string += new_result[i];
+void TreeMaker::setDerivationThreads(int numThreads)
+{
+    m_lsystem.setThreadCount(numThreads);
+}
+
+void TreeMaker::setCompiledRules(bool compiled)
+{
+    m_compiledRules = compiled;
+}
+
+// Returns the next symbol for the turtle, or '\0' once the string is used up.
+char TreeMaker::nextSymbol()
+{
+    if(m_source == SOURCE_MODULES){
+        if(L_index >= (int)m_modules.symbols.length()){
+            return '\0';
+        }
+        char symbol = m_modules.symbols[L_index++];
+        m_symbolParams = m_modules.params.data() + m_paramIndex;
+        m_symbolArity = m_grammar.arity(symbol);
+        m_paramIndex += m_symbolArity;
+        return symbol;
+    }
+    if(m_source == SOURCE_STREAM){
+        return m_lsystem.nextSymbol();
     }
+    if(L_index >= (int)L_string.length()){
+        return '\0';
+    }
+    return L_string[L_index++];
 }
 
+// Starts reading symbols from wherever the last derivation put them.
+void TreeMaker::beginInterpretation()
+{
+    L_index = 0;
+    m_paramIndex = 0;
+    m_symbolArity = 0;
+    if(m_parametric){
+        m_source = SOURCE_MODULES;
+    } else if(streams()){
+        m_source = SOURCE_STREAM;
+        m_lsystem.beginStream(L_string, L_keys, m_deriveIters);
+    } else {
+        m_source = SOURCE_STRING;
+    }
+}
 
+void TreeMaker::setPosition(float x, float y)
+{
+    m_x = x;
+    m_y = y;
+    m_placed = true;
+}
 
-// Generates a random float between 0.0 and 1.0.  Off the Internet.
-float randomFloat(){
-    return static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
+// Draws the trunk's spot from the tree's key unless it was set.  Slots 0 and 1 are kept for
+// it either way, so the rest of the tree comes out the same.
+void TreeMaker::placeTrunk()
+{
+    if(!m_placed){
+        m_x = randomFloat(m_treeKey, 0) * 30.0 - 15.0;
+        m_y = randomFloat(m_treeKey, 1) * 30.0 - 15.0;
+    }
 }
 
 void TreeMaker::makeTree(){
-    // Basically a wrapper for the branch function.
-    L_index = 0;
-    phi_rotations.push_front(0.0);
-    theta_rotations.push_front(0.0);
-    branch_size_ratios.push_front(1.0);
-    m_x = randomFloat() * 30.0 - 15.0;
-    m_y = randomFloat() * 30.0 - 15.0;
-    handleBranch(glm::mat4x4(1.0));
+    // Basically a wrapper for the turtle.
+    finishDerivation();
+    beginTree();
+    advance((size_t)-1);
 }
 
-void TreeMaker::handleBranch(glm::mat4x4 current_total_transformation){
-    while(L_string[L_index] != '\0'){
+void TreeMaker::beginTree()
+{
+    beginInterpretation();
+    placeTrunk();
+
+    // The trunk points straight up at full size.
+    m_pending.clear();
+    BranchParams trunk = {0.0f, 0.0f, 1.0f};
+    m_pending.push_back(trunk);
+
+    // The outermost state holds the trunk, and is never closed.  Slots 0 and 1 were the position.
+    // The turtle grows along z, so the base is tipped over to make z point up.
+    TurtleState root = {glm::vec3(m_x, -5, m_y),
+                        glm::angleAxis((float)(-90.0 * DEG_TO_RAD), glm::vec3(1,0,0)),
+                        m_trunkRadius, m_treeKey, 2, 0, -1};
+    beginTurtle(root, m_deriveIters);
+}
 
-        // **************************************************
+bool TreeMaker::advance(size_t maxSymbols)
+{
+    // Any iterations reset left are done first, one a call, so that no call does much
+    // more than one iteration or maxSymbols symbols.
+    if(deriveNext()){
+        return false;
+    }
+    return runTurtle(maxSymbols);
+}
 
-        // The section to handle the actual transformation matrix calculations.
-        if(L_string[L_index] == '['){
+void TreeMaker::beginGrowth(float trunkRadius, InstanceStore *shapeTransformations, InstanceStore *leafTransformations, uint64_t seed)
+{
+    m_treeKey = seed;
+    m_trunkRadius = trunkRadius;
+    m_shapeTransformations = shapeTransformations;
+    m_leafTransformations = leafTransformations;
+    placeTrunk();
+
+    // The trunk is the one bud, set up just as makeTree would.
+    Bud trunk = {{glm::vec3(m_x, -5, m_y),
+                  glm::angleAxis((float)(-90.0 * DEG_TO_RAD), glm::vec3(1,0,0)),
+                  m_trunkRadius, m_treeKey, 2, 0, -1},
+                 {0.0f, 0.0f, 1.0f}};
+    m_buds.assign(1, trunk);
+}
 
-            // This is where we need to recurse.
-            float phi = phi_rotations.front();
-            phi_rotations.pop_front();
-            float theta = theta_rotations.front();
-            theta_rotations.pop_front();
+/**
+ * @brief TreeMaker::grow rewrites the buds, and only them, once
+ * The buds are derived together as one string of '!'s.  Each one's successor then starts
+ * with the '[' of its branch, which is opened here, and ends with the matching ']', where
+ * the turtle stops.  The '!'s inside become the next buds.
+ */
+size_t TreeMaker::grow(bool last)
+{
+    size_t numBranches = m_shapeTransformations->size();
 
-            float branch_size_ratio = branch_size_ratios.front();
-            branch_size_ratios.pop_front();
-            current_branch_radius *= branch_size_ratio;
+    m_growingBuds.swap(m_buds);
+    m_buds.clear();
 
-            // The randomly generated length of this branch will be between 5 and 15 times the diameter.
-            float length = (randomFloat() * 10.0 + 5.0) * current_branch_radius;
+    L_string.assign(m_growingBuds.size(), '!');
+    L_keys.resize(m_growingBuds.size());
+    for(size_t i = 0; i < m_growingBuds.size(); i++){
+        const TurtleState &parent = m_growingBuds[i].parent;
+        L_keys[i] = Random::childKey(parent.key, parent.child);
+    }
+    m_lsystem.derive(L_string, L_keys, m_nextString, m_nextKeys, last);
+    L_string.swap(m_nextString);
+    L_keys.swap(m_nextKeys);
 
-            // Will transform object space to reside at the tip of the new branch.
-            glm::mat4x4 coord_translation = glm::translate(glm::mat4x4(1.0), glm::vec3(0.0f, 0.0f, length));
-            // The cylinder, being centered at the origin, needs a separate translation matrix.
-            glm::mat4x4 cyl_translation = glm::translate(glm::mat4x4(1.0), glm::vec3(0.0, 0.0, length / 2));
-            // Will transform object space so that the y-axis is aligned with the new branch. (angle, axis)
-            glm::mat4x4 rotation = glm::rotate(glm::mat4x4(1.0), phi, glm::vec3(sin(theta), cos(theta), 0.0));
-            // Scale matrix in order to transform the cylinder itself.
-            glm::mat4x4 scale = glm::scale(glm::mat4x4(1.0), glm::vec3(current_branch_radius, current_branch_radius, length));
+    L_index = 0;
+    m_source = SOURCE_STRING;
+    m_growing = true;
+    for(size_t i = 0; i < m_growingBuds.size(); i++){
+        nextSymbol();
+        m_pending.assign(1, m_growingBuds[i].params);
+        TurtleState branch = startBranch(m_growingBuds[i].parent);
+        interpret(branch, 1);
+    }
+    m_growing = false;
 
-            //glm::vec4 to_origin = current_total_transformation[3];
-            //to_origin.x = current_total_transformation[0].w;
-            //to_origin.y = current_total_transformation[1].w;
-            //to_origin.z = current_total_transformation[2].w;
-            //to_origin.w = 1.0;
+    return m_shapeTransformations->size() - numBranches;
+}
 
-            glm::mat4x4 branch_trans = current_total_transformation * rotation * cyl_translation;
+/**
+ * @brief TreeMaker::addBud leaves the next child branch to be grown later
+ */
+void TreeMaker::addBud(TurtleState &state)
+{
+    Bud bud = {state, takeParams()};
+    m_buds.push_back(bud);
+    state.child++;
+}
 
-            glm::mat4x4 coord_trans = current_total_transformation * rotation * coord_translation;
+/**
+ * @brief TreeMaker::makeSubtree grows a lone subtree in its own frame
+ * It is grown as if the tree's key were key, its trunk being the subtree's first branch.
+ */
+void TreeMaker::makeSubtree(InstanceStore *branches, InstanceStore *leaves, uint64_t key, int iterations)
+{
+    m_shapeTransformations = branches;
+    m_leafTransformations = leaves;
+    m_treeKey = key;
 
-            // Used to add the cylinder itself to the scenegraph.
-            //glm::mat4x4 branch_trans = glm::translate(glm::mat4x4(1.0), glm::vec3(to_origin))
-            //        * cyl_translation * current_total_transformation * rotation;
-            // And the tranformation to manipulate object space.
-            //glm::mat4x4 coord_trans = glm::translate(glm::mat4x4(1.0), glm::vec3(to_origin))
-            //        * coord_translation * current_total_transformation * rotation
-            //        * glm::translate(glm::mat4x4(1.0), glm::vec3(-to_origin));
+    std::vector<uint64_t> keys(1, Random::childKey(key, 0));
+    derive(keys, iterations);
+    beginInterpretation();
 
-            // Adding the cylinder representing the branch to the sceneview graph.
-            m_shapeTransformations->push_front(glm::translate(glm::mat4x4(1.0), glm::vec3(m_x, -5, m_y))
-                        * glm::rotate(glm::mat4x4(1.0), (float)(-90.0 * DEG_TO_RAD), glm::vec3(1,0,0)) * branch_trans * scale);
+    m_pending.clear();
+    BranchParams straight = {0.0f, 0.0f, 1.0f};
+    m_pending.push_back(straight);
 
-            // * glm::rotate(glm::mat4x4(1.0), (float)(90.0 * DEG_TO_RAD), glm::vec3(1,0,0))
+    // The depth is the one the subtree has in a whole tree.
+    TurtleState root = {glm::vec3(0.0f), glm::quat(), 1.0f, key, 1, 0, m_species.iterations - iterations - 1};
+    interpret(root, iterations);
+}
 
-            //m_shapeTransformations->push_front(branch_trans * scale * glm::translate(glm::mat4x4(1.0), glm::vec3(-to_origin)));
+/**
+ * @brief TreeMaker::interpret walks the turtle over the symbols until root is closed or
+ * they run out.  There is no recursion, every open branch is one entry of m_stack.
+ * @param maxDepth how many branches can be open at once below root
+ */
+void TreeMaker::interpret(const TurtleState &root, int maxDepth)
+{
+    beginTurtle(root, maxDepth);
+    runTurtle((size_t)-1);
+}
 
-            // Recurse.  Remember, there's no L_index increment at the beginning of the nested call.
-            L_index++;
-            handleBranch(coord_trans);
-            //handleBranch(coord_trans);
+void TreeMaker::beginTurtle(const TurtleState &root, int maxDepth)
+{
+    // Both stacks are sized up front, so nothing is allocated while walking.
+    m_stack.clear();
+    m_stack.reserve(maxDepth + 2);
+    m_pending.reserve(m_pending.size() + 3 * (maxDepth + 2));
+    m_stack.push_back(root);
+}
 
-            // We need to recover this class-global variable's original value when the sub-recursion finishes.
-            current_branch_radius /= branch_size_ratio;
+/**
+ * @brief TreeMaker::runTurtle reads at most maxSymbols symbols
+ * All of the turtle's state is in m_stack and m_pending, so it can stop after any symbol
+ * and pick up from there on the next call.
+ * @return true once root is closed or the symbols run out
+ */
+bool TreeMaker::runTurtle(size_t maxSymbols)
+{
+    // The loop is compiled once per source, so reading a symbol is inlined.
+    switch(m_source){
+    case SOURCE_STRING:
+        return runTurtleFrom<SOURCE_STRING>(maxSymbols);
+    case SOURCE_STREAM:
+        return runTurtleFrom<SOURCE_STREAM>(maxSymbols);
+    default:
+        return runTurtleFrom<SOURCE_MODULES>(maxSymbols);
+    }
+}
 
-        }
+template <TreeMaker::SymbolSource Source>
+char TreeMaker::nextSymbolFrom()
+{
+    if(Source == SOURCE_STRING){
+        return (L_index < (int)L_string.length()) ? L_string[L_index++] : '\0';
+    }
+    if(Source == SOURCE_STREAM){
+        return m_lsystem.nextSymbol();
+    }
+    return nextSymbol();
+}
 
-        // **************************************************
-
-        // The section to prepare for branchings.
-        else if(L_string[L_index] == 'a'){
-            // One branching, only slightly smaller than the parent.
-            // This branch may bend up to 60 degrees from the parent, and at any angle.
-            float phi = randomFloat() * 60 * DEG_TO_RAD;
-            float theta = randomFloat() * 360 * DEG_TO_RAD;
-            //float phi = 90;
-            //float theta = 0;
-
-            phi_rotations.push_front(phi);
-            theta_rotations.push_front(theta);
-
-            branch_size_ratios.push_front(.75);
-        } else if(L_string[L_index] == 'b'){
-            // Two branchings.
-            // I balance the sizes and directions of the two branches.
-            // If one is bigger, the other is smaller.
-            // The bigger one will be closer in line to the parent branch.  The smaller will stick out more.
-            // Their thetas will differ by 180 degrees.
-
-            // The branches can rotate in any direction.
-            float theta1 = randomFloat() * 360 * DEG_TO_RAD;
-            float theta2 = theta1 + (180 * DEG_TO_RAD);
-
-            // The ratios can be between .9 and .3, with an average of .6.
-            float ratio1 = randomFloat() * .6 + .3;
-            float ratio2 = 1.2 - ratio1;
-
-            float phi1 = (1.0 - ratio1) * 45 * DEG_TO_RAD;
-            float phi2 = (1.0 - ratio2) * 45 * DEG_TO_RAD;
-
-            phi_rotations.push_front(phi1);
-            phi_rotations.push_front(phi2);
-            theta_rotations.push_front(theta1);
-            theta_rotations.push_front(theta2);
-            branch_size_ratios.push_front(ratio1);
-            branch_size_ratios.push_front(ratio2);
-        } else if(L_string[L_index] == 'c'){
-            // Three branchings.
-            // The minimum theta angle between two branches is 35 degrees.  Maximum is 160.
-            // The minimum phi angle is 25 degrees.  Maximum is 80.  Independent.
-            // The ratios range from .7 to .25.  Independent.
-
-            float theta1 = randomFloat() * 360 * DEG_TO_RAD;
-            float theta2 = theta1 + (randomFloat() * 125 + 35) * DEG_TO_RAD;
-            float theta3 = theta2 + (randomFloat() * 125 + 35) * DEG_TO_RAD;
-
-            float phi1 = (randomFloat() * 55 + 25) * DEG_TO_RAD;
-            float phi2 = (randomFloat() * 55 + 25) * DEG_TO_RAD;
-            float phi3 = (randomFloat() * 55 + 25) * DEG_TO_RAD;
-
-            float ratio1 = randomFloat() * .45 + .25;
-            float ratio2 = randomFloat() * .45 + .25;
-            float ratio3 = randomFloat() * .45 + .25;
-
-            phi_rotations.push_front(phi1);
-            phi_rotations.push_front(phi2);
-            phi_rotations.push_front(phi3);
-            theta_rotations.push_front(theta1);
-            theta_rotations.push_front(theta2);
-            theta_rotations.push_front(theta3);
-            branch_size_ratios.push_front(ratio1);
-            branch_size_ratios.push_front(ratio2);
-            branch_size_ratios.push_front(ratio3);
+template <TreeMaker::SymbolSource Source>
+bool TreeMaker::runTurtleFrom(size_t maxSymbols)
+{
+    for(size_t n = 0; n < maxSymbols && !m_stack.empty(); n++){
+        char symbol = nextSymbolFrom<Source>();
+        TurtleState &state = m_stack.back();
+
+        switch(symbol){
+        case '\0':
+            m_stack.clear();
+            return true;
+        case '[':
+            m_stack.push_back(startBranch(state));
+            break;
+        case 'a':
+        case 'b':
+        case 'c':
+            prepareBranches(state, symbol);
+            break;
+        case 'x':
+            addLeaf(state);
+            break;
+        case '!':
+            if(m_growing){
+                addBud(state);
+            } else if(m_templates){
+                addTemplateRef(state);
+            }
+            break;
+        case ']':
+            // Lessen the depth upon closing bracket.
+            m_stack.pop_back();
+            break;
         }
+    }
+    return m_stack.empty();
+}
 
-        // **************************************************
+// Will rotate object space so that the z-axis is aligned with a new branch. (angle, axis)
+glm::quat TreeMaker::branchRotation(const BranchParams &params)
+{
+    return glm::angleAxis(params.phi, glm::vec3(sin(params.theta), cos(params.theta), 0.0));
+}
 
-        // The section for generating leaves.
-        else if(L_string[L_index] == 'x'){
-            // Generate one leaf.
-            // Random value for phi and theta.
-            float phi = randomFloat() * 30 * DEG_TO_RAD;
-            float theta = randomFloat() * 360 * DEG_TO_RAD;
+/**
+ * @brief TreeMaker::startBranch adds the next child branch of parent to the tree
+ * @return the turtle state inside of the new branch
+ */
+// Takes the parameters set up for the next child.  A grammar that opens a branch nothing
+// set up gets a straight one of the parent's radius, rather than reading past the end.
+TreeMaker::BranchParams TreeMaker::takeParams()
+{
+    if(m_pending.empty()){
+        BranchParams straight = {0.0f, 0.0f, 1.0f};
+        return straight;
+    }
+    BranchParams params = m_pending.back();
+    m_pending.pop_back();
+    return params;
+}
 
-            // We do not translate or scale the leaf in object space.
-            // We only need to rotate.
-            glm::mat4x4 rotation = glm::rotate(glm::mat4x4(1.0), phi, glm::vec3(sin(theta), cos(theta), 0.0));
+TreeMaker::TurtleState TreeMaker::startBranch(TurtleState &parent)
+{
+    BranchParams params = takeParams();
+
+    TurtleState state;
+    state.radius = parent.radius * params.ratio;
+    // The key of the new branch.  This matches the key the L-system gave the '!' it grew from.
+    state.key = Random::childKey(parent.key, parent.child++);
+    // Slot 0 is this branch's own length.
+    state.slot = 1;
+    state.child = 0;
+    state.depth = parent.depth + 1;
+
+    // The randomly generated length of this branch is a multiple of its radius.
+    float length = (randomFloat(state.key, 0) * (m_species.maxLength - m_species.minLength) +
+                    m_species.minLength) * state.radius;
+
+    state.orientation = parent.orientation * branchRotation(params);
+
+    // The branch runs from the parent's tip along its own z-axis.  The cylinder, being
+    // centered at the origin, sits halfway along, and the new tip at the far end.
+    glm::vec3 axis = state.orientation * glm::vec3(0.0f, 0.0f, 1.0f);
+    glm::vec3 center = parent.position + axis * (length / 2);
+    state.position = parent.position + axis * length;
+
+    // Adding the cylinder representing the branch to the sceneview graph.
+    BranchInfo info = {state.key, (uint64_t)state.depth};
+    m_shapeTransformations->append(center, state.orientation, state.radius, length, info);
+
+    return state;
+}
 
-            // Store the transformation matrix.
-            m_leafTransformations->push_front(rotation * current_total_transformation);
-        }
+/**
+ * @brief TreeMaker::addTemplateRef puts a template where the next child branch would grow
+ * The template is scaled to the radius the branch would have had.
+ */
+void TreeMaker::addTemplateRef(TurtleState &state)
+{
+    BranchParams params = takeParams();
+
+    // The key of the '!' being replaced, as in startBranch
+    uint64_t key = Random::childKey(state.key, state.child++);
 
-        // **************************************************
+    TemplateRef ref = {state.position, state.orientation * branchRotation(params),
+                       state.radius * params.ratio, m_templates->pick(key)};
+    m_templateRefs->push_back(ref);
+}
 
-        // Lessen recursion upon closing bracket.
-        else if(L_string[L_index] == ']'){
-            return;
+/**
+ * @brief TreeMaker::prepareBranches sets up the parameters of the children to come
+ * They are used last in first out by startBranch.
+ */
+void TreeMaker::prepareBranches(TurtleState &state, char symbol)
+{
+    if(symbol == 'a'){
+        // One branching, only slightly smaller than the parent.
+        // This branch may bend up to aMaxPhi degrees from the parent, and at any angle.
+        BranchParams p;
+        p.phi = param(0, randomFloat(state.key, state.slot++) * m_species.aMaxPhi) * DEG_TO_RAD;
+        p.theta = param(1, randomFloat(state.key, state.slot++) * 360) * DEG_TO_RAD;
+        p.ratio = param(2, m_species.aRatio);
+
+        m_pending.push_back(p);
+    } else if(symbol == 'b'){
+        // Two branchings.
+        // I balance the sizes and directions of the two branches.
+        // If one is bigger, the other is smaller.
+        // The bigger one will be closer in line to the parent branch.  The smaller will stick out more.
+        // Their thetas will differ by 180 degrees.
+        BranchParams p1, p2;
+
+        // The branches can rotate in any direction.
+        p1.theta = randomFloat(state.key, state.slot++) * 360 * DEG_TO_RAD;
+        p2.theta = p1.theta + (180 * DEG_TO_RAD);
+
+        // The ratios are between bMinRatio and bMaxRatio, and add up to their sum.
+        p1.ratio = randomFloat(state.key, state.slot++) * (m_species.bMaxRatio - m_species.bMinRatio) + m_species.bMinRatio;
+        p2.ratio = m_species.bMinRatio + m_species.bMaxRatio - p1.ratio;
+
+        p1.phi = (1.0 - p1.ratio) * m_species.bBend * DEG_TO_RAD;
+        p2.phi = (1.0 - p2.ratio) * m_species.bBend * DEG_TO_RAD;
+
+        m_pending.push_back(p1);
+        m_pending.push_back(p2);
+    } else if(symbol == 'c'){
+        // Three branchings.
+        // The theta angle between two branches is between cMinSpread and cMaxSpread degrees.
+        // The phi angles and ratios are drawn independently from their ranges.
+        const Species &s = m_species;
+        BranchParams p[3];
+
+        p[0].theta = randomFloat(state.key, state.slot++) * 360 * DEG_TO_RAD;
+        p[1].theta = p[0].theta + (randomFloat(state.key, state.slot++) * (s.cMaxSpread - s.cMinSpread) + s.cMinSpread) * DEG_TO_RAD;
+        p[2].theta = p[1].theta + (randomFloat(state.key, state.slot++) * (s.cMaxSpread - s.cMinSpread) + s.cMinSpread) * DEG_TO_RAD;
+
+        for(int i = 0; i < 3; i++){
+            p[i].phi = (randomFloat(state.key, state.slot++) * (s.cMaxPhi - s.cMinPhi) + s.cMinPhi) * DEG_TO_RAD;
+        }
+        for(int i = 0; i < 3; i++){
+            p[i].ratio = randomFloat(state.key, state.slot++) * (s.cMaxRatio - s.cMinRatio) + s.cMinRatio;
         }
 
-        // **************************************************
+        for(int i = 0; i < 3; i++){
+            m_pending.push_back(p[i]);
+        }
+    }
+}
 
-        // This is not a for loop only because L_index should not be re-initialized every recursion.
-        // We need to manually increment it here.
-        L_index++;
+/**
+ * @brief TreeMaker::addLeaf generates one leaf at the current tip
+ */
+void TreeMaker::addLeaf(TurtleState &state)
+{
+    // Random value for phi and theta.
+    float phi = param(0, randomFloat(state.key, state.slot++) * m_species.leafMaxPhi) * DEG_TO_RAD;
+    float theta = param(1, randomFloat(state.key, state.slot++) * 360) * DEG_TO_RAD;
 
-    }
+    // We do not translate or scale the leaf in object space.
+    // We only need to rotate it within the frame at the tip of the branch.
+    glm::quat rotation = glm::angleAxis(phi, glm::vec3(sin(theta), cos(theta), 0.0));
+
+    // Store the transformation.  Leaves are unscaled.
+    m_leafTransformations->append(state.position, state.orientation * rotation, 1.0f, 1.0f);
 }
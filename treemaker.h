@@ -1,9 +1,12 @@
 #ifndef TREEMAKER_H
 #define TREEMAKER_H
 
-#include <deque>
 #include <string>
-#include "Common.h"
+#include "lsystem.h"
+#include "parametriclsystem.h"
+#include "instancestore.h"
+#include "templatelibrary.h"
+#include "species.h"
 
 class TreeMaker{
 
@@ -11,33 +14,211 @@ public:
     TreeMaker();
     ~TreeMaker();
 
-    void reset(float trunkRadius, std::deque<glm::mat4x4> *shapeTransformations, std::deque<glm::mat4x4> *leafTransformations);
+    void reset(float trunkRadius, InstanceStore *shapeTransformations, InstanceStore *leafTransformations, uint64_t seed);
 
     void makeTree();
 
+    // Plants the next trees with their trunks at (x, y) on the ground, instead of at a spot
+    // drawn from their seed in the 30x30 square around the origin.  Their shape is the same
+    // wherever they stand.
+    void setPosition(float x, float y);
+    // Goes back to drawing the spot from the seed
+    void clearPosition() { m_placed = false; }
+
+    // makeTree in pieces.  beginTree sets the turtle up, and each call to advance reads at
+    // most maxSymbols more symbols, returning true once the tree is done.  With streaming
+    // on, reset does no work up front either, so a tree can be built in slices of any size.
+    // Where the string can't be streamed, with templates or a grammar set, reset leaves the
+    // derivation to advance, which runs one iteration a call before the turtle starts.
+    void beginTree();
+    bool advance(size_t maxSymbols);
+
+    // Grows trees from a parametric grammar instead of the built in one, or goes back to
+    // the built in one when source is empty.  See ParametricLSystem for the syntax.  Apart
+    // from [ and ], the turtle reads a, b and c as branchings and x as a leaf.  a(phi, theta,
+    // ratio) and x(phi, theta) take their angles in degrees, and parameters left out are
+    // drawn at random as usual.  On a syntax error the grammar is unchanged.  Only the
+    // benchmark sets a grammar for now; the viewer always grows species.
+    bool setGrammar(const std::string &source, std::string *error = 0);
+
+    // With a library set, trees stop library->iterations() iterations short, and every
+    // subtree that is left is added to refs as a reference to one of the templates.
+    // Only used with the built in grammar, and never streamed.  Pass null to turn it off.
+    void setTemplates(const TemplateLibrary *library, std::vector<TemplateRef> *refs);
+
+    // Grows the subtree of one '!' of the built in grammar, for the given number of
+    // iterations.  Its first branch starts at the origin along z, with a radius of 1.
+    void makeSubtree(InstanceStore *branches, InstanceStore *leaves, uint64_t key, int iterations);
+
+    // Starts a tree of the built in grammar that grows one iteration per call to grow,
+    // instead of all at once.  It begins with nothing but the unopened trunk.
+    void beginGrowth(float trunkRadius, InstanceStore *shapeTransformations, InstanceStore *leafTransformations, uint64_t seed);
+
+    // Grows every open '!' of the tree by one iteration, appending only the new branches
+    // and leaves.  With last set the final rules cap everything with leaves, and the tree
+    // is done.  Once done, the stores hold the same instances makeTree would have made
+    // with as many iterations, but in the order they grew.  Returns the number of new branches.
+    size_t grow(bool last = false);
+
+    // Number of '!'s left to grow
+    size_t budCount() const { return m_buds.size(); }
+
+    // When streaming, the L-system is expanded on demand as makeTree walks it instead of
+    // being fully derived by reset.  Peak memory is then proportional to the depth.
+    void setStreaming(bool streaming);
+
+    // Number of threads reset may use to derive the L-system.
+    void setDerivationThreads(int numThreads);
+
+    // On one thread the built in rules are derived by StaticLSystem, which has them compiled
+    // in.  Turning that off derives them through LSystem's tables, as more threads do, so
+    // that thread counts can be compared on the same code.
+    void setCompiledRules(bool compiled);
+
+    // Grows trees of the given species from now on.  Its rules replace the built in grammar's,
+    // and its ranges are what a, b, c and x draw from.
+    void setSpecies(const Species &species);
+    const Species &species() const { return m_species; }
+
+    // Number of iterations trees of the built in grammar are derived for.  Defaults to the species'.
+    void setIterations(int iterations) { m_species.iterations = iterations; }
+    int iterations() const { return m_species.iterations; }
+
+    // Per iteration throughput of the last derivation
+    const std::vector<LSystem::DeriveStats> &derivationStats() const { return m_deriveStats; }
+
+    // The most frames the streaming expansion held at once while making the last tree, or 0
+    // if it wasn't streamed.  Streaming memory goes with this, not with the string length.
+    size_t peakStreamDepth() const { return m_source == SOURCE_STREAM ? m_lsystem.peakStreamDepth() : 0; }
+
+    // The string reset derived.  Only whole with the built in grammar and streaming off.
+    const std::string &derivedString() const { return L_string; }
+
 protected:
 
+    void derive(const std::vector<uint64_t> &keys, int iterations, bool finish = true);
+    void beginDerivation(const std::vector<uint64_t> &keys, int iterations, bool finish = true);
+    void beginGrammar();
+    bool deriveNext();
+    void finishDerivation();
     void cycleLString(int iterNum);
-    void handleBranch(glm::mat4x4 current_total_transformation);
+
+    // Where the turtle is inside of one open branch
+    struct TurtleState
+    {
+        glm::vec3 position;    // World space tip of the branch
+        glm::quat orientation; // The branch grows along this frame's z-axis
+        float radius;
+        uint64_t key;          // Every random draw inside the branch is made from this
+        uint32_t slot;         // The next free random slot
+        uint32_t child;        // How many child branches have been started
+        int depth;             // The trunk is 0
+    };
+
+    // How the next child branch bends and shrinks
+    struct BranchParams
+    {
+        float phi;
+        float theta;
+        float ratio;
+    };
+
+    void interpret(const TurtleState &root, int maxDepth);
+    void beginTurtle(const TurtleState &root, int maxDepth);
+    bool runTurtle(size_t maxSymbols);
+    static glm::quat branchRotation(const BranchParams &params);
+    BranchParams takeParams();
+    TurtleState startBranch(TurtleState &parent);
+    void addTemplateRef(TurtleState &state);
+    void addBud(TurtleState &state);
+    void prepareBranches(TurtleState &state, char symbol);
+    void addLeaf(TurtleState &state);
+    float randomFloat(uint64_t key, uint32_t slot);
+    float param(int i, float fallback);
+    char nextSymbol();
+    void beginInterpretation();
+    void placeTrunk();
+    bool streams() const { return m_streaming && !m_parametric && !m_templates; }
 
     float m_trunkRadius;
 
-    std::deque<glm::mat4x4> *m_shapeTransformations;
-    std::deque<glm::mat4x4> *m_leafTransformations;
+    InstanceStore *m_shapeTransformations;
+    InstanceStore *m_leafTransformations;
+
+    LSystem m_lsystem;
+    std::vector<LSystem::DeriveStats> m_deriveStats;
 
     std::string L_string;
+    // Keys of the keyed symbols in L_string
+    std::vector<uint64_t> L_keys;
+    // Scratch buffers that each iteration is derived into
+    std::string m_nextString;
+    std::vector<uint64_t> m_nextKeys;
+    // The iteration count of the current derivation, how many of them are done, and if
+    // its last one uses the final rules
+    int m_deriveIters;
+    int m_derivedIters;
+    bool m_deriveFinal;
     int L_index;
 
+    // Every random draw of a tree is made from this key.
+    uint64_t m_treeKey;
+
     float m_x, m_y;
+    // Set when m_x and m_y come from setPosition
+    bool m_placed;
 
     int numIters;
-
-    // Only ever use push/pop_front on these, turns them into a stack.
-    std::deque<float> phi_rotations;
-    std::deque<float> theta_rotations;
-    std::deque<float> branch_size_ratios;
-
-    float current_branch_radius;
+    Species m_species;
+    // Set while the species has the built in rules, which StaticLSystem derives faster
+    bool m_builtInRules;
+    // Cleared by setCompiledRules(false)
+    bool m_compiledRules;
+
+    bool m_streaming;
+
+    // Set when trees come from m_grammar.  The derived modules then take the place of
+    // L_string and L_keys.
+    bool m_parametric;
+    ParametricLSystem m_grammar;
+    ParametricLSystem::ModuleString m_modules;
+    ParametricLSystem::ModuleString m_nextModules;
+    size_t m_paramIndex;
+    // Parameters of the symbol nextSymbol last returned
+    const float *m_symbolParams;
+    int m_symbolArity;
+
+    const TemplateLibrary *m_templates;
+    std::vector<TemplateRef> *m_templateRefs;
+
+    // One entry for every open branch
+    std::vector<TurtleState> m_stack;
+    // Parameters set up by a, b and c for the branches still to come.  Used as a stack.
+    std::vector<BranchParams> m_pending;
+
+    // Where nextSymbol reads from
+    enum SymbolSource
+    {
+        SOURCE_STRING,  // L_string
+        SOURCE_STREAM,  // The streaming derivation of m_lsystem
+        SOURCE_MODULES  // m_modules, from the parametric grammar
+    };
+    SymbolSource m_source;
+
+    // runTurtle and nextSymbol for one source
+    template <SymbolSource Source> bool runTurtleFrom(size_t maxSymbols);
+    template <SymbolSource Source> char nextSymbolFrom();
+
+    // A '!' of a growing tree that is yet to be grown.  parent.child is its index among
+    // the children of its parent branch, which gives it its key.
+    struct Bud
+    {
+        TurtleState parent;
+        BranchParams params;
+    };
+    bool m_growing;
+    std::vector<Bud> m_buds;
+    std::vector<Bud> m_growingBuds;
 
 };
 
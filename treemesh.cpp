@@ -0,0 +1,138 @@
+#include "treemesh.h"
+#include <glm/gtc/constants.hpp>
+#include <math.h>
+
+// Vertices around each ring.  The first is repeated at the end for the texture seam.
+#define RING_SLICES 8
+
+// How far a side branch starts inside its parent, in its own radii
+#define SIDE_BRANCH_SINK 0.5f
+
+TreeMesh::TreeMesh()
+{
+    m_treeStarts.push_back(0);
+
+    m_ringCos.resize(RING_SLICES + 1);
+    m_ringSin.resize(RING_SLICES + 1);
+    for(int s = 0; s <= RING_SLICES; s++){
+        float angle = 2.0f * glm::pi<float>() * s / RING_SLICES;
+        m_ringCos[s] = cos(angle);
+        m_ringSin[s] = sin(angle);
+    }
+}
+
+void TreeMesh::clear()
+{
+    m_vertices.clear();
+    m_indices.clear();
+    m_treeStarts.assign(1, 0);
+}
+
+/**
+ * @brief TreeMesh::appendTree sweeps the branches of one tree
+ * Branches are stored depth first, so the parent of every branch is the last one before
+ * it on a lower level, and has already been swept when the branch is reached.
+ */
+void TreeMesh::appendTree(const InstanceStore &branches)
+{
+    size_t n = branches.size();
+    m_parents.assign(n, -1);
+    m_widestChild.assign(n, -1);
+    m_tipRings.assign(n, 0);
+    m_tipV.assign(n, 0.0f);
+    m_open.clear();
+
+    // Find every branch's parent, and the widest child each branch continues into
+    for(size_t i = 0; i < n; i++){
+        uint64_t level = branches.info(i).level;
+        while(!m_open.empty() && branches.info(m_open.back()).level >= level){
+            m_open.pop_back();
+        }
+        if(!m_open.empty()){
+            int parent = m_open.back();
+            m_parents[i] = parent;
+            int widest = m_widestChild[parent];
+            if(widest < 0 || branches.radii()[i] > branches.radii()[widest]){
+                m_widestChild[parent] = (int)i;
+            }
+        }
+        m_open.push_back((int)i);
+    }
+
+    for(size_t i = 0; i < n; i++){
+        const glm::quat &orientation = branches.orientations()[i];
+        glm::vec3 axis = orientation * glm::vec3(0.0f, 0.0f, 1.0f);
+        float radius = branches.radii()[i];
+        float length = branches.lengths()[i];
+        glm::vec3 base = branches.positions()[i] - axis * (length / 2);
+        glm::vec3 tip = base + axis * length;
+
+        int parent = m_parents[i];
+        uint32_t baseRing;
+        float baseV;
+        if(parent >= 0 && m_widestChild[parent] == (int)i){
+            // Welded onto the parent's tip
+            baseRing = m_tipRings[parent];
+            baseV = m_tipV[parent];
+        } else {
+            baseV = (parent >= 0) ? m_tipV[parent] : 0.0f;
+            glm::vec3 sunk = (parent >= 0) ? base - axis * (radius * SIDE_BRANCH_SINK) : base;
+            baseRing = addRing(sunk, orientation, radius, baseV);
+        }
+
+        // The texture wraps around once, so it keeps its aspect by advancing one
+        // circumference of length per repeat.
+        float tipV = baseV + length / (2.0f * glm::pi<float>() * radius);
+
+        int child = m_widestChild[i];
+        uint32_t tipRing;
+        if(child >= 0){
+            // Tilted halfway to the child, and as wide as it
+            glm::quat joint = glm::slerp(orientation, branches.orientations()[child], 0.5f);
+            tipRing = addRing(tip, joint, branches.radii()[child], tipV);
+        } else {
+            tipRing = addRing(tip, orientation, 0.0f, tipV);
+        }
+
+        addBand(baseRing, tipRing);
+        m_tipRings[i] = tipRing;
+        m_tipV[i] = tipV;
+    }
+
+    m_treeStarts.push_back(m_indices.size());
+}
+
+uint32_t TreeMesh::addRing(const glm::vec3 &center, const glm::quat &orientation, float radius, float v)
+{
+    uint32_t first = (uint32_t)m_vertices.size();
+
+    // Every ring is the same circle in its own frame, so the frame's axes are all that
+    // needs rotating.
+    glm::mat3 frame = glm::mat3_cast(orientation);
+    for(int s = 0; s <= RING_SLICES; s++){
+        float c = m_ringCos[s];
+        float sn = m_ringSin[s];
+
+        MeshVertex vertex;
+        vertex.normal = frame[0] * c + frame[1] * sn;
+        vertex.position = center + vertex.normal * radius;
+        vertex.texCoord = glm::vec2((float)s / RING_SLICES, v);
+        vertex.tangent = frame[1] * c - frame[0] * sn;
+        vertex.bitangent = frame[2];
+        m_vertices.push_back(vertex);
+    }
+    return first;
+}
+
+void TreeMesh::addBand(uint32_t base, uint32_t tip)
+{
+    for(uint32_t s = 0; s < RING_SLICES; s++){
+        m_indices.push_back(base + s);
+        m_indices.push_back(base + s + 1);
+        m_indices.push_back(tip + s + 1);
+
+        m_indices.push_back(base + s);
+        m_indices.push_back(tip + s + 1);
+        m_indices.push_back(tip + s);
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef TREEMESH_H
+#define TREEMESH_H
+
+#include "instancestore.h"
+
+// Laid out like glhlib's GLHVertex_VNTT3T3, so the cylinder's shader inputs read it as is
+struct MeshVertex
+{
+    glm::vec3 position;
+    glm::vec3 normal;
+    glm::vec2 texCoord;
+    glm::vec3 tangent;
+    glm::vec3 bitangent;
+};
+
+/**
+ * The branches of whole trees, swept into one triangle mesh per tree.
+ *
+ * Every branch is a tube with one ring of vertices at each end.  A branch and its widest
+ * child share the ring at their joint, which is tilted halfway between the two so the
+ * bend is welded shut, and the tube narrows from one ring to the next.  The other
+ * children start just inside the parent.  No caps are made, as the base of every branch
+ * is hidden in its parent or the ground, and a branch with nothing growing out of it
+ * comes to a point instead.
+ *
+ * The trees are appended to shared vertex and index arrays, each tree being one range
+ * of indices so it can be drawn with a single call.
+ */
+class TreeMesh
+{
+public:
+    TreeMesh();
+
+    void clear();
+
+    // Sweeps the branches of one tree, which must have info, and appends them as the next tree.
+    void appendTree(const InstanceStore &branches);
+
+    const std::vector<MeshVertex> &vertices() const { return m_vertices; }
+    const std::vector<uint32_t> &indices() const { return m_indices; }
+
+    int numTrees() const { return (int)m_treeStarts.size() - 1; }
+    size_t treeFirstIndex(int tree) const { return m_treeStarts[tree]; }
+    size_t treeIndexCount(int tree) const { return m_treeStarts[tree + 1] - m_treeStarts[tree]; }
+
+private:
+    // Appends a ring of vertices around center, facing along orientation's z-axis.
+    uint32_t addRing(const glm::vec3 &center, const glm::quat &orientation, float radius, float v);
+    // Joins two rings with a band of triangles.
+    void addBand(uint32_t base, uint32_t tip);
+
+    std::vector<MeshVertex> m_vertices;
+    std::vector<uint32_t> m_indices;
+    // Where each tree's indices start, and one past the last tree's
+    std::vector<size_t> m_treeStarts;
+
+    // The unit circle of every ring
+    std::vector<float> m_ringCos;
+    std::vector<float> m_ringSin;
+
+    // Per branch scratch for appendTree
+    std::vector<int> m_parents;
+    std::vector<int> m_widestChild;
+    std::vector<uint32_t> m_tipRings;
+    std::vector<float> m_tipV;
+    std::vector<int> m_open;
+};
+
+#endif // TREEMESH_H
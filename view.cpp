@@ -1,8 +1,53 @@
 #include "view.h"
 #include <QApplication>
 #include <QKeyEvent>
+#include <QFile>
+#include <QDir>
+#include <stddef.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+// How many trees make up the forest, and the width of the square they are spread over
+#define NUM_TREES 5
+#define FOREST_SIZE 30.0f
+
+// How many iterations the subtree templates stand in for, and how many of them there are
+#define TEMPLATE_ITERS 3
+#define TEMPLATE_VARIANTS 8
+
+// How long each frame may spend building trees when they are built by tick
+#define SLICE_MICROSECONDS 4000
+
+// Where built forests are saved, relative to the working directory
+#define CACHE_DIRECTORY "forestcache"
+
+// Width and length of every leaf
+#define LEAF_WIDTH 0.35f
+#define LEAF_LENGTH 0.6f
+
+// The names of the uniforms in enum Uniform and enum LeafUniform, in the same order
+static const char *UNIFORM_NAMES[NUM_UNIFORMS] = {
+    "p", "v", "m", "allBlack", "useLighting",
+    "ambient_color", "diffuse_color", "specular_color", "shininess",
+    "useTexture", "tex", "normalMap", "useArrowOffsets",
+    "blend", "useNormalMap", "useInstancing"
+};
+static const char *LEAF_UNIFORM_NAMES[NUM_LEAF_UNIFORMS] = {
+    "p", "v", "leafSize", "ambient_color",
+    "tex"
+};
+
+// Looks up the location of each of the count names in program
+static void findUniforms(GLuint program, const char *const *names, int count, GLint *locs)
+{
+    for(int i = 0; i < count; i++){
+        locs[i] = glGetUniformLocation(program, names[i]);
+    }
+}
 
-View::View(QWidget *parent) : QGLWidget(parent)
+View::View(QWidget *parent) : QGLWidget(parent),
+    m_cullPool(std::max((int)std::thread::hardware_concurrency(), 1))
 {
     // View needs all mouse move events, not just mouse drag events
     setMouseTracking(true);
@@ -31,34 +76,73 @@ View::View(QWidget *parent) : QGLWidget(parent)
     rails_flag = true;
     look_flag = false;
 
-    m_treeBranches = new std::deque<glm::mat4x4>;
-    m_treeLeaves = new std::deque<glm::mat4x4>;
+    m_forestSeed = 1;
+    m_useTemplates = false;
+    m_timeSliced = std::thread::hardware_concurrency() <= 1;
+    m_numTreesShown = 0;
+    m_slicedKey = 0;
+    m_slicedNeedsSaving = false;
 
-    m_treemaker = TreeMaker();
+    // Without the directory nothing is cached, but everything still works
+    if(QDir().mkpath(CACHE_DIRECTORY)){
+        m_cacheDirectory = CACHE_DIRECTORY;
+    }
+    m_worker.setCacheDirectory(m_cacheDirectory);
+
+    // Species come from the file named on the command line, or species.txt.  It is watched,
+    // and the trees it changes are regrown whenever it is saved.
+    QStringList args = QApplication::arguments();
+    m_speciesFile = (args.size() > 1) ? args[1] : QString("species.txt");
+    connect(&m_speciesWatcher, SIGNAL(fileChanged(QString)), this, SLOT(reloadSpecies()));
+    loadSpecies();
 
     m_useNormalMap = false;
 
     m_OpenGLDidInit = false;
+    m_useMeshes = true;
+    m_meshVertexFill.capacity = m_meshIndexFill.capacity = 0;
+    m_leafFill.capacity = m_refLeafFill.capacity = 0;
+    frontReplaced();
+    m_branchRing = 0;
+    m_instanceModelAttrib = -1;
+    m_lightUBO = 0;
+    m_lightsDirty = false;
 }
 
 View::~View()
 {
+    waitForCacheWrite();
+
     if(m_OpenGLDidInit)
     {
         // Delete the OpenGL buffers
         glDeleteVertexArrays(1, &m_vaoID);
         glDeleteBuffers(1, &m_vertexBuffer);
+        delete m_branchRing;
+        glDeleteBuffers(1, &m_lightUBO);
 
         // Delete the clinder
         glhDeleteCylinderf2(&m_cylinder);
 
+        // Delete the tree meshes
+        glDeleteVertexArrays(1, &m_meshVAO);
+        glDeleteBuffers(1, &m_meshVBO);
+        glDeleteBuffers(1, &m_meshIBO);
+        glDeleteVertexArrays(1, &m_templateVAO);
+        glDeleteBuffers(1, &m_templateVBO);
+        glDeleteBuffers(1, &m_templateIBO);
+
+        // Delete the leaves
+        glDeleteVertexArrays(1, &m_leafVAO);
+        glDeleteBuffers(1, &m_leafQuadVBO);
+        glDeleteBuffers(1, &m_leafInstanceVBO);
+        glDeleteBuffers(1, &m_refLeafInstanceVBO);
+        glDeleteTextures(1, &m_leafTexID);
+
         // Delete the skybox
         delete m_skybox;
     }
 
-    delete m_treeBranches;
-    delete m_treeLeaves;
-
     delete m_camera;
 }
 
@@ -107,11 +191,33 @@ void View::initializeGL()
     // Create the skybox
     m_skybox = new Skybox();
 
-    // Make a tree or three
-    for(int i = 0; i < 5; i++){
-        generateTree();
+    // The templates only depend on their own seed, so they are made once
+    m_templates.build(TEMPLATE_ITERS, TEMPLATE_VARIANTS, 0);
+    for(int t = 0; t < m_templates.numTemplates(); t++){
+        m_templateMesh.appendTree(m_templates.templateBranches(t));
     }
 
+    // Buffers for the swept meshes.  The forest's is filled once there is a forest.
+    makeMeshBuffers(&m_meshVAO, &m_meshVBO, &m_meshIBO);
+    makeMeshBuffers(&m_templateVAO, &m_templateVBO, &m_templateIBO);
+    uploadMesh(m_templateVBO, m_templateIBO, m_templateMesh);
+
+    // The leaf quad, and a buffer for the forest's leaves
+    makeLeafBuffers();
+
+    // For testing, use a single standard light
+    clearLights();
+    CS123SceneLightData light;
+    memset(&light, 0, sizeof(light));
+    light.type = LIGHT_DIRECTIONAL;
+    light.dir = glm::normalize(glm::vec4(1.f, -1.f, -1.f, 0.f));
+    light.color[0] = light.color[1] = light.color[2] = 1;
+    light.id = 0;
+    setLight(light);
+
+    // Make a tree or three
+    generateForest();
+
     // Mark the initilization as done
     m_OpenGLDidInit = true;
 
@@ -135,20 +241,28 @@ void View::loadShaders()
             ":/shaders/default.vert",
             ":/shaders/default.frag");
 
-    m_uniformLocs["p"]= glGetUniformLocation(m_shader, "p");
-    m_uniformLocs["m"]= glGetUniformLocation(m_shader, "m");
-    m_uniformLocs["v"]= glGetUniformLocation(m_shader, "v");
-    m_uniformLocs["allBlack"]= glGetUniformLocation(m_shader, "allBlack");
-    m_uniformLocs["useLighting"]= glGetUniformLocation(m_shader, "useLighting");
-    m_uniformLocs["ambient_color"] = glGetUniformLocation(m_shader, "ambient_color");
-    m_uniformLocs["diffuse_color"] = glGetUniformLocation(m_shader, "diffuse_color");
-    m_uniformLocs["specular_color"] = glGetUniformLocation(m_shader, "specular_color");
-    m_uniformLocs["shininess"] = glGetUniformLocation(m_shader, "shininess");
-    m_uniformLocs["useTexture"] = glGetUniformLocation(m_shader, "useTexture");
-    m_uniformLocs["tex"] = glGetUniformLocation(m_shader, "tex");
-    m_uniformLocs["useArrowOffsets"] = glGetUniformLocation(m_shader, "useArrowOffsets");
-    m_uniformLocs["blend"] = glGetUniformLocation(m_shader, "blend");
-    m_uniformLocs["useNormalMap"] = glGetUniformLocation(m_shader, "useNormalMap");
+    findUniforms(m_shader, UNIFORM_NAMES, NUM_UNIFORMS, m_uniformLocs);
+
+    m_leafShader = ResourceLoader::loadShaders(
+            ":/shaders/leaf.vert",
+            ":/shaders/leaf.frag");
+
+    findUniforms(m_leafShader, LEAF_UNIFORM_NAMES, NUM_LEAF_UNIFORMS, m_leafUniformLocs);
+
+    // Both programs read their lights from the same buffer
+    GLuint programs[2] = {m_shader, m_leafShader};
+    for(int i = 0; i < 2; i++){
+        GLuint block = glGetUniformBlockIndex(programs[i], "Lights");
+        if(block != GL_INVALID_INDEX){
+            glUniformBlockBinding(programs[i], block, LIGHT_BLOCK_BINDING);
+        }
+    }
+
+    glGenBuffers(1, &m_lightUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, m_lightUBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(LightBlock), 0, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, LIGHT_BLOCK_BINDING, m_lightUBO);
 }
 
 /**
@@ -227,6 +341,15 @@ void View::makeCylinder()
                     (void *)(11 * sizeof(float)) // Start location offset in the buffer
                     );
 
+    // The model matrix of each instance takes four attributes, one per column.  Where they
+    // read from moves around the ring, so they are pointed at it by drawBranchInstances.
+    m_branchRing = new BufferRing(GL_ARRAY_BUFFER, 1024 * sizeof(glm::mat4x4));
+    m_instanceModelAttrib = glGetAttribLocation(m_shader, "instanceModel");
+    for(int column = 0; column < 4; column++){
+        glEnableVertexAttribArray(m_instanceModelAttrib + column);
+        glVertexAttribDivisor(m_instanceModelAttrib + column, 1);
+    }
+
     // Unbind the vertex buffer
     glBindBuffer(GL_ARRAY_BUFFER, 0);
 
@@ -245,6 +368,249 @@ void View::makeCylinder()
     glBindVertexArray(0);
 }
 
+/**
+ * @brief View::drawBranchInstances draws every visible branch as an instance of the cylinder
+ * The matrices are written to the next region of the ring, which the GPU finished reading
+ * frames ago, so nothing waits on the frames still in flight.  Only the clusters that
+ * survived culling are copied.
+ */
+void View::drawBranchInstances()
+{
+    size_t n = m_visible.numBranches + m_visible.numRefBranches;
+    if(n == 0){
+        return;
+    }
+
+    glm::mat4x4 *out = (glm::mat4x4 *)m_branchRing->map(n * sizeof(glm::mat4x4));
+    for(size_t i = 0; i < m_visible.numClusters; i++){
+        const BranchCluster &cluster = m_front.clusters[m_visible.clusters[i]];
+        const glm::mat4x4 *first = &m_front.branchMatrices[cluster.first];
+        out = std::copy(first, first + cluster.count, out);
+    }
+    for(size_t i = 0; i < m_visible.numRefs; i++){
+        const BranchCluster &cluster = m_front.refClusters[m_visible.refs[i]];
+        const glm::mat4x4 *first = &m_front.refBranchMatrices[cluster.first];
+        out = std::copy(first, first + cluster.count, out);
+    }
+    size_t offset = m_branchRing->unmap();
+
+    glBindVertexArray(m_vaoID);
+    glBindBuffer(GL_ARRAY_BUFFER, m_branchRing->buffer());
+    for(int column = 0; column < 4; column++){
+        glVertexAttribPointer(m_instanceModelAttrib + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4x4),
+                              (void *)(offset + column * sizeof(glm::vec4)));
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glUniform1i(m_uniformLocs[UNIFORM_USE_INSTANCING], true);
+    glDrawElementsInstanced(GL_TRIANGLES, m_cylinder.TotalIndex, GL_UNSIGNED_SHORT, (void *)0, (GLsizei)n);
+    glUniform1i(m_uniformLocs[UNIFORM_USE_INSTANCING], false);
+
+    m_branchRing->fence();
+}
+
+/**
+ * @brief View::makeMeshBuffers creates a VAO with empty buffers for a TreeMesh
+ * The vertices are laid out like the cylinder's, so the same shader inputs are used.
+ */
+void View::makeMeshBuffers(GLuint *vao, GLuint *vbo, GLuint *ibo)
+{
+    glGenVertexArrays(1, vao);
+    glBindVertexArray(*vao);
+
+    glGenBuffers(1, vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, *vbo);
+
+    GLint position = glGetAttribLocation(m_shader, "position");
+    GLint normal = glGetAttribLocation(m_shader, "normal");
+    GLint texCoord = glGetAttribLocation(m_shader, "texCoord");
+    GLint tangent = glGetAttribLocation(m_shader, "tangent");
+    GLint bitangent = glGetAttribLocation(m_shader, "bitangent");
+    glEnableVertexAttribArray(position);
+    glEnableVertexAttribArray(normal);
+    glEnableVertexAttribArray(texCoord);
+    glEnableVertexAttribArray(tangent);
+    glEnableVertexAttribArray(bitangent);
+    glVertexAttribPointer(position, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void *)offsetof(MeshVertex, position));
+    glVertexAttribPointer(normal, 3, GL_FLOAT, GL_TRUE, sizeof(MeshVertex), (void *)offsetof(MeshVertex, normal));
+    glVertexAttribPointer(texCoord, 2, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void *)offsetof(MeshVertex, texCoord));
+    glVertexAttribPointer(tangent, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void *)offsetof(MeshVertex, tangent));
+    glVertexAttribPointer(bitangent, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void *)offsetof(MeshVertex, bitangent));
+
+    // The index buffer binding is part of the VAO, so it stays bound
+    glGenBuffers(1, ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, *ibo);
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/**
+ * @brief View::uploadMesh replaces the contents of a mesh's buffers
+ */
+void View::uploadMesh(GLuint vbo, GLuint ibo, const TreeMesh &mesh)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, mesh.vertices().size() * sizeof(MeshVertex),
+                 mesh.vertices().data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh.indices().size() * sizeof(uint32_t),
+                 mesh.indices().data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+/**
+ * @brief View::makeLeafBuffers creates the leaf quad, an empty instance buffer and the leaf texture
+ */
+void View::makeLeafBuffers()
+{
+    glGenVertexArrays(1, &m_leafVAO);
+    glBindVertexArray(m_leafVAO);
+
+    // A triangle strip from the base of the leaf to its tip
+    float quad[] = {-0.5f, 0.0f,
+                     0.5f, 0.0f,
+                    -0.5f, 1.0f,
+                     0.5f, 1.0f};
+    glGenBuffers(1, &m_leafQuadVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, m_leafQuadVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+    GLint corner = glGetAttribLocation(m_leafShader, "corner");
+    glEnableVertexAttribArray(corner);
+    glVertexAttribPointer(corner, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void *)0);
+
+    // The instance attributes advance once per leaf.  Where they point is set by drawLeaves.
+    glGenBuffers(1, &m_leafInstanceVBO);
+    glGenBuffers(1, &m_refLeafInstanceVBO);
+    m_leafPositionAttrib = glGetAttribLocation(m_leafShader, "leafPosition");
+    m_leafOrientationAttrib = glGetAttribLocation(m_leafShader, "leafOrientation");
+    glEnableVertexAttribArray(m_leafPositionAttrib);
+    glEnableVertexAttribArray(m_leafOrientationAttrib);
+    glVertexAttribDivisor(m_leafPositionAttrib, 1);
+    glVertexAttribDivisor(m_leafOrientationAttrib, 1);
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    m_leafTexID = loadTexture(":/textures/leaf.png");
+}
+
+/**
+ * @brief View::appendToBuffer copies what was added to an array since the last call
+ * A buffer too small for the array is reallocated with twice the room and filled again
+ * from the start, so however the array grows each item is copied a bounded number of
+ * times.  The copy goes through GL_COPY_WRITE_BUFFER, which no VAO keeps.
+ */
+void View::appendToBuffer(GLuint buffer, BufferFill *fill, const void *data, size_t count, size_t itemSize)
+{
+    size_t first = std::min(fill->uploaded, count);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    if(count > fill->capacity){
+        fill->capacity = std::max(count, 2 * fill->capacity);
+        glBufferData(GL_COPY_WRITE_BUFFER, fill->capacity * itemSize, 0, GL_STATIC_DRAW);
+        first = 0;
+    }
+    if(count > first){
+        glBufferSubData(GL_COPY_WRITE_BUFFER, first * itemSize, (count - first) * itemSize,
+                        (const char *)data + first * itemSize);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    fill->uploaded = count;
+}
+
+/**
+ * @brief View::appendMesh uploads the trees added to m_front's mesh since the last call
+ */
+void View::appendMesh()
+{
+    const TreeMesh &mesh = m_front.mesh;
+    appendToBuffer(m_meshVBO, &m_meshVertexFill, mesh.vertices().data(),
+                   mesh.vertices().size(), sizeof(MeshVertex));
+    appendToBuffer(m_meshIBO, &m_meshIndexFill, mesh.indices().data(),
+                   mesh.indices().size(), sizeof(uint32_t));
+}
+
+/**
+ * @brief View::appendLeaves uploads the leaves added to a store since the last call
+ * Like appendToBuffer, but for two arrays.  The positions take the first capacity slots
+ * and the orientations the rest, so a reallocation moves the orientations and copies both.
+ */
+void View::appendLeaves(GLuint vbo, BufferFill *fill, const InstanceStore &leaves)
+{
+    size_t n = leaves.size();
+    size_t first = std::min(fill->uploaded, n);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, vbo);
+    if(n > fill->capacity){
+        fill->capacity = std::max(n, 2 * fill->capacity);
+        glBufferData(GL_COPY_WRITE_BUFFER, fill->capacity * (sizeof(glm::vec3) + sizeof(glm::quat)),
+                     0, GL_STATIC_DRAW);
+        first = 0;
+    }
+    if(n > first){
+        glBufferSubData(GL_COPY_WRITE_BUFFER, first * sizeof(glm::vec3),
+                        (n - first) * sizeof(glm::vec3), leaves.positions() + first);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, fill->capacity * sizeof(glm::vec3) + first * sizeof(glm::quat),
+                        (n - first) * sizeof(glm::quat), leaves.orientations() + first);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    fill->uploaded = n;
+}
+
+// The run of a tree's leaves in m_front.leaves, or in refLeaves
+static void treeLeaves(const TreeParts &tree, bool refLeaves, size_t *first, size_t *end)
+{
+    *first = refLeaves ? tree.firstRefLeaf : tree.firstLeaf;
+    *end = *first + (refLeaves ? tree.numRefLeaves : tree.numLeaves);
+}
+
+/**
+ * @brief View::drawLeaves draws the leaves of the visible trees from one of the instance buffers
+ * Each tree's leaves follow each other in the buffer, so they are drawn by pointing the
+ * instance attributes at the first of them.  Visible trees whose leaves follow on from
+ * each other share a call.  m_leafVAO must be bound.
+ */
+void View::drawLeaves(GLuint vbo, const BufferFill &fill, bool refLeaves)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    size_t i = 0;
+    while(i < m_visible.numTrees){
+        size_t first, end;
+        treeLeaves(m_front.trees[m_visible.trees[i++]], refLeaves, &first, &end);
+        for(; i < m_visible.numTrees; i++){
+            size_t nextFirst, nextEnd;
+            treeLeaves(m_front.trees[m_visible.trees[i]], refLeaves, &nextFirst, &nextEnd);
+            if(nextFirst != end){
+                break;
+            }
+            end = nextEnd;
+        }
+        end = std::min(end, fill.uploaded);
+        if(first >= end){
+            continue;
+        }
+
+        // glm keeps a quaternion as x, y, z, w, which is how the shader reads it
+        glVertexAttribPointer(m_leafPositionAttrib, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3),
+                              (void *)(first * sizeof(glm::vec3)));
+        glVertexAttribPointer(m_leafOrientationAttrib, 4, GL_FLOAT, GL_FALSE, sizeof(glm::quat),
+                              (void *)(fill.capacity * sizeof(glm::vec3) + first * sizeof(glm::quat)));
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, (GLsizei)(end - first));
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/**
+ * @brief View::frontReplaced has paintGL upload m_front from the start
+ * The buffers are kept, so a forest no bigger than the last needs no reallocation.
+ */
+void View::frontReplaced()
+{
+    m_meshVertexFill.uploaded = m_meshIndexFill.uploaded = 0;
+    m_leafFill.uploaded = m_refLeafFill.uploaded = 0;
+}
+
 /**
  * @brief View::initCylinder inits the member unit cylinder m_cylinder
  */
@@ -264,26 +630,107 @@ void View::initCylinder()
 
 
 /**
- * @brief View::generateTree uses the member TreeMaker to make a tree
+ * @brief View::waitForCacheWrite waits for m_cacheWriter, if it is saving a forest
  */
-void View::generateTree()
+void View::waitForCacheWrite()
 {
-    m_treemaker.reset(1.0f, m_treeBranches, m_treeLeaves);
-    m_treemaker.makeTree();
+    if(m_cacheWriter.joinable()){
+        m_cacheWriter.join();
+    }
 }
 
 /**
- * @brief View::reloadTree will delete the current tree and generate a new tree
+ * @brief View::generateForest asks for the forest of the current seed
+ * It is built in the background, and the current one is drawn until it is ready.  When
+ * time sliced, the current one is dropped and the new one appears tree by tree instead.
  */
-void View::reloadTree()
+void View::generateForest()
+{
+    const TemplateLibrary *templates = m_useTemplates ? &m_templates : 0;
+
+    // Spread the trees out as far as their species ask
+    std::vector<float> spacings;
+    for(size_t i = 0; i < m_species.size(); i++){
+        spacings.push_back(m_species[i].spacing);
+    }
+    if(spacings.empty()){
+        spacings.push_back(Species().spacing);
+    }
+    m_placement.scatter(FOREST_SIZE, FOREST_SIZE, spacings, m_forestSeed, NUM_TREES);
+    const std::vector<glm::vec2> &sites = m_placement.sites();
+
+    if(m_timeSliced){
+        waitForCacheWrite();
+        m_slicedForest.setTemplates(templates);
+        m_slicedForest.setSpecies(m_species);
+        m_slicedForest.setSites(sites);
+
+        // A forest in the cache is done as soon as it is read
+        ForestCache cache;
+        m_slicedKey = ForestCache::key(NUM_TREES, m_forestSeed, templates, m_species, sites);
+        if(!m_cacheDirectory.empty() &&
+           cache.open(ForestCache::path(m_cacheDirectory, m_slicedKey), m_slicedKey,
+                      templates ? templates->numTemplates() : 0)){
+            m_slicedForest.load(cache);
+            m_slicedNeedsSaving = false;
+        } else {
+            m_slicedForest.begin(NUM_TREES, m_forestSeed);
+            m_slicedNeedsSaving = !m_cacheDirectory.empty();
+        }
+        m_front.clear();
+        m_numTreesShown = 0;
+        frontReplaced();
+    } else {
+        m_worker.request(NUM_TREES, m_forestSeed, templates, m_species, sites);
+    }
+}
+
+/**
+ * @brief View::loadSpecies reads the species file
+ * If the file can't be read or parsed, the species in use are kept.
+ * @return true if the species were replaced
+ */
+bool View::loadSpecies()
 {
-    m_treeBranches->clear();
-    m_treeBranches->clear();
+    // Editors often save by replacing the file, which drops it from the watcher.
+    if(QFile::exists(m_speciesFile) && !m_speciesWatcher.files().contains(m_speciesFile)){
+        m_speciesWatcher.addPath(m_speciesFile);
+    }
 
-    m_treemaker.reset(1.0f, m_treeBranches, m_treeLeaves);
-    for(int i = 0; i < 5; i++){
-        m_treemaker.makeTree();
+    QFile file(m_speciesFile);
+    if(!file.open(QIODevice::ReadOnly | QIODevice::Text)){
+        return false;
     }
+    std::string error;
+    std::vector<Species> species;
+    if(!Species::parse(file.readAll().toStdString(), &species, &error)){
+        std::cerr << m_speciesFile.toStdString() << ": " << error << std::endl;
+        return false;
+    }
+    std::cout << "Loaded " << species.size() << " species from " << m_speciesFile.toStdString() << std::endl;
+    m_species.swap(species);
+    return true;
+}
+
+/**
+ * @brief View::reloadSpecies is called when the species file changes
+ * The worker then only rebuilds the trees whose species changed.
+ */
+void View::reloadSpecies()
+{
+    if(loadSpecies()){
+        generateForest();
+    }
+}
+
+/**
+ * @brief View::reloadTree replaces the current trees with new ones
+ * The current trees stay up until the new ones are swapped in by tick.
+ */
+void View::reloadTree()
+{
+    m_forestSeed++;
+    generateForest();
 }
 
 void View::paintGL()
@@ -300,29 +747,21 @@ void View::paintGL()
     // Use the shader program
     glUseProgram(m_shader);
 
-    // Set up the lighting
-    clearLights();
-
-    // For testing, use a single standard light
-    glm::vec4 lightDirection = glm::normalize(glm::vec4(1.f, -1.f, -1.f, 0.f));
-    CS123SceneLightData light;
-    memset(&light, 0, sizeof(light));
-    light.type = LIGHT_DIRECTIONAL;
-    light.dir = lightDirection;
-    light.color[0] = light.color[1] = light.color[2] = 1;
-    light.id = 0;
-    setLight(light);
+    // The lights only go to the GPU when they have changed
+    if(m_lightsDirty){
+        uploadLights();
+    }
 
     // Set the uniforms
-    glUniform1i(m_uniformLocs["useLighting"], true);
-    glUniform1i(m_uniformLocs["useArrowOffsets"], GL_FALSE);
-    glUniformMatrix4fv(m_uniformLocs["p"], 1, GL_FALSE,
+    glUniform1i(m_uniformLocs[UNIFORM_USE_LIGHTING], true);
+    glUniform1i(m_uniformLocs[UNIFORM_USE_ARROW_OFFSETS], GL_FALSE);
+    glUniformMatrix4fv(m_uniformLocs[UNIFORM_P], 1, GL_FALSE,
             glm::value_ptr(m_camera->getProjectionMatrix()));
-    glUniformMatrix4fv(m_uniformLocs["v"], 1, GL_FALSE,
+    glUniformMatrix4fv(m_uniformLocs[UNIFORM_V], 1, GL_FALSE,
             glm::value_ptr(m_camera->getViewMatrix()));
-    glUniformMatrix4fv(m_uniformLocs["m"], 1, GL_FALSE,
+    glUniformMatrix4fv(m_uniformLocs[UNIFORM_M], 1, GL_FALSE,
             glm::value_ptr(glm::mat4()));
-    glUniform3f(m_uniformLocs["allBlack"], 1, 1, 1);
+    glUniform3f(m_uniformLocs[UNIFORM_ALL_BLACK], 1, 1, 1);
 
     // Apply the default material for an object
     // All are specified in RGB order
@@ -331,98 +770,84 @@ void View::paintGL()
     float specular[3] = {1.0f, 1.0f, 1.0f};
     float shininess = 2.0f;
 
-    glUniform3fv(m_uniformLocs["ambient_color"], 1, ambient);
-    glUniform3fv(m_uniformLocs["diffuse_color"], 1, diffuse);
-    glUniform3fv(m_uniformLocs["specular_color"], 1, specular);
-    glUniform1f(m_uniformLocs["shininess"], shininess);
+    glUniform3fv(m_uniformLocs[UNIFORM_AMBIENT_COLOR], 1, ambient);
+    glUniform3fv(m_uniformLocs[UNIFORM_DIFFUSE_COLOR], 1, diffuse);
+    glUniform3fv(m_uniformLocs[UNIFORM_SPECULAR_COLOR], 1, specular);
+    glUniform1f(m_uniformLocs[UNIFORM_SHININESS], shininess);
 
     // Use textures with no blending of the object color
-    glUniform1i(m_uniformLocs["useTexture"], 1);
-    glUniform1f(m_uniformLocs["blend"], 1.0f);
+    glUniform1i(m_uniformLocs[UNIFORM_USE_TEXTURE], 1);
+    glUniform1f(m_uniformLocs[UNIFORM_BLEND], 1.0f);
 
     // Set up the texture map
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, m_pineTexID);
-    glUniform1i(m_uniformLocs["tex"], 0); // maps with glActiveTexture, so this is GL_TEXTURE0
+    glUniform1i(m_uniformLocs[UNIFORM_TEX], 0); // maps with glActiveTexture, so this is GL_TEXTURE0
 
     // Bind the normal map as well
     glActiveTexture(GL_TEXTURE1);
     glBindTexture(GL_TEXTURE_2D, m_pineNormalMapID);
-    glUniform1i(m_uniformLocs["normalMap"], 1); // maps with glActiveTexture, so this is GL_TEXTURE1
+    glUniform1i(m_uniformLocs[UNIFORM_NORMAL_MAP], 1); // maps with glActiveTexture, so this is GL_TEXTURE1
 
     // Are we using the normal map?
-    glUniform1i(m_uniformLocs["useNormalMap"], m_useNormalMap);
+    glUniform1i(m_uniformLocs[UNIFORM_USE_NORMAL_MAP], m_useNormalMap);
 
     // Reset the active texture to texture 0, just in case
     glActiveTexture(GL_TEXTURE0);
 
-    // Draw the cylinder
-    glBindVertexArray(m_vaoID);
-
-    // Render the entire cylinder at once
-    //glDrawRangeElements(GL_TRIANGLES, m_cylinder.Start_DrawRangeElements, m_cylinder.End_DrawRangeElements,
-        //m_cylinder.TotalIndex, GL_UNSIGNED_SHORT, (void *)0 );
-
-    // Draw the tree
-        for(size_t i = 0; i < m_treeBranches->size(); i++)
+    // Only what was added to m_front since the last frame goes up
+    appendMesh();
+    appendLeaves(m_leafInstanceVBO, &m_leafFill, m_front.leaves);
+    appendLeaves(m_refLeafInstanceVBO, &m_refLeafFill, m_front.refLeaves);
+
+    // Only what the camera can see is drawn
+    Frustum frustum(m_camera->getProjectionMatrix() * m_camera->getViewMatrix());
+    m_front.cull(frustum, &m_visible, &m_cullPool);
+
+    if(m_useMeshes){
+        // The meshes are already in world space, or the template's own frame.  One call
+        // per visible tree.
+        glBindVertexArray(m_meshVAO);
+        glUniformMatrix4fv(m_uniformLocs[UNIFORM_M], 1, GL_FALSE, glm::value_ptr(glm::mat4()));
+        for(size_t i = 0; i < m_visible.numTrees; i++)
         {
-            // Apply the modeling transformation
-            glUniformMatrix4fv(
-                        m_uniformLocs["m"], // Shader variable
-                        1, // Number of matricies
-                        GL_FALSE, //
-                        glm::value_ptr(m_treeBranches->at(i)) // Pointer to the first element
-                    );
-
-            // Draw the cylinder
-            glDrawRangeElements(GL_TRIANGLES, m_cylinder.Start_DrawRangeElements, m_cylinder.End_DrawRangeElements,
-                    m_cylinder.TotalIndex, GL_UNSIGNED_SHORT, (void *)0 );
+            int t = m_visible.trees[i];
+            glDrawElements(GL_TRIANGLES, m_front.mesh.treeIndexCount(t), GL_UNSIGNED_INT,
+                    (void *)(m_front.mesh.treeFirstIndex(t) * sizeof(uint32_t)));
         }
-/*
-
-        float arr = {0.0, 0.0, 0.0,
-                    0.0, 1.0, 0.0,
-                    0.0, 0.0,
-                    0.0, 1.0, 0.0,
-                    0.0, 1.0, 0.0,
-                    0.0, 1.0,
-                    1.0, 0.0, 0.0,
-                    0.0, 1.0, 0.0,
-                    1.0, 0.0,
-                    0.0, 1.0, 0.0,
-                    0.0, 1.0, 0.0,
-                    0.0, 1.0,
-                    1.0, 0.0, 0.0,
-                    0.0, 1.0, 0.0,
-                    1.0, 0.0,
-                    1.0, 1.0, 0.0,
-                    0.0, 1.0, 0.0,
-                    1.0, 1.0};
-
-        for(size_t i = 0; i < m_treeLeaves->size(); i++)
-        {
-            // Apply the modeling transformation
-            glUniformMatrix4fv(
-                        m_uniformLocs["m"],
-                        1,
-                        GL_FALSE,
-                        glm::value_ptr(m_treeLeaves->at(i))
-                        );
-
 
+        // And one per visible templated subtree
+        glBindVertexArray(m_templateVAO);
+        GLint model = m_uniformLocs[UNIFORM_M];
+        for(size_t i = 0; i < m_visible.numRefs; i++)
+        {
+            int r = m_visible.refs[i];
+            int t = m_front.templateRefs[r].templateIndex;
+            glUniformMatrix4fv(model, 1, GL_FALSE, glm::value_ptr(m_front.refMatrices[r]));
+            glDrawElements(GL_TRIANGLES, m_templateMesh.treeIndexCount(t), GL_UNSIGNED_INT,
+                    (void *)(m_templateMesh.treeFirstIndex(t) * sizeof(uint32_t)));
+        }
+    } else {
+        // Every branch is an instance of the cylinder, so all that are visible are one call
+        drawBranchInstances();
+    }
 
-            // Draw the square
-            glDrawRangeElements(GL_TRIANGLES,
-                                0,
-                                48,
-                                2,
-                                GL_UNSIGNED_INT,
+    // The leaves of the visible trees
+    glUseProgram(m_leafShader);
+    glUniformMatrix4fv(m_leafUniformLocs[LEAF_UNIFORM_P], 1, GL_FALSE,
+            glm::value_ptr(m_camera->getProjectionMatrix()));
+    glUniformMatrix4fv(m_leafUniformLocs[LEAF_UNIFORM_V], 1, GL_FALSE,
+            glm::value_ptr(m_camera->getViewMatrix()));
+    glUniform2f(m_leafUniformLocs[LEAF_UNIFORM_LEAF_SIZE], LEAF_WIDTH, LEAF_LENGTH);
+    glUniform3fv(m_leafUniformLocs[LEAF_UNIFORM_AMBIENT_COLOR], 1, ambient);
 
+    glBindTexture(GL_TEXTURE_2D, m_leafTexID);
+    glUniform1i(m_leafUniformLocs[LEAF_UNIFORM_TEX], 0);
 
+    glBindVertexArray(m_leafVAO);
+    drawLeaves(m_leafInstanceVBO, m_leafFill, false);
+    drawLeaves(m_refLeafInstanceVBO, m_refLeafFill, true);
 
-                                (void *)0 );
-        }
-*/
     glBindVertexArray(0);
 
     // Unbind the shader
@@ -435,12 +860,8 @@ void View::paintGL()
  */
 void View::clearLights()
 {
-    for (int i = 0; i < MAX_NUM_LIGHTS; i++) {
-        std::ostringstream os;
-        os << i;
-        std::string indexString = "[" + os.str() + "]"; // e.g. [0], [1], etc.
-        glUniform3f(glGetUniformLocation(m_shader, ("lightColors" + indexString).c_str()), 0, 0, 0);
-    }
+    memset(&m_lights, 0, sizeof(m_lights));
+    m_lightsDirty = true;
 }
 
 /**
@@ -449,45 +870,46 @@ void View::clearLights()
  */
 void View::setLight(const CS123SceneLightData &light)
 {
-    std::ostringstream os;
-    os << light.id;
-    std::string indexString = "[" + os.str() + "]"; // e.g. [0], [1], etc.
-
+    int i = light.id;
     bool ignoreLight = false;
 
-    GLint lightType;
+    GLint lightType = 0;
     switch(light.type)
     {
     case LIGHT_POINT:
         lightType = 0;
-        glUniform3fv(glGetUniformLocation(m_shader, ("lightPositions" + indexString).c_str()), 1,
-                glm::value_ptr(light.pos));
+        m_lights.positions[i] = light.pos;
         break;
     case LIGHT_DIRECTIONAL:
         lightType = 1;
-        glUniform3fv(glGetUniformLocation(m_shader, ("lightDirections" + indexString).c_str()), 1,
-                glm::value_ptr(glm::normalize(light.dir)));
+        m_lights.directions[i] = glm::vec4(glm::normalize(glm::vec3(light.dir)), 0.0f);
         break;
     default:
         ignoreLight = true; // Light type not supported
         break;
     }
 
-    float color[3];
-    color[0] = light.color[0];
-    color[1] = light.color[1];
-    color[2] = light.color[2];
     // Set the light to black if we're ignoring it
+    m_lights.colors[i] = glm::vec4(light.color[0], light.color[1], light.color[2], 0.0f);
     if (ignoreLight)
     {
-        color[0] = color[1] = color[2] = 0.0f;
+        m_lights.colors[i] = glm::vec4(0.0f);
     }
 
-    glUniform1i(glGetUniformLocation(m_shader, ("lightTypes" + indexString).c_str()), lightType);
-    glUniform3fv(glGetUniformLocation(m_shader, ("lightColors" + indexString).c_str()),
-                1, color);
-    glUniform3f(glGetUniformLocation(m_shader, ("lightAttenuations" + indexString).c_str()),
-            light.function.x, light.function.y, light.function.z);
+    m_lights.types[i] = glm::ivec4(lightType, 0, 0, 0);
+    m_lights.attenuations[i] = glm::vec4(light.function, 0.0f);
+    m_lightsDirty = true;
+}
+
+/**
+ * @brief View::uploadLights sends every light to the shaders in one call
+ */
+void View::uploadLights()
+{
+    glBindBuffer(GL_UNIFORM_BUFFER, m_lightUBO);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(LightBlock), &m_lights);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    m_lightsDirty = false;
 }
 
 void View::resizeGL(int w, int h)
@@ -559,6 +981,19 @@ void View::keyPressEvent(QKeyEvent *event)
         // Toggle normal maps
         m_useNormalMap = !m_useNormalMap;
     }
+
+    if(event->key() == Qt::Key_M)
+    {
+        // Toggle between swept meshes and a cylinder per branch
+        m_useMeshes = !m_useMeshes;
+    }
+
+    if(event->key() == Qt::Key_T)
+    {
+        // Toggle subtree templates, which needs the forest to be made again
+        m_useTemplates = !m_useTemplates;
+        generateForest();
+    }
 }
 
 void View::keyReleaseEvent(QKeyEvent *event)
@@ -739,6 +1174,39 @@ void View::tick()
 
     // TODO: Implement the demo update here
 
+    if(m_timeSliced){
+        // Build for a while, showing each tree as it is done.  Adding a tree to m_front
+        // comes out of the same time, so a frame never waits on a whole forest's worth.
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        long long remaining = SLICE_MICROSECONDS;
+        while(remaining > 0 && m_numTreesShown < m_slicedForest.numTrees()){
+            if(m_numTreesShown < m_slicedForest.numFinished()){
+                m_front.append(m_slicedForest, m_numTreesShown++);
+            } else {
+                m_slicedForest.advance((int)remaining);
+            }
+            remaining = SLICE_MICROSECONDS - std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start).count();
+        }
+        if(m_slicedNeedsSaving && m_slicedForest.numFinished() == m_slicedForest.numTrees()){
+            // Writing and evicting would blow the slice, so they go on their own thread
+            std::string directory = m_cacheDirectory;
+            std::string file = ForestCache::path(directory, m_slicedKey);
+            const Forest *forest = &m_slicedForest;
+            uint64_t key = m_slicedKey;
+            m_cacheWriter = std::thread([directory, file, forest, key](){
+                ForestCache::write(file, *forest, key);
+                ForestCache::evict(directory, FOREST_CACHE_MAX_FILES);
+            });
+            m_slicedNeedsSaving = false;
+        }
+    } else {
+        // Swap in a newly generated forest, if there is one
+        if(m_worker.take(m_front)){
+            frontReplaced();
+        }
+    }
+
     // Move the camera
     moveCamera(seconds);
 
@@ -7,6 +7,7 @@
 #include <qgl.h>
 #include <QTime>
 #include <QTimer>
+#include <QFileSystemWatcher>
 
 // GL Helper Library
 //#include <glhlib.h>
@@ -15,8 +16,10 @@
 #include "Common.h"
 #include "camera.h"
 #include "skybox.h"
-#include "treemaker.h"
-#include <deque>
+#include "forestworker.h"
+#include "forestcache.h"
+#include "placement.h"
+#include "bufferring.h"
 
 /*
  * Data for lights in a scene
@@ -46,6 +49,36 @@ struct CS123SceneLightData
    float width, height; // Only applicable to area lights
 };
 
+// The Lights uniform block shared by the shaders, laid out by std140.  Every array element
+// takes 16 bytes there, so each is padded to a vec4.
+struct LightBlock
+{
+    glm::ivec4 types[MAX_NUM_LIGHTS];        // In x, 0 for point and 1 for directional
+    glm::vec4 positions[MAX_NUM_LIGHTS];     // In xyz
+    glm::vec4 directions[MAX_NUM_LIGHTS];    // In xyz
+    glm::vec4 attenuations[MAX_NUM_LIGHTS];  // Constant, linear, and quadratic term
+    glm::vec4 colors[MAX_NUM_LIGHTS];        // In xyz
+};
+
+// The uniform buffer binding the Lights block is read from
+#define LIGHT_BLOCK_BINDING 0
+
+// The uniforms of the main shader, in the order of UNIFORM_NAMES in view.cpp
+enum Uniform {
+    UNIFORM_P, UNIFORM_V, UNIFORM_M, UNIFORM_ALL_BLACK, UNIFORM_USE_LIGHTING,
+    UNIFORM_AMBIENT_COLOR, UNIFORM_DIFFUSE_COLOR, UNIFORM_SPECULAR_COLOR, UNIFORM_SHININESS,
+    UNIFORM_USE_TEXTURE, UNIFORM_TEX, UNIFORM_NORMAL_MAP, UNIFORM_USE_ARROW_OFFSETS,
+    UNIFORM_BLEND, UNIFORM_USE_NORMAL_MAP, UNIFORM_USE_INSTANCING,
+    NUM_UNIFORMS
+};
+
+// The uniforms of the leaf shader, in the order of LEAF_UNIFORM_NAMES in view.cpp
+enum LeafUniform {
+    LEAF_UNIFORM_P, LEAF_UNIFORM_V, LEAF_UNIFORM_LEAF_SIZE, LEAF_UNIFORM_AMBIENT_COLOR,
+    LEAF_UNIFORM_TEX,
+    NUM_LEAF_UNIFORMS
+};
+
 class View : public QGLWidget
 {
     Q_OBJECT
@@ -80,6 +113,57 @@ private:
     glhCylinderObjectf2 m_cylinder;
     void initCylinder();
 
+    // The model matrix of every visible branch, the trees' and then the templated subtrees',
+    // is streamed through a ring each frame and drawn as instances of the cylinder in one call.
+    BufferRing *m_branchRing;
+    GLint m_instanceModelAttrib;
+    void drawBranchInstances();
+
+    // Swept tree meshes.  When set, each tree's branches are one draw call, and each
+    // template reference another.  Otherwise every branch is an instance of the cylinder.
+    bool m_useMeshes;
+    // The forest's mesh
+    GLuint m_meshVAO, m_meshVBO, m_meshIBO;
+    // Every template as one tree of its own mesh
+    TreeMesh m_templateMesh;
+    GLuint m_templateVAO, m_templateVBO, m_templateIBO;
+    void makeMeshBuffers(GLuint *vao, GLuint *vbo, GLuint *ibo);
+    void uploadMesh(GLuint vbo, GLuint ibo, const TreeMesh &mesh);
+
+    // How much of one of m_front's arrays is in its buffer, and how much the buffer holds.
+    // m_front only ever grows until it is replaced, so paintGL uploads just what was
+    // appended past uploaded.
+    struct BufferFill
+    {
+        size_t uploaded;
+        size_t capacity;
+    };
+    BufferFill m_meshVertexFill, m_meshIndexFill;
+    static void appendToBuffer(GLuint buffer, BufferFill *fill, const void *data, size_t count, size_t itemSize);
+    void appendMesh();
+
+    // Every leaf is the same textured quad, drawn instanced, for the visible trees' own
+    // leaves and then their templated ones.  Each instance buffer holds room for
+    // capacity positions and then capacity orientations.
+    GLuint m_leafShader;
+    GLint m_leafUniformLocs[NUM_LEAF_UNIFORMS];
+    GLuint m_leafVAO, m_leafQuadVBO, m_leafInstanceVBO, m_refLeafInstanceVBO;
+    GLint m_leafPositionAttrib, m_leafOrientationAttrib;
+    BufferFill m_leafFill, m_refLeafFill;
+    GLuint m_leafTexID;
+    void makeLeafBuffers();
+    void appendLeaves(GLuint vbo, BufferFill *fill, const InstanceStore &leaves);
+    void drawLeaves(GLuint vbo, const BufferFill &fill, bool refLeaves);
+
+    // Marks none of m_front as uploaded, for when it is replaced instead of added to
+    void frontReplaced();
+
+    // What of m_front is inside the camera's frustum, found at the start of each frame,
+    // on the threads of m_cullPool once the forest is big enough.  The pool's threads
+    // are kept from frame to frame.
+    VisibleSet m_visible;
+    WorkerPool m_cullPool;
+
     // Camera movement
     void moveCamera(const float &seconds);
     void translateCamera(const float &seconds);
@@ -91,9 +175,15 @@ private:
     bool look_flag;
     float theta;
 
-    // Lighting functions
+    // Lighting functions.  These only change m_lights, which paintGL uploads to
+    // m_lightUBO when m_lightsDirty is set.
     void clearLights();
     void setLight(const CS123SceneLightData &light);
+    void uploadLights();
+
+    LightBlock m_lights;
+    GLuint m_lightUBO;
+    bool m_lightsDirty;
 
     // Texture loader
     GLuint loadTexture(std::string filename);
@@ -114,8 +204,8 @@ private:
     // The program ID of the OpenGL shader
     GLuint m_shader;
 
-    // A mapping of strings to their associated uniform locations in the shader
-    std::map<std::string, GLint> m_uniformLocs;
+    // The location of each uniform in the shader, found once it is linked
+    GLint m_uniformLocs[NUM_UNIFORMS];
 
     // A mapping of Qt keys and if they are pressed or not
     std::map<int, bool> m_keys;
@@ -124,15 +214,47 @@ private:
     Skybox *m_skybox;
 
     // For the tree maker
-    std::deque<glm::mat4x4> *m_treeBranches;
-    std::deque<glm::mat4x4> *m_treeLeaves;
-    TreeMaker m_treemaker;
-
-    void generateTree();
+    uint64_t m_forestSeed;
+
+    // When set, the last iterations of every tree are drawn from a few shared templates
+    bool m_useTemplates;
+    TemplateLibrary m_templates;
+
+    // The forest being drawn.  New ones are built by m_worker and swapped in by tick.
+    ForestBuffers m_front;
+    ForestWorker m_worker;
+
+    // With no core to spare for the worker, forests are built by tick a slice per frame
+    // instead, and each tree is shown as soon as it is done.
+    bool m_timeSliced;
+    Forest m_slicedForest;
+    int m_numTreesShown;
+
+    // Where built forests are saved, so that any forest seen before starts at once.  A
+    // time sliced forest that wasn't in the cache is saved when it is done, on
+    // m_cacheWriter so the frame doesn't wait on the disk.  m_slicedForest is only read
+    // while it runs, and nothing changes it before waitForCacheWrite.
+    std::string m_cacheDirectory;
+    uint64_t m_slicedKey;
+    bool m_slicedNeedsSaving;
+    std::thread m_cacheWriter;
+    void waitForCacheWrite();
+
+    // Where the trees of the current seed stand
+    Placement m_placement;
+
+    // Species the trees are grown from, read from m_speciesFile.  Empty for the built in one.
+    std::vector<Species> m_species;
+    QString m_speciesFile;
+    QFileSystemWatcher m_speciesWatcher;
+    bool loadSpecies();
+
+    void generateForest();
     void reloadTree();
 
 private slots:
     void tick();
+    void reloadSpecies();
 };
 
 #endif // VIEW_H